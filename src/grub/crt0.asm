@@ -25,11 +25,253 @@ stack_bottom:
     resb STACK_SIZE
 stack_top:
 
+%ifdef ARCH_X86_64
+; Keep in sync with KERNEL_VIRTUAL_BASE (src/klib/util.hh, ldconfig64.ld)
+KERNEL_VIRTUAL_BASE EQU 0xFFFFFFFF80000000
+
+PAGE_PW EQU 0x3
+PDE_LARGE EQU 0x83 ; Present, writable, 2 MiB page
+
+CPUID_LONG_MODE EQU 1 << 29
+CR4_PAE EQU 0x20
+MSR_EFER EQU 0xC0000080
+EFER_LME EQU 1 << 8
+
+section .data
+align 4096
+; Long mode boot tables. A single page directory of 2 MiB pages maps the first GiB of
+; physical memory twice: identity mapped, so the code switching modes keeps running,
+; and at KERNEL_VIRTUAL_BASE (PML4 entry 511, PDPT entry 510). setup_pagedir() later
+; switches to kernel_pagedir, which drops the identity map.
+boot_pml4:
+    dq boot_pdpt_low - KERNEL_VIRTUAL_BASE + PAGE_PW
+    times 510 dq 0
+    dq boot_pdpt_high - KERNEL_VIRTUAL_BASE + PAGE_PW
+boot_pdpt_low:
+    dq boot_pd - KERNEL_VIRTUAL_BASE + PAGE_PW
+    times 511 dq 0
+boot_pdpt_high:
+    times 510 dq 0
+    dq boot_pd - KERNEL_VIRTUAL_BASE + PAGE_PW
+    dq 0
+boot_pd:
+%assign i 0
+%rep 512
+    dq (i << 21) | PDE_LARGE
+%assign i i + 1
+%endrep
+
+; Same layout as the 32-bit GDT (code at 0x10, data at 0x18), but with a long mode code segment
+align 8
+gdt:
+    dq 0
+    dq 0
+    dq 0x00AF9A000000FFFF ; 0x10: code, ring 0, 64-bit
+    dq 0x00CF92000000FFFF ; 0x18: data, ring 0
+gdt_end:
+
+; Loaded before paging, so it holds the GDT's physical address
+gdtr_boot:
+    dw gdt_end - gdt - 1
+    dq gdt - KERNEL_VIRTUAL_BASE
+
+gdtr:
+    dw gdt_end - gdt - 1
+    dq gdt
+
+section .boot.text progbits alloc exec nowrite align=16
+global _start
+_start:
+    ; Paging is off, so only physical addresses work until the jump to higher_half.
+    ; eax and ebx hold the multiboot magic and info; cpuid clobbers both.
+    mov esi, eax
+    mov edi, ebx
+    mov eax, 0x80000000
+    cpuid
+    cmp eax, 0x80000001
+    jb .no_long_mode
+    mov eax, 0x80000001
+    cpuid
+    test edx, CPUID_LONG_MODE
+    jz .no_long_mode
+
+    mov eax, cr4
+    or eax, CR4_PAE
+    mov cr4, eax
+    mov eax, boot_pml4 - KERNEL_VIRTUAL_BASE
+    mov cr3, eax
+    mov ecx, MSR_EFER
+    rdmsr
+    or eax, EFER_LME
+    wrmsr
+    mov eax, cr0
+    or eax, 0x80000000 ; PG, which activates long mode
+    mov cr0, eax
+    lgdt [gdtr_boot - KERNEL_VIRTUAL_BASE]
+    jmp 0x10:long_mode
+
+.no_long_mode:
+    cli
+    hlt
+    jmp .no_long_mode
+
+[bits 64]
+long_mode:
+    mov rax, higher_half
+    jmp rax
+
 section .text
+higher_half:
+    lgdt [gdtr]
+    mov cx, 0x18
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+    mov ss, cx
+    mov rsp, stack_top
+    ; kernel_main(magic, multiboot_info) in rdi and rsi, System V style. _init may
+    ; clobber those, so keep the arguments in callee-saved registers until then.
+    ; The info structure is in low memory, so it is in the direct map.
+    mov r12d, esi
+    mov r13d, edi
+    mov rax, KERNEL_VIRTUAL_BASE
+    add r13, rax
+    call _init
+    mov edi, r12d
+    mov rsi, r13
+    call kernel_main
+    call _fini
+    cli
+    hlt_forever:
+    hlt
+    jmp hlt_forever
+%else
+; Keep in sync with KERNEL_VIRTUAL_BASE (src/klib/util.hh, ldconfig.ld)
+; and kernel::DIRECT_MAP_END (src/kernel/kernel.hh)
+KERNEL_VIRTUAL_BASE EQU 0xC0000000
+DIRECT_MAP_END EQU 0xF0000000
+KERNEL_PDE_INDEX EQU KERNEL_VIRTUAL_BASE >> 22
+DIRECT_MAP_PDES EQU (DIRECT_MAP_END - KERNEL_VIRTUAL_BASE) >> 22
+DIRECT_MAP_PAE_PDES EQU (DIRECT_MAP_END - KERNEL_VIRTUAL_BASE) >> 21
+
+PDE_LARGE EQU 0x83 ; Present, writable, 4 MiB page (2 MiB with PAE)
+
+CPUID_PAE EQU 1 << 6
+CR4_PSE EQU 0x10
+CR4_PAE EQU 0x20
+
+section .data
+align 4096
+; Boot page directory, all 4 MiB pages. The first 4 MiB are identity mapped so that
+; the code enabling paging keeps running, and physical memory is mapped linearly from
+; KERNEL_VIRTUAL_BASE. setup_pagedir() later switches to kernel_pagedir, which drops the
+; identity map.
+boot_pagedir:
+    dd PDE_LARGE
+    times KERNEL_PDE_INDEX - 1 dd 0
+%assign i 0
+%rep DIRECT_MAP_PDES
+    dd (i << 22) | PDE_LARGE
+%assign i i + 1
+%endrep
+    times 1024 - KERNEL_PDE_INDEX - DIRECT_MAP_PDES dd 0
+
+; The same boot mappings for PAE, with 2 MiB pages. Entries are 64 bits, written as two
+; dwords. KERNEL_VIRTUAL_BASE is exactly the fourth gigabyte, so the whole direct map
+; lives in the last page directory.
+align 4096
+boot_pae_pd_low:
+    dd PDE_LARGE, 0
+    times 511 dq 0
+boot_pae_pd_high:
+%assign i 0
+%rep DIRECT_MAP_PAE_PDES
+    dd (i << 21) | PDE_LARGE, 0
+%assign i i + 1
+%endrep
+    times 512 - DIRECT_MAP_PAE_PDES dq 0
+
+; Page directory pointer table entries may only have P set
+align 32
+boot_pdpt:
+    dd boot_pae_pd_low - KERNEL_VIRTUAL_BASE + 1, 0
+    dq 0
+    dq 0
+    dd boot_pae_pd_high - KERNEL_VIRTUAL_BASE + 1, 0
+
+; Read by pagetables::pae_enabled()
+global boot_pae_enabled
+boot_pae_enabled:
+    db 0
+
+; Flat 4 GiB segments, laid out like GRUB's (code at 0x10, data at 0x18; see
+; kernel::KERNEL_CS_SEG_START). GRUB's own GDT sits in low memory, which is
+; unmapped once we switch to kernel_pagedir, so it can't be kept.
+align 8
+gdt:
+    dq 0
+    dq 0
+    dq 0x00CF9A000000FFFF ; 0x10: code, ring 0
+    dq 0x00CF92000000FFFF ; 0x18: data, ring 0
+gdt_end:
+
+gdtr:
+    dw gdt_end - gdt - 1
+    dd gdt
+
+section .boot.text progbits alloc exec nowrite align=16
 global _start
 _start:
+    ; Paging is off, so only physical addresses work until the jump below.
+    ; eax and ebx hold the multiboot magic and info; cpuid clobbers both.
+    mov esi, eax
+    mov edi, ebx
+    mov eax, 1
+    cpuid
+    test edx, CPUID_PAE
+    jz .no_pae
+    mov ecx, cr4
+    or ecx, CR4_PAE
+    mov cr4, ecx
+    mov ecx, boot_pdpt - KERNEL_VIRTUAL_BASE
+    mov cr3, ecx
+    mov byte [boot_pae_enabled - KERNEL_VIRTUAL_BASE], 1
+    jmp .enable_paging
+.no_pae:
+    mov ecx, cr4
+    or ecx, CR4_PSE
+    mov cr4, ecx
+    mov ecx, boot_pagedir - KERNEL_VIRTUAL_BASE
+    mov cr3, ecx
+.enable_paging:
+    mov eax, esi
+    mov ebx, edi
+    mov ecx, cr0
+    or ecx, 0x80000000 ; PG
+    mov cr0, ecx
+    mov ecx, higher_half
+    jmp ecx
+
+section .text
+higher_half:
     mov esp, stack_top
     cli
+    lgdt [gdtr]
+    jmp 0x10:reload_segments
+reload_segments:
+    mov cx, 0x18
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+    mov ss, cx
+    ; The info structure is in low memory, so it is in the direct map
+    add ebx, KERNEL_VIRTUAL_BASE
+    ; kernel_main(magic, multiboot_info): pushed before _init so the
+    ; global constructors cannot clobber them
+    push ebx
+    push eax
     call _init
     call kernel_main
     call _fini
@@ -37,4 +279,4 @@ _start:
     hlt_forever:
     hlt
     jmp hlt_forever
-
+%endif
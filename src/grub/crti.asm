@@ -1,3 +1,19 @@
+%ifdef ARCH_X86_64
+[bits 64]
+SECTION .init
+global _init
+_init:
+    push rbp
+    mov rbp, rsp
+    ; gcc will put crtbegin.o's .init contents here
+
+SECTION .fini
+global _fini
+_fini:
+    push rbp
+    mov rbp, rsp
+    ; gcc will put crtbegin.o's .fini contents here
+%else
 SECTION .init
 global _init
 _init:
@@ -11,3 +27,4 @@ _fini:
     push ebp
     mov ebp, esp
     ; gcc will put crtbegin.o's .fini contents here
+%endif
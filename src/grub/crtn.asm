@@ -1,3 +1,15 @@
+%ifdef ARCH_X86_64
+[bits 64]
+SECTION .init
+    ; GCC will put crtend.o's .fini section content here
+    pop rbp
+    ret
+
+SECTION .fini
+    ; GCC will put crtend.o's .fini section content here
+    pop rbp
+    ret
+%else
 SECTION .init
     ; GCC will put crtend.o's .fini section content here
     pop ebp
@@ -7,3 +19,4 @@ SECTION .fini
     ; GCC will put crtend.o's .fini section content here
     pop ebp
     ret
+%endif
@@ -1,221 +1,603 @@
 #include "kernel/alloc.hh"
+#include "kernel/compaction.hh"
 #include "kernel/kernel.hh"
+#include "kernel/shrinker.hh"
 #include "klib/int.hh"
 #include "klib/array.hh"
 #include "klib/result.hh"
 #include "klib/pagetables.hh"
 #include "klib/concepts.hh"
 #include "klib/assert.hh"
-#include "klib/console.hh"
+#include "klib/util.hh"
+#include "klib/x86.hh"
 
 using namespace wlib::alloc;
+using namespace kernel;
 
 BuddyAllocator simple_allocator;
 
-// The buddy allocator should begin in the following state:
-// All lists have no head (i.e. they are "none")
-// ... Except for the last list, which points to block 0
-// All blocks, even the first, should point nowhere (next and prev are none)
-BuddyAllocator::BuddyAllocator() {
-    for (auto& list : free_lists) {
-        list.become_none();
+// init: The allocator starts out with no blocks at all (see the constexpr constructor).
+// We first find the highest available address to size the metadata, then place the 
+// metadata (the blocks, then the pageblock types) right after the kernel image.
+// Every available page frame above the metadata is then freed into the lists, in the
+// largest naturally-aligned blocks that fit.
+// Holes and reserved regions are never freed, so they can never be allocated or coalesced.
+void BuddyAllocator::init(multiboot::Info const& info) {
+    assert(num_blocks == 0, "BuddyAllocator initialized twice");
+    assert(info.has(multiboot::InfoFlag::MemoryMap), "Bootloader did not provide a memory map");
+
+    u64 highest = 0;
+    info.for_each_available([&](u64 const base, u64 const length) {
+        highest = util::max(highest, base + length);
+    });
+
+    highest = util::min(highest, u64(HIGHEST_ADDRESS));
+    num_blocks = u32(highest / PAGESIZE);
+
+    // Physical addresses, like the memory map
+    auto const metadata_start = util::kernel_to_physical_addr(
+        (uptr(kernel_end) + PAGESIZE - 1) & ~uptr(PAGESIZE - 1));
+    auto const num_pageblocks = (num_blocks + (1_u32 << PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER;
+    auto const metadata_end = (metadata_start + num_blocks * sizeof(block) + num_pageblocks
+                               + PAGESIZE - 1) & ~uptr(PAGESIZE - 1);
+
+    auto metadata_fits = false;
+    info.for_each_available([&](u64 const base, u64 const length) {
+        metadata_fits |= base <= metadata_start && metadata_end <= base + length;
+    });
+
+    assert(metadata_fits, "No room for allocator metadata after the kernel image");
+
+    blocks = reinterpret_cast<block*>(util::physical_addr_to_kernel(metadata_start));
+
+    // All zeroes: not free, order 0, no owner. Links are only read while a block is free.
+    util::memset<u8>(blocks, 0_u8, num_blocks * sizeof(block));
+
+    pageblock_types = reinterpret_cast<Mobility*>(blocks + num_blocks);
+    util::memset<u8>(pageblock_types, u8(Mobility::Movable), num_pageblocks);
+    pageblock_counts[u8(Mobility::Movable)] = num_pageblocks;
+
+    for (auto& lists : free_lists) {
+        for (auto& list : lists) {
+            list.become_none();
+        }
     }
 
-    free_lists.last() = 0;
+    // Everything below metadata_end is either low memory, the kernel image or the metadata.
+    auto const reserved_end = util::max(metadata_end, uptr(LOW_MEMORY_END));
 
-    for (auto& block : blocks) {
-        block.next.become_none();
-        block.prev.become_none();
-        block.set_free();
-    }
+    info.for_each_available([&](u64 const base, u64 const length) {
+        free_range(util::max(base, u64(reserved_end)), util::min(base + length, highest));
+    });
+
+    // Building the lists is not allocator activity
+    counters = Stats {};
 }
 
 // kalloc: If size is less than the minimum block size, round up to the minimum size.
-// Otherwise, keep it the same.
 // Find what list index this corresponds to, and check if this is too large (if so, return null)
-// Check this list. If it has a block, just return that block.
-// If not, then we need to loop until we find the first list above that list index that has a block.
-// Once we do, we need to continually split this block until we split to the size we want.
-// Finally, return the block.
-// If we don't find a block of an appropriate size at all, return null.
-[[nodiscard]] auto BuddyAllocator::kalloc(usize const size) -> Nullable<uptr, 0> {
+// Have find_block take a big enough block off the lists. If there is none, ask the shrinkers
+// for that many pages and look again. Failing that, enough memory may well be free, just not
+// in one piece, so have compaction make a block of that size. If there still isn't one, return null.
+// Otherwise keep splitting off the block's upper half until it is the size we want.
+[[nodiscard]] auto BuddyAllocator::kalloc(usize const size,
+                                          Mobility const mobility) -> Nullable<uptr, 0> {
     auto const adjusted_size = size < (1 << SMALLEST_BLOCK_SIZE) ?
                                1 << SMALLEST_BLOCK_SIZE :
                                size;
 
-    terminal.print_debug("Adjusted size: ", usize(adjusted_size));
-    terminal.print_debug("Rounded up: ", round_up_pow2(adjusted_size));
+    auto const list_idx = u8(log2(round_up_pow2(adjusted_size)) - SMALLEST_BLOCK_SIZE);
+
+    if (list_idx >= NUM_LISTS) [[unlikely]] {
+        ++counters.failed;
+        return Nullable<uptr, 0>();
+    }
 
-    auto const list_idx = log2(round_up_pow2(adjusted_size)) - SMALLEST_BLOCK_SIZE;
-    terminal.print_debug("List index: ", i8(list_idx));
+    auto found = find_block(list_idx, mobility);
 
-    if (list_idx >= NUM_BLOCKS) [[unlikely]] {
+    if (found.none()) [[unlikely]] {
+        // Slow path: have the caches give memory back, then look again
+        shrink_caches(1_u32 << list_idx);
+        found = find_block(list_idx, mobility);
+    }
+
+    if (found.none() && list_idx > 0 && compact_memory(list_idx)) [[unlikely]] {
+        found = find_block(list_idx, mobility);
+    }
+
+    if (found.none()) [[unlikely]] {
+        ++counters.failed;
         return Nullable<uptr, 0>();
     }
 
-    auto const head_idx = pop_free_list(list_idx);
+    auto const head_idx = found.unwrap();
+    auto const order = blocks[head_idx].order();
 
-    if (head_idx.some()) {
-        terminal.print_debug("Head is some 1");
-        return index_to_addr(head_idx.unwrap());
+    // split the block into a suitable size.
+    // The upper half of a block of order j is 2^(j - 1) blocks past its head.
+    for (auto j = order; j > list_idx; --j) {
+        push_free_list(j - 1, head_idx + (1_u32 << (j - 1)));
     }
 
-    for (i8 i = list_idx + 1; i < NUM_LISTS; ++i) {
-        auto const head = pop_free_list(i);
+    blocks[head_idx].set_order(list_idx);
+    blocks[head_idx].mobility = mobility;
 
-        if (head.none()) {
-            terminal.print_debug("Head is none");
-            continue;
+    ++counters.allocs[list_idx];
+    counters.splits += order - list_idx;
+    counters.pages_in_use += 1_u32 << list_idx;
+    counters.high_water = util::max(counters.high_water, counters.pages_in_use);
+
+    return index_to_addr(head_idx);
+}
+
+// find_block: Mask off every order below [order] in the nonempty_orders of [mobility]; the
+// lowest set bit left is the smallest order with a free block. Without one, fall back to the
+// *largest* free block of the other kind: stealing big blocks means a few pageblocks change
+// hands for good, rather than small allocations getting sprinkled over many of them.
+// The pageblocks the allocation will occupy become ours. So does the rest of the pageblock of
+// a stolen block of at least half a pageblock, so that it serves the same kind of allocation.
+// Whatever kalloc splits off beyond that goes back to the lists of its own pageblocks.
+auto BuddyAllocator::find_block(u8 const order, Mobility const mobility) -> Nullable<u32, NULL_BLOCK> {
+    auto const mask = ~0_u32 << order;
+    auto const candidates = nonempty_orders[u8(mobility)] & mask;
+    auto const claimed = util::max(order, PAGEBLOCK_ORDER);
+
+    if (candidates != 0) [[likely]] {
+        // Without BMI1, tzcnt executes as bsf, which is undefined for zero; ruled out above
+        auto const found = u8(x86::tzcnt_32(candidates));
+        auto const block_idx = pop_free_list(mobility, found).unwrap();
+
+        if (found >= PAGEBLOCK_ORDER) {
+            // May have coalesced with pageblocks of the other kind
+            claim_pageblocks(block_idx, claimed, mobility);
         }
 
-        auto const head_addr = index_to_addr(head.unwrap());
+        return block_idx;
+    }
 
-        terminal.print_debug("List index is ", i8(list_idx));
+    for (u8 m = 0; m < NUM_MOBILITIES; ++m) {
+        auto const other = nonempty_orders[m] & mask;
 
-        // split the block into a suitable size
-        for (auto j = i; j > list_idx; --j) {
-            // we find the "middle address" by taking the head address and adding 2^(x - 1)
-            // where x is the "order" of the block. e.g. a block at 0x0000 of order of 13 has
-            // its middle address at 0x1000, since 2^13 = 0x2000.
-            auto const middle_offset = (1 << ((j - 1) + SMALLEST_BLOCK_SIZE));
-            auto const middle_addr = head_addr + middle_offset;
-            auto const maybe_middle_idx = addr_to_index(middle_addr);
+        if (m == u8(mobility) || other == 0) {
+            continue;
+        }
 
-            if (maybe_middle_idx.some()) {
-                auto const middle_idx = maybe_middle_idx.unwrap();
-                push_free_list(j - 1, middle_idx);
-            }
+        auto const found = log2(other);
+        auto const block_idx = pop_free_list(Mobility(m), found).unwrap();
+
+        if (found >= PAGEBLOCK_ORDER) {
+            claim_pageblocks(block_idx, claimed, mobility);
+        } else if (found >= PAGEBLOCK_ORDER / 2) {
+            claim_pageblocks(block_idx, found, mobility);
         }
 
-        blocks[head.unwrap()].set_order(list_idx);
-        blocks[head.unwrap()].clear_free();
-        
-        return {head_addr};
+        ++counters.fallbacks;
+        return block_idx;
     }
 
-    return Nullable<uptr, 0>();
+    return NULL_BLOCK;
 }
 
-// kfree: Check invariants, find block from the index
-// While its buddy is free, we need to coalesce with the buddy, removing the buddy from the list at every step
-// Finally, we put the block in the new list.
+void BuddyAllocator::claim_pageblocks(u32 const block_idx, u8 const order, Mobility const mobility) {
+    auto const first = block_idx >> PAGEBLOCK_ORDER;
+    auto const last = (block_idx + (1_u32 << order) - 1) >> PAGEBLOCK_ORDER;
+
+    for (auto pageblock = first; pageblock <= last; ++pageblock) {
+        auto& type = pageblock_types[pageblock];
+
+        if (type == mobility) {
+            continue;
+        }
+
+        --pageblock_counts[u8(type)];
+        ++pageblock_counts[u8(mobility)];
+        type = mobility;
+
+        if (order >= PAGEBLOCK_ORDER) {
+            // The block covers the whole pageblock (the caller holds it), so nothing else is in it
+            continue;
+        }
+
+        // Only the head of a free block is marked free, so walking page by page finds each
+        // once. Free blocks this small never straddle a pageblock boundary.
+        auto idx = pageblock << PAGEBLOCK_ORDER;
+        auto const end = util::min(idx + (1_u32 << PAGEBLOCK_ORDER), num_blocks);
+
+        while (idx < end) {
+            if (!blocks[idx].is_free()) {
+                ++idx;
+                continue;
+            }
+
+            auto const free_order = blocks[idx].order();
+            remove_from_list(idx);
+            push_free_list(free_order, idx);
+            idx += 1_u32 << free_order;
+        }
+    }
+}
+
+// kfree: Check invariants, find block from the index, then hand it to free_block.
 void BuddyAllocator::kfree(uptr const ptr) {
-    assert(ptr % (1 << SMALLEST_BLOCK_SIZE) == 0 &&
-           ptr >= BLOCK_OFFSET, "Attempted to free a wild pointer");
+    assert(ptr % (1 << SMALLEST_BLOCK_SIZE) == 0, "Attempted to free a wild pointer");
     
-    auto block_idx = addr_to_index(ptr).unwrap();
-    auto& block = blocks[block_idx];
+    auto const maybe_idx = addr_to_index(ptr);
 
-    assert(!block.is_free(), "Attempted to free an already-freed block");
-    
-    auto new_list_idx = block.order();
+    assert(maybe_idx.some(), "Attempted to free a wild pointer");
 
-    // Coalesce with its buddy until we can't anymore
-    while (buddy_is_free(block_idx)) {
-        auto const buddy_idx = buddy_index(block_idx);
-        // terminal.print_debug(buddy_idx);
+    auto const block_idx = maybe_idx.unwrap();
+
+    assert(!blocks[block_idx].is_free(), "Attempted to free an already-freed block");
+
+    if (blocks[block_idx].extra_refs > 0) {
+        // Still mapped somewhere else
+        --blocks[block_idx].extra_refs;
+        return;
+    }
+
+    auto const order = blocks[block_idx].order();
 
-        if (buddy_idx > blocks.len()) {
+    ++counters.frees[order];
+    counters.pages_in_use -= 1_u32 << order;
+
+    free_block(block_idx, order);
+}
+
+// free_block: While its buddy is free (and whole, i.e. of the same order), we coalesce with
+// the buddy, removing the buddy from its list at every step. Both conditions are a single
+// compare against the buddy's order_and_free. The merged block starts at the lower of the
+// two indices, which is just the two ANDed together since they differ in one bit.
+// Finally, we put the block in the new list.
+void BuddyAllocator::free_block(u32 block_idx, u8 order) {
+    // Whoever it was is gone, and compaction must not mistake it for a mapped page
+    blocks[block_idx].owner = nullptr;
+
+    for (; order + 1 < NUM_LISTS; ++order) {
+        auto const buddy_idx = block_idx ^ (1_u32 << order);
+
+        if (buddy_idx >= num_blocks || blocks[buddy_idx].order_and_free != free_tag(order)) {
             break;
         }
 
         remove_from_list(buddy_idx);
-        ++new_list_idx;
-        block_idx = block_idx > buddy_idx ? buddy_idx : block_idx;
-        blocks[block_idx].set_order(new_list_idx);
+        block_idx &= buddy_idx;
+        ++counters.coalesces;
     }
-    
-    // insert original block into the new list
-    push_free_list(new_list_idx, block_idx);
+
+    push_free_list(order, block_idx);
+}
+
+void BuddyAllocator::free_range(u64 const start, u64 const end) {
+    if (start >= end) {
+        return;
+    }
+
+    auto idx = u32((start + PAGESIZE - 1) / PAGESIZE);
+    auto const end_idx = u32(end / PAGESIZE);
+
+    while (idx < end_idx) {
+        // Find the largest block that is naturally aligned at idx and still fits
+        u8 order = 0;
+        while (order + 1 < NUM_LISTS && 
+               (idx & ((2_u32 << order) - 1)) == 0 &&
+               idx + (2_u32 << order) <= end_idx) {
+            ++order;
+        }
+
+        free_block(idx, order);
+        idx += 1_u32 << order;
+    }
+}
+
+void BuddyAllocator::set_owner(uptr const addr, void* const owner) {
+    auto const maybe_idx = addr_to_index(addr);
+    assert(maybe_idx.some(), "Attempted to set the owner of a wild pointer");
+    blocks[maybe_idx.unwrap()].owner = owner;
+}
+
+auto BuddyAllocator::owner(uptr const addr) const -> void* {
+    auto const idx = u32(util::kernel_to_physical_addr(addr) / PAGESIZE);
+    assert(idx < num_blocks, "Attempted to get the owner of a wild pointer");
+    return blocks[idx].owner;
+}
+
+void BuddyAllocator::add_ref(uptr const addr) {
+    auto const maybe_idx = addr_to_index(addr);
+    assert(maybe_idx.some(), "Attempted to share a wild pointer");
+
+    auto& block = blocks[maybe_idx.unwrap()];
+    assert(!block.is_free() && block.order() == 0, "Only allocated single pages can be shared");
+    assert(block.extra_refs < 0xFFFF, "Too many references to one page");
+
+    ++block.extra_refs;
+}
+
+auto BuddyAllocator::ref_count(uptr const addr) const -> u32 {
+    auto const idx = u32(util::kernel_to_physical_addr(addr) / PAGESIZE);
+    assert(idx < num_blocks, "Attempted to get the references of a wild pointer");
+    return blocks[idx].extra_refs + 1_u32;
+}
+
+// compact: First take all of the range's free blocks off the lists, so that kalloc can't hand
+// out a frame inside the range as somewhere to move a page to. Then empty the range front to
+// back, keeping the frames we move pages out of off the lists as well. Finally they are all
+// freed at once, which coalesces them into a single block (if every page could be moved).
+auto BuddyAllocator::compact(u8 const order, Migrate const migrate) -> bool {
+    // Every page moved needs a free frame outside the range
+    if (order >= NUM_LISTS || free_pages() < (1_u32 << order)) {
+        return false;
+    }
+
+    auto const target = find_compaction_target(order);
+
+    if (target.none()) {
+        return false;
+    }
+
+    auto const end = target.unwrap() + (1_u32 << order);
+
+    // Both linked through next, like the free lists. [free] is in address order.
+    Nullable<u32, NULL_BLOCK> free;
+    Nullable<u32, NULL_BLOCK> taken;
+    Nullable<u32, NULL_BLOCK> last_free;
+
+    for (auto idx = target.unwrap(); idx < end;) {
+        auto& block = blocks[idx];
+
+        if (!block.is_free()) {
+            ++idx;
+            continue;
+        }
+
+        auto const free_order = block.order();
+        remove_from_list(idx);
+
+        if (last_free.some()) {
+            blocks[last_free.unwrap()].next = idx;
+        } else {
+            free = idx;
+        }
+
+        last_free = idx;
+        idx += 1_u32 << free_order;
+    }
+
+    auto next_free = free;
+    auto idx = target.unwrap();
+
+    while (idx < end) {
+        auto& block = blocks[idx];
+
+        if (next_free == idx) {
+            next_free = block.next;
+            idx += 1_u32 << block.order();
+            continue;
+        }
+
+        // kalloc may have swapped a page out to make room, putting its frame back on the lists
+        if (block.is_free()) {
+            auto const free_order = block.order();
+            remove_from_list(idx);
+            block.next = taken;
+            taken = idx;
+            idx += 1_u32 << free_order;
+            continue;
+        }
+
+        if (!movable(idx)) {
+            break;
+        }
+
+        auto const owner = block.owner;
+        auto const destination = kalloc(PAGESIZE, Mobility::Movable);
+
+        if (destination.none()) {
+            break;
+        }
+
+        // That frame would have to be moved again. It can only be one a swap-out freed.
+        auto const destination_idx = addr_to_index(destination.unwrap()).unwrap();
+
+        if (destination_idx >= target.unwrap() && destination_idx < end) {
+            kfree(destination.unwrap());
+            break;
+        }
+
+        // kalloc may have swapped the page out to make room
+        if (block.is_free() || block.owner != owner) {
+            kfree(destination.unwrap());
+            continue;
+        }
+
+        if (!migrate(index_to_addr(idx), destination.unwrap())) {
+            kfree(destination.unwrap());
+            break;
+        }
+
+        // As good as kfree'd, but kept off the lists for now
+        ++counters.frees[0];
+        --counters.pages_in_use;
+        ++counters.migrations;
+
+        block.next = taken;
+        taken = idx;
+        ++idx;
+    }
+
+    if (last_free.some()) {
+        blocks[last_free.unwrap()].next = taken;
+        taken = free;
+    }
+
+    while (taken.some()) {
+        auto const block_idx = taken.unwrap();
+        taken = blocks[block_idx].next;
+        free_block(block_idx, blocks[block_idx].order());
+    }
+
+    if (idx < end) {
+        return false;
+    }
+
+    ++counters.compactions;
+    return true;
+}
+
+auto BuddyAllocator::movable(u32 const block_idx) const -> bool {
+    auto& block = blocks[block_idx];
+
+    return !block.is_free() && block.order() == 0 && block.mobility == Mobility::Movable
+        && block.owner != nullptr && block.extra_refs == 0;
 }
 
-auto BuddyAllocator::pop_free_list(u16 const idx) -> Nullable<u16, NULL_BLOCK> {
-    if (free_lists[idx].none()) {
+// find_compaction_target: Walk the block heads one aligned range at a time. Blocks no larger
+// than a range never straddle two, so each range starts at a head, unless a larger block
+// covers it entirely; that block is skipped as a whole. Of the ranges holding nothing but
+// free blocks and movable pages, take the one with the fewest pages to move.
+auto BuddyAllocator::find_compaction_target(u8 const order) const -> Nullable<u32, NULL_BLOCK> {
+    auto const size = 1_u32 << order;
+
+    Nullable<u32, NULL_BLOCK> best;
+    auto best_moves = size;
+    u32 start = 0;
+
+    while (start + size <= num_blocks) {
+        if (blocks[start].order() >= order) {
+            start += 1_u32 << blocks[start].order();
+            continue;
+        }
+
+        u32 moves = 0;
+        auto idx = start;
+
+        while (idx < start + size && moves < best_moves) {
+            if (blocks[idx].is_free()) {
+                idx += 1_u32 << blocks[idx].order();
+            } else if (movable(idx)) {
+                ++moves;
+                ++idx;
+            } else {
+                break;
+            }
+        }
+
+        if (idx == start + size) {
+            best = start;
+            best_moves = moves;
+        }
+
+        start += size;
+    }
+
+    return best;
+}
+
+auto BuddyAllocator::free_pages() const -> u32 {
+    u32 pages = 0;
+    for (u8 order = 0; order < NUM_LISTS; ++order) {
+        pages += free_block_counts[order] << order;
+    }
+    return pages;
+}
+
+// fragmentation_index: Free pages in blocks below [order] are unusable for a request of
+// that order, so report them as a share of all free pages.
+auto BuddyAllocator::fragmentation_index(u8 const order) const -> u8 {
+    auto const total = free_pages();
+
+    if (total == 0) {
+        return 0;
+    }
+
+    u32 unusable = 0;
+    for (u8 i = 0; i < order; ++i) {
+        unusable += free_block_counts[i] << i;
+    }
+
+    return u8(u64(unusable) * 100 / total);
+}
+
+auto BuddyAllocator::pop_free_list(Mobility const mobility,
+                                   u8 const order) -> Nullable<u32, NULL_BLOCK> {
+    auto& list = free_lists[u8(mobility)][order];
+
+    if (list.none()) {
         return NULL_BLOCK;
     }
 
-    auto head_idx = free_lists[idx].unwrap();
+    auto const head_idx = list.unwrap();
     auto& head = blocks[head_idx];
 
-    free_lists[idx] = head.next;
-    terminal.print_debug("pop ", head_idx, " from ", idx, " next is ", head.next.unwrap());
+    list = head.next;
+    --free_block_counts[order];
 
     if (head.next.some()) {
-        blocks[head.next.unwrap()].next.become_none();
+        blocks[head.next.unwrap()].prev.become_none();
+    } else {
+        nonempty_orders[u8(mobility)] &= ~(1_u32 << order);
     }
 
     head.next.become_none();
     head.prev.become_none();
     head.clear_free();
-    head.set_order(idx);
+    head.set_order(order);
 
     return head_idx;
 }
 
-void BuddyAllocator::push_free_list(u16 const idx, u16 const block_idx) {
+void BuddyAllocator::push_free_list(u8 const order, u32 const block_idx) {
     auto& block = blocks[block_idx];
+    auto const mobility = pageblock_type(block_idx);
+    auto& list = free_lists[u8(mobility)][order];
+
     block.set_free();
-    block.set_order(idx);
+    block.set_order(order);
+    block.mobility = mobility;
+    block.prev.become_none();
+    block.next = list;
 
-    if (free_lists[idx].none()) {
-        free_lists[idx] = block_idx;
-        block.next.become_none();
-        block.prev.become_none();
-        terminal.print_debug("push head: ", block_idx, " for ", idx);
-    } else {
-        auto const head_idx = free_lists[idx].unwrap();
-        auto& head = blocks[head_idx];
-        head.prev = block_idx;
-        block.next = head_idx;
-        block.prev.become_none();
-        free_lists[idx] = block_idx;
-        terminal.print_debug("push to ", idx, " block next: ", head_idx);
+    if (list.some()) {
+        blocks[list.unwrap()].prev = block_idx;
     }
+
+    list = block_idx;
+    nonempty_orders[u8(mobility)] |= 1_u32 << order;
+    ++free_block_counts[order];
 }
 
-void constexpr BuddyAllocator::remove_from_list(u16 const block_idx) {
+void constexpr BuddyAllocator::remove_from_list(u32 const block_idx) {
     auto& block = blocks[block_idx];
-    if (block.prev.some()) {
-        auto& prev = blocks[block.prev.unwrap()];
-        prev.next = block.next;
-    }
+    auto& list = free_lists[u8(block.mobility)][block.order()];
 
-    if (free_lists[block.order()] == block_idx) {
-        free_lists[block.order()] = block.next;
-    }
-}
-
-auto constexpr BuddyAllocator::buddy_index(u16 const block_idx) -> u16 {
-    auto const order = blocks[block_idx].order();
-    uptr const block_address = block_idx * PAGESIZE;
+    --free_block_counts[block.order()];
 
-    if (block_address % (1 << (order + SMALLEST_BLOCK_SIZE + 1)) == 0) {
-        auto const buddy_address = block_address + (1 << (order + SMALLEST_BLOCK_SIZE));
-        return addr_to_index(buddy_address + BLOCK_OFFSET).unwrap();
+    if (block.prev.some()) {
+        blocks[block.prev.unwrap()].next = block.next;
     } else {
-        auto const buddy_address = block_address - (1 << (order + SMALLEST_BLOCK_SIZE));
-        return addr_to_index(buddy_address + BLOCK_OFFSET).unwrap();
-    }
-}
+        list = block.next;
 
-auto BuddyAllocator::buddy_is_free(u16 const idx) -> bool {
-    auto const buddy_idx = buddy_index(idx);
-    terminal.print_debug(idx, " buddy: ", buddy_idx, " order: ", blocks[idx].order());
+        if (block.next.none()) {
+            nonempty_orders[u8(block.mobility)] &= ~(1_u32 << block.order());
+        }
+    }
 
-    if (buddy_idx > blocks.len()) {
-        return false;
+    if (block.next.some()) {
+        blocks[block.next.unwrap()].prev = block.prev;
     }
 
-    return blocks[buddy_idx].is_free();
+    block.next.become_none();
+    block.prev.become_none();
+    block.clear_free();
 }
 
-auto constexpr BuddyAllocator::index_to_addr(u16 const idx) -> uptr {
-    return idx * 0x1000 + BLOCK_OFFSET;
+auto constexpr BuddyAllocator::index_to_addr(u32 const idx) -> uptr {
+    return util::physical_addr_to_kernel(uptr(idx) * PAGESIZE);
 }
 
-auto constexpr BuddyAllocator::addr_to_index(uptr const addr) -> Nullable<u16, NULL_BLOCK> {
-    auto const index = (addr - BLOCK_OFFSET) / 0x1000;
-    return index >= blocks.len() ? NULL_BLOCK : index;
+// Addresses below the direct map wrap around to huge indices, so they are caught as well.
+auto constexpr BuddyAllocator::addr_to_index(uptr const addr) -> Nullable<u32, NULL_BLOCK> {
+    auto const index = u32(util::kernel_to_physical_addr(addr) / PAGESIZE);
+    return index >= num_blocks ? NULL_BLOCK : index;
 }
 
 auto constexpr BuddyAllocator::block::is_free() -> bool {
@@ -250,12 +632,8 @@ auto wlib::alloc::round_up_pow2(u32 num) -> u32 {
     return num;
 }
 
+// log2: Index of the highest set bit (bsr), or -1 for zero.
 auto wlib::alloc::log2(u32 num) -> u8 {
-    auto count = u8(-1);
-    while (num) {
-        num >>= 1;
-        ++count;
-    }
-    return count;
+    return num == 0 ? u8(-1) : u8(31 - __builtin_clz(num));
 }
 
@@ -6,6 +6,8 @@
 #include "klib/concepts.hh"
 #include "klib/nullable.hh"
 #include "kernel/kernel.hh"
+#include "kernel/multiboot.hh"
+#include "klib/util.hh"
 
 namespace wlib::alloc {
     template<typename A>
@@ -14,36 +16,132 @@ namespace wlib::alloc {
         { allocator.kfree() } -> wlib::concepts::is_type<void>;
     };
 
+    // How easily an allocation could be given up or moved elsewhere. The buddy allocator keeps
+    // each kind in its own pageblocks, so that long-lived kernel structures don't end up
+    // scattered all over memory where they would break up every large block.
+    enum class Mobility : u8 {
+        Unmovable, // Kernel structures, pagetables, DMA buffers: the default
+        Movable,   // Only reached through a mapping that can be changed, e.g. demand and vmalloc pages
+    };
+
+    auto constexpr NUM_MOBILITIES = 2_u8;
+
     class BuddyAllocator {
       public:
-        [[nodiscard]] auto kalloc(usize size) -> wlib::Nullable<uptr, 0>;
+        // Number of lists, one per order.
+        // The largest block is 2^(NUM_LISTS - 1) pages, i.e. 2 GiB.
+        auto static constexpr NUM_LISTS = 20_u8;
+
+        // Free memory is grouped by Mobility in pageblocks of 2^PAGEBLOCK_ORDER pages (2 MiB,
+        // a PAE large page). Each pageblock belongs to one Mobility, whose allocations it serves.
+        auto static constexpr PAGEBLOCK_ORDER = 9_u8;
+
+        // Counters updated on every kalloc and kfree. They are plain increments,
+        // so they stay on in release builds.
+        struct Stats {
+            Array<u32, NUM_LISTS> allocs; // Successful kallocs, by order
+            Array<u32, NUM_LISTS> frees;  // kfrees, by order
+            u32 splits;
+            u32 coalesces;
+            u32 failed;                   // kallocs that returned none
+            u32 fallbacks;                // kallocs served from another Mobility's pageblocks
+            u32 compactions;              // compact calls that made a block of the order asked for
+            u32 migrations;               // Pages moved by compact
+            u32 pages_in_use;
+            u32 high_water;               // Most pages ever in use at once
+        };
+
+        // Allocate a block of at least [size] bytes, aligned to its size rounded up to a power
+        // of two. If [mobility] has no free block big enough, part of the largest free block of
+        // the other kind is taken instead (see find_block).
+        [[nodiscard]] auto kalloc(usize size, Mobility mobility = Mobility::Unmovable)
+            -> wlib::Nullable<uptr, 0>;
         void kfree(uptr ptr);
-        BuddyAllocator();
+
+        // Size the block metadata from the Multiboot memory map and put every usable
+        // page frame on the free lists. Must be called exactly once, before the first
+        // kalloc and before paging is enabled.
+        void init(kernel::multiboot::Info const& info);
+
+        // Stash a pointer for whoever holds the frame at [addr]. Reset to nullptr when it is freed.
+        // The slab allocator uses this to find the slab an object was carved from, and
+        // compaction to find the page a Movable frame is mapped at.
+        void set_owner(uptr addr, void* owner);
+
+        // The pointer stashed by set_owner for the frame at [addr], or nullptr.
+        [[nodiscard]] auto owner(uptr addr) const -> void*;
+
+        // A single page frame can be mapped by several address spaces at once (copy-on-write).
+        // Take another reference to the one page block at [addr]. kfree drops a reference,
+        // and only frees the frame once the last one is gone.
+        void add_ref(uptr addr);
+
+        // Number of references to the block at [addr]: 1 unless add_ref was used on it.
+        [[nodiscard]] auto ref_count(uptr addr) const -> u32;
+
+        // Moves the contents of the Movable page [frame] to the freshly allocated page
+        // [destination] and makes everyone use the new one. Returns false if it can't.
+        using Migrate = auto (*)(uptr frame, uptr destination) -> bool;
+
+        // Make a free block of 2^[order] pages by moving every page out of some range of that
+        // size with [migrate]. Only single Movable pages with an owner (see set_owner) that
+        // nobody else references are moved. Returns false if no range could be emptied.
+        auto compact(u8 order, Migrate migrate) -> bool;
+
+        // One past the highest *physical* address managed by this allocator.
+        // Everything else deals in direct-map (kernel virtual) addresses.
+        [[nodiscard]] auto constexpr end_address() const -> uptr {
+            return uptr(num_blocks) * PAGESIZE;
+        }
+
+        [[nodiscard]] auto constexpr stats() const -> Stats const& { return counters; }
+
+        // Number of free blocks of each order.
+        [[nodiscard]] auto constexpr free_counts() const -> Array<u32, NUM_LISTS> const& {
+            return free_block_counts;
+        }
+
+        [[nodiscard]] auto free_pages() const -> u32;
+
+        // Number of pageblocks currently belonging to [mobility].
+        [[nodiscard]] auto constexpr pageblocks(Mobility const mobility) const -> u32 {
+            return pageblock_counts[u8(mobility)];
+        }
+
+        // Percentage (0-100) of free memory sitting in blocks too small to satisfy a request
+        // of 2^[order] pages. 0 means no fragmentation at that order; when it approaches 100,
+        // kalloc of that order is about to start failing even though memory is free.
+        [[nodiscard]] auto fragmentation_index(u8 order) const -> u8;
+
+        // Print the counters, the free lists and the fragmentation index to [out],
+        // which can be the terminal or a serial port.
+        template<typename Out>
+        void print_stats(Out& out) const;
+
+        constexpr BuddyAllocator() {}
       private:
-        // Offset of where the block is located.
-        auto static constexpr BLOCK_OFFSET = 0x20000;
+        // Nothing below this address is ever handed out: the BIOS data areas,
+        // GRUB's GDT and the multiboot structures all live down here.
+        auto static constexpr LOW_MEMORY_END = 0x100000_u32;
 
-        // Number of blocks. 
-        // The [i]th block is located at memory location 4096 * i + BLOCK_OFFSET.
-        // i.e., each block is 1 page and we start at BLOCK_OFFSET.
-        auto static constexpr NUM_BLOCKS = 64_u8;
+        // Highest physical address we will manage: everything we hand out must be in the direct map.
+        auto static constexpr HIGHEST_ADDRESS =
+            u32(kernel::DIRECT_MAP_END - util::KERNEL_VIRTUAL_BASE);
 
-        // Number of lists.
-        auto static constexpr NUM_LISTS = 9_u8;
-        
-        // Magic number representing no head in m_free_list_heads.
-        auto static constexpr NULL_BLOCK = 0xFFFF_u16;
+        // Magic number representing no block in a list.
+        auto static constexpr NULL_BLOCK = 0xFFFFFFFF_u32;
 
         // Smallest block size in terms of power of log_2(BLOCK_SIZE)
         auto static constexpr SMALLEST_BLOCK_SIZE = 12_u8;
 
-        // Largest block size in terms of power of log_2(BLOCK_SIZE)
-        auto static constexpr LARGEST_BLOCK_SIZE = 17_u8;
-
         struct block {
-            wlib::Nullable<u16, NULL_BLOCK> next;
-            wlib::Nullable<u16, NULL_BLOCK> prev;
+            wlib::Nullable<u32, NULL_BLOCK> next;
+            wlib::Nullable<u32, NULL_BLOCK> prev;
+            void* owner;
             u8 order_and_free;
+            Mobility mobility; // Which free lists a free block is on, or what an allocated one
+                               // was allocated as. Also fits in padding.
+            u16 extra_refs; // See add_ref. Fits in what used to be padding.
 
             [[gnu::always_inline]] auto constexpr is_free() -> bool;
             [[gnu::always_inline]] auto constexpr order() -> u8;
@@ -53,24 +151,93 @@ namespace wlib::alloc {
             [[gnu::always_inline]] void constexpr clear_free();
         };
 
-        Array<Nullable<u16, NULL_BLOCK>, NUM_LISTS> free_lists;
-        Array<block, NUM_BLOCKS> blocks;
+        // One set of lists per Mobility. A free block is on the lists of the pageblock it starts in.
+        Array<Array<Nullable<u32, NULL_BLOCK>, NUM_LISTS>, NUM_MOBILITIES> free_lists;
+
+        // Bit i of the [m]th mask is set iff free_lists[m][i] is non-empty, so kalloc can find
+        // the smallest usable order with a single tzcnt instead of walking the lists.
+        Array<u32, NUM_MOBILITIES> nonempty_orders {};
+        static_assert(NUM_LISTS <= 32, "nonempty_orders needs a bit per order");
+
+        Array<u32, NUM_LISTS> free_block_counts {};
+        Stats counters {};
+
+        // Per-frame metadata, placed right after the kernel image by init().
+        // The [i]th block describes the page frame at physical address 4096 * i
+        // (kernel address KERNEL_VIRTUAL_BASE + 4096 * i),
+        // so frames in holes of the memory map simply never become free.
+        block* blocks = nullptr;
+        u32 num_blocks = 0;
+
+        // The Mobility of each pageblock, placed right after the blocks. They all start out
+        // Movable; unmovable allocations claim pageblocks as they need them.
+        Mobility* pageblock_types = nullptr;
+        Array<u32, NUM_MOBILITIES> pageblock_counts {};
+
+        auto pop_free_list(Mobility mobility, u8 order) -> Nullable<u32, NULL_BLOCK>;
+
+        // Put the block at [block_idx] on the lists of the pageblock it starts in.
+        void push_free_list(u8 order, u32 block_idx);
 
-        auto pop_free_list(u16 idx) -> Nullable<u16, NULL_BLOCK>;
+        // Take a free block of at least [order] for [mobility] off the lists, stealing from the
+        // other kind if need be. Returns its index; blocks[idx].order() says how big it is.
+        auto find_block(u8 order, Mobility mobility) -> Nullable<u32, NULL_BLOCK>;
 
-        void push_free_list(u16 list_idx, u16 block_idx);
+        // Hand the pageblocks covered by [block_idx, block_idx + 2^order) to [mobility]; the caller
+        // has taken that range off the lists. Below a pageblock, the whole pageblock is taken,
+        // along with its other free blocks.
+        void claim_pageblocks(u32 block_idx, u8 order, Mobility mobility);
 
-        auto buddy_is_free(u16 idx) -> bool;
+        // Whether compact can move the block at [block_idx].
+        [[nodiscard]] auto movable(u32 block_idx) const -> bool;
 
-        [[gnu::always_inline]] auto constexpr buddy_index(u16 idx) -> u16;
+        // The start of the range of 2^[order] pages compact should empty, if any.
+        auto find_compaction_target(u8 order) const -> Nullable<u32, NULL_BLOCK>;
 
-        [[gnu::always_inline]] void constexpr remove_from_list(u16 const block_idx);
+        [[gnu::always_inline]] auto pageblock_type(u32 const block_idx) const -> Mobility {
+            return pageblock_types[block_idx >> PAGEBLOCK_ORDER];
+        }
 
-        [[gnu::always_inline]] auto constexpr index_to_addr(u16 idx) -> uptr;
+        // Free the block at [block_idx] of the given [order], coalescing it with its buddies.
+        void free_block(u32 block_idx, u8 order);
 
-        [[gnu::always_inline]] auto constexpr addr_to_index(uptr addr) -> Nullable<u16, NULL_BLOCK>;
+        // The value of order_and_free for a free block of [order].
+        [[gnu::always_inline]] auto static constexpr free_tag(u8 order) -> u8 {
+            return u8(order << 1) | 0b1;
+        }
+
+        // Free every whole page in the physical range [start, end).
+        void free_range(u64 start, u64 end);
+
+        [[gnu::always_inline]] void constexpr remove_from_list(u32 const block_idx);
+
+        [[gnu::always_inline]] auto constexpr index_to_addr(u32 idx) -> uptr;
+
+        [[gnu::always_inline]] auto constexpr addr_to_index(uptr addr) -> Nullable<u32, NULL_BLOCK>;
     };
 
+    template<typename Out>
+    void BuddyAllocator::print_stats(Out& out) const {
+        out.print_line("pages in use: ", counters.pages_in_use,
+                       ", high water: ", counters.high_water, ", free: ", free_pages());
+        out.print_line("splits: ", counters.splits, ", coalesces: ", counters.coalesces,
+                       ", failed: ", counters.failed, ", fallbacks: ", counters.fallbacks);
+        out.print_line("compactions: ", counters.compactions, ", migrated pages: ", counters.migrations);
+        out.print_line("pageblocks: ", pageblocks(Mobility::Unmovable), " unmovable, ",
+                       pageblocks(Mobility::Movable), " movable");
+
+        // Only orders that have seen any activity, so that this fits on one screen
+        for (u8 order = 0; order < NUM_LISTS; ++order) {
+            if (counters.allocs[order] == 0 && counters.frees[order] == 0 &&
+                free_block_counts[order] == 0) {
+                continue;
+            }
+
+            out.print_line("order ", order, ": ", counters.allocs[order], " allocs, ",
+                           counters.frees[order], " frees, ", free_block_counts[order],
+                           " free, frag ", fragmentation_index(order), "%");
+        }
+    }
 }; // namespace wlib::alloc
 
 extern wlib::alloc::BuddyAllocator simple_allocator;
@@ -79,10 +246,19 @@ namespace wlib::alloc {
     auto round_up_pow2(u32 num) -> u32; // TODO: move to another suitable file? we want it inlined tho
     auto log2(u32 num) -> u8;
 
+    // Allocate [size] bytes of kernel memory. Requests of up to 2 KiB are served from
+    // the slab size classes (see kernel/slab.hh), anything larger from simple_allocator.
+    // Either way, the memory is aligned to [size] rounded up to a power of two.
+    [[nodiscard]] auto kmalloc(usize size) -> Nullable<uptr, 0>;
+
+    // Free memory returned by kmalloc.
+    void kmfree(uptr ptr);
+
+    // Allocate (but do not construct) a T aligned to at least [align], which must be a power of two.
     template<typename T>
-    inline __attribute__((malloc)) auto knew(u16 align = 0) -> T* {
-        // align currently unused but may be used in the future
-        return simple_allocator.kalloc(sizeof(T)).unwrap_as<T*>();
+    inline __attribute__((malloc)) auto knew(u16 align = alignof(T)) -> T* {
+        // kmalloc aligns to the rounded-up size, so asking for at least [align] bytes is enough
+        return kmalloc(sizeof(T) < align ? align : sizeof(T)).template unwrap_as<T*>();
     }
 }; // namespace alloc
 
@@ -0,0 +1,327 @@
+#include "kernel/block_queue.hh"
+#include "klib/assert.hh"
+#include "klib/idt.hh"
+#include "klib/util.hh"
+#include "klib/x86.hh"
+
+using namespace wlib;
+using namespace wlib::block;
+using ahci::Direction;
+using ahci::IOError;
+
+block::Queue::Queue(ahci::AHCIState& disk) : _disk(disk) {
+    _sorted.fill(nullptr);
+    _position.fill(0);
+
+    for (u32 i = 0; i < MAX_COMMANDS; ++i) {
+        _commands[i].queue = this;
+        _commands[i].index = i;
+    }
+
+    // Don't queue up more commands than the disk can take
+    auto const slots = util::min(disk.num_ncq_slots(), MAX_COMMANDS);
+    _all_commands = slots == 32 ? ~0_u32 : (1_u32 << slots) - 1;
+    _free_commands = _all_commands;
+}
+
+void block::Queue::submit(Request& request) {
+    assert(request.buffer.len() % ahci::SECTOR_SIZE == 0 && !request.buffer.empty(),
+           "Block request is not a whole number of sectors");
+
+    auto const dir = u8(request.direction);
+
+    request.status = u32(IOError::TryAgain);
+    request.deadline = _clock + (request.direction == Direction::Read ? READ_EXPIRE : WRITE_EXPIRE);
+
+    // Behind any request for the same sector, so those go out in the order they came in
+    Request* prev = nullptr;
+    auto* next = _sorted[dir];
+
+    while (next != nullptr && next->sector <= request.sector) {
+        prev = next;
+        next = next->next;
+    }
+
+    request.next = next;
+
+    if (prev != nullptr) {
+        prev->next = &request;
+    } else {
+        _sorted[dir] = &request;
+    }
+
+    if (request.priority == ahci::Priority::High) {
+        ++_urgent;
+    }
+
+    ++_stats.requests;
+    dispatch();
+}
+
+auto block::Queue::wait(Request const& request) -> Result<Null, IOError> {
+    // The completion comes in through an interrupt
+    assert(Idt::interrupts_enabled(), "Waiting for the disk with interrupts disabled");
+
+    while (!request.done()) {
+        dispatch();
+        x86::pause();
+    }
+
+    return request.result();
+}
+
+void block::Queue::dispatch() {
+    // Completions only ever set bits, so one we saw set stays set until we claim it
+    while (_free_commands != 0) {
+        // next_request takes a high priority request whenever there is one
+        auto const urgent = _urgent > 0;
+        auto* const first = next_request();
+
+        if (first == nullptr) {
+            return;
+        }
+
+        u32 idx;
+
+        {
+            InterruptGuard guard;
+            idx = x86::tzcnt_32(_free_commands);
+            _free_commands = _free_commands & ~(1_u32 << idx);
+        }
+
+        send(_commands[idx], first, urgent);
+    }
+}
+
+auto block::Queue::flush() -> Result<Null, IOError> {
+    assert(Idt::interrupts_enabled(), "Flushing the disk with interrupts disabled");
+
+    while (_sorted[u8(Direction::Read)] != nullptr || _sorted[u8(Direction::Write)] != nullptr
+           || _free_commands != _all_commands) {
+        dispatch();
+        x86::pause();
+    }
+
+    ++_stats.flushes;
+    return _disk.flush();
+}
+
+auto block::Queue::read(Slice<u8>& buf, usize const offset,
+                        ahci::Priority const priority) -> Result<Null, IOError> {
+    auto request = Request { .buffer = buf, .sector = offset / ahci::SECTOR_SIZE,
+                             .direction = Direction::Read, .priority = priority };
+    submit(request);
+    return wait(request);
+}
+
+auto block::Queue::write(Slice<u8> const& buf, usize const offset,
+                         ahci::Priority const priority) -> Result<Null, IOError> {
+    auto request = Request { .buffer = buf, .sector = offset / ahci::SECTOR_SIZE,
+                             .direction = Direction::Write, .priority = priority };
+    submit(request);
+    return wait(request);
+}
+
+// next_request: High priority requests first, without disturbing the batch. Otherwise carry
+// on with the current batch while it lasts, unless it is writing and a read has expired.
+// Otherwise start a new one, with reads unless writes have waited too long.
+auto block::Queue::next_request() -> Request* {
+    auto const reads = _sorted[u8(Direction::Read)] != nullptr;
+    auto const writes = _sorted[u8(Direction::Write)] != nullptr;
+
+    if (!reads && !writes) {
+        return nullptr;
+    }
+
+    if (_urgent > 0) {
+        return next_urgent();
+    }
+
+    if (_batch_left > 0 && _sorted[u8(_batch_direction)] != nullptr
+        && !(_batch_direction == Direction::Write && expired(Direction::Read) != nullptr)) {
+        --_batch_left;
+        return next_in_order(_batch_direction);
+    }
+
+    if (reads && (!writes || _starved < WRITES_STARVED)) {
+        _batch_direction = Direction::Read;
+        _starved = writes ? _starved + 1 : 0;
+    } else {
+        _batch_direction = Direction::Write;
+        _starved = 0;
+    }
+
+    _batch_left = BATCH_SIZE - 1;
+
+    auto const* const late = expired(_batch_direction);
+
+    if (late != nullptr) {
+        _position[u8(_batch_direction)] = late->sector;
+        ++_stats.expired;
+    }
+
+    return next_in_order(_batch_direction);
+}
+
+auto block::Queue::next_urgent() -> Request* {
+    // Reads come first: Direction::Read is 0
+    for (u8 dir = 0; dir < 2; ++dir) {
+        Request* prev = nullptr;
+
+        for (auto* request = _sorted[dir]; request != nullptr; request = request->next) {
+            if (request->priority == ahci::Priority::High) {
+                unlink(prev, request);
+                return request;
+            }
+
+            prev = request;
+        }
+    }
+
+    assert(false, "Lost track of a high priority request");
+    return nullptr;
+}
+
+auto block::Queue::next_in_order(Direction const direction) -> Request* {
+    auto const position = _position[u8(direction)];
+    Request* prev = nullptr;
+    auto* request = _sorted[u8(direction)];
+
+    while (request != nullptr && request->sector < position) {
+        prev = request;
+        request = request->next;
+    }
+
+    // Nothing past the position: wrap around to the start of the disk
+    if (request == nullptr) {
+        prev = nullptr;
+        request = _sorted[u8(direction)];
+    }
+
+    if (request != nullptr) {
+        unlink(prev, request);
+    }
+
+    return request;
+}
+
+auto block::Queue::expired(Direction const direction) -> Request* {
+    Request* oldest = nullptr;
+
+    for (auto* request = _sorted[u8(direction)]; request != nullptr; request = request->next) {
+        if (oldest == nullptr || i32(request->deadline - oldest->deadline) < 0) {
+            oldest = request;
+        }
+    }
+
+    if (oldest == nullptr || i32(_clock - oldest->deadline) < 0) {
+        return nullptr;
+    }
+
+    return oldest;
+}
+
+void block::Queue::unlink(Request* const prev, Request* const request) {
+    if (prev != nullptr) {
+        prev->next = request->next;
+    } else {
+        _sorted[u8(request->direction)] = request->next;
+    }
+
+    if (request->priority == ahci::Priority::High) {
+        --_urgent;
+    }
+
+    request->next = nullptr;
+}
+
+// send: Requests come off the list in sector order, so the ones that continue [first] are
+// right behind it. Each one merged counts against the batch, but never waits for a new one.
+// An urgent command is sent out of turn, so it leaves the batch and its position alone.
+void block::Queue::send(command& cmd, Request* const first, bool const urgent) {
+    auto const dir = u8(first->direction);
+    auto priority = first->priority;
+    auto end = first->sector + first->buffer.len() / ahci::SECTOR_SIZE;
+    auto sectors = end - first->sector;
+    auto prds = (first->buffer.len() + ahci::MAX_PRD_BYTES - 1) / ahci::MAX_PRD_BYTES;
+    auto* last = first;
+    usize count = 1;
+
+    cmd.requests = first;
+    cmd.segments[0] = first->buffer;
+
+    while (count < MAX_MERGE) {
+        Request* prev = nullptr;
+        auto* next = _sorted[dir];
+
+        while (next != nullptr && next->sector < end) {
+            prev = next;
+            next = next->next;
+        }
+
+        if (next == nullptr || next->sector != end) {
+            break;
+        }
+
+        auto const next_sectors = next->buffer.len() / ahci::SECTOR_SIZE;
+        auto const next_prds = (next->buffer.len() + ahci::MAX_PRD_BYTES - 1) / ahci::MAX_PRD_BYTES;
+
+        if (sectors + next_sectors > ahci::MAX_SECTORS || prds + next_prds > ahci::MAX_PRDS) {
+            break;
+        }
+
+        unlink(prev, next);
+        last->next = next;
+        last = next;
+
+        cmd.segments[count] = next->buffer;
+        priority = util::max(priority, next->priority);
+        end += next_sectors;
+        sectors += next_sectors;
+        prds += next_prds;
+        ++count;
+
+        if (!urgent && _batch_left > 0) {
+            --_batch_left;
+        }
+    }
+
+    cmd.io = ahci::Request {
+        .segments = Slice<Slice<u8>>(&cmd.segments[0], count),
+        .sector = first->sector,
+        .direction = first->direction,
+        .priority = priority,
+        .on_complete = complete,
+        .context = &cmd,
+    };
+
+    if (!urgent) {
+        _position[dir] = end;
+    }
+
+    ++_clock;
+    ++_stats.commands;
+
+    _disk.submit(cmd.io);
+}
+
+// complete: In the interrupt handler. Each merged request shares the command's outcome.
+void block::Queue::complete(ahci::Request& io) {
+    auto& cmd = *static_cast<command*>(io.context);
+    auto* request = cmd.requests;
+
+    while (request != nullptr) {
+        // The request may be reused once it is done
+        auto* const next = request->next;
+
+        request->status = io.status;
+
+        if (request->on_complete != nullptr) {
+            request->on_complete(*request);
+        }
+
+        request = next;
+    }
+
+    cmd.queue->_free_commands = cmd.queue->_free_commands | (1_u32 << cmd.index);
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include "klib/ahci/ahci.hh"
+#include "klib/array.hh"
+#include "klib/int.hh"
+#include "klib/option.hh"
+#include "klib/result.hh"
+#include "klib/slice.hh"
+
+namespace wlib::block {
+    // A request to the block layer. Like ahci::Request, it is its own token: it and its buffer
+    // must stay put until it is done.
+    struct Request {
+        Slice<u8> buffer;    // Physically contiguous, a whole number of sectors
+        usize sector;
+        ahci::Direction direction;
+        ahci::Priority priority = ahci::Priority::Normal;
+
+        // Called from the interrupt handler once the request is done. Must not submit or wait.
+        void (*on_complete)(Request& request) = nullptr;
+        void* context = nullptr; // For on_complete
+
+        // ahci::IOError::TryAgain until done, then 0 or the error it failed with
+        volatile u32 status = u32(ahci::IOError::TryAgain);
+
+        // Owned by the Queue while the request is in it
+        Request* next = nullptr;
+        u32 deadline = 0;
+
+        [[nodiscard]] auto done() const -> bool { return status != u32(ahci::IOError::TryAgain); }
+
+        // Only meaningful once done()
+        [[nodiscard]] auto result() const -> Result<Null, ahci::IOError> {
+            if (status != 0) {
+                return Result<Null, ahci::IOError>::Err(ahci::IOError(status));
+            }
+            return Result<Null, ahci::IOError>::Ok({});
+        }
+    };
+
+    // The request queue in front of a disk. Requests wait here, one list per direction sorted
+    // by sector, until the disk has a free command slot. The queue then sends requests in
+    // batches, each one continuing in sector order from where the last left off, and
+    // merges requests for adjacent sectors into a single command.
+    //
+    // Every request gets a deadline. A batch starts with the oldest request of its direction
+    // if that has expired. Reads are preferred over writes, which only get a batch after
+    // WRITES_STARVED read batches have gone by while they waited, and a write batch is cut
+    // short once a read has expired. Deadlines are counted in commands sent to the disk:
+    // there is no clock to speak of, and a queue only waits while its disk is busy anyway.
+    //
+    // High priority requests skip all of that: they go out as soon as there is room, ahead of
+    // any batch, and the disk is told to put their commands first too.
+    //
+    // Requests only go to the disk from submit and wait, never from the interrupt handler.
+    // Overlapping requests are not ordered against each other: wait for the first one to be
+    // done before submitting the second.
+    class Queue {
+      public:
+        explicit Queue(ahci::AHCIState& disk);
+        Queue(Queue const&) = delete;
+
+        // Queue [request], and send it to the disk right away if there is room.
+        void submit(Request& request);
+
+        // Wait for [request] to be done, feeding the disk meanwhile, and return its result.
+        // Interrupts must be enabled, as that is how completions come in.
+        [[nodiscard]] auto wait(Request const& request) -> Result<Null, ahci::IOError>;
+
+        // Send queued requests to the disk while it has free command slots.
+        void dispatch();
+
+        // Barrier: wait for every request submitted so far, then flush the disk's write cache
+        // (see ahci::AHCIState::flush). Filesystems call this where their writes must be durable.
+        // Interrupts must be enabled, like for wait.
+        [[nodiscard]] auto flush() -> Result<Null, ahci::IOError>;
+
+        // Filesystems read and write their metadata with ahci::Priority::High, and file data
+        // with the default. Both wait for their request, so a caller that only uses these has
+        // at most one request queued at a time, and it is never merged or reordered. So far
+        // only swap submits several requests before waiting.
+        [[nodiscard]] auto read(Slice<u8>& buf, usize offset,
+                                ahci::Priority priority = ahci::Priority::Normal)
+            -> Result<Null, ahci::IOError>;
+        [[nodiscard]] auto write(Slice<u8> const& buf, usize offset,
+                                 ahci::Priority priority = ahci::Priority::Normal)
+            -> Result<Null, ahci::IOError>;
+
+        struct Stats {
+            u32 requests; // Requests submitted
+            u32 commands; // Commands sent to the disk for them
+            u32 expired;  // Batches started early for a request past its deadline
+            u32 flushes;
+        };
+
+        [[nodiscard]] auto stats() const -> Stats const& { return _stats; }
+
+      private:
+        // In commands sent to the disk
+        auto static constexpr READ_EXPIRE = 32_u32;
+        auto static constexpr WRITE_EXPIRE = 256_u32;
+
+        // Requests per batch, merged ones included
+        auto static constexpr BATCH_SIZE = 16_u32;
+
+        auto static constexpr WRITES_STARVED = 2_u32;
+
+        // Requests merged into one command at most
+        auto static constexpr MAX_MERGE = 16_usize;
+
+        auto static constexpr MAX_COMMANDS = 32_u32;
+
+        // A command in flight, and the requests merged into it
+        struct command {
+            ahci::Request io;
+            Array<Slice<u8>, MAX_MERGE> segments;
+            Request* requests; // Linked through next, in sector order
+            Queue* queue;
+            u32 index;
+        };
+
+        ahci::AHCIState& _disk;
+
+        // One per ahci::Direction
+        Array<Request*, 2> _sorted;
+        Array<usize, 2> _position; // Where the last request sent in each direction ended
+
+        Array<command, MAX_COMMANDS> _commands;
+        volatile u32 _free_commands; // Bit i is set iff _commands[i] is not in flight
+        u32 _all_commands;           // _free_commands when nothing is in flight
+
+        u32 _clock = 0; // Commands sent so far
+        ahci::Direction _batch_direction = ahci::Direction::Read;
+        u32 _batch_left = 0;
+        u32 _starved = 0; // Read batches sent while writes waited
+        u32 _urgent = 0;  // Queued requests with ahci::Priority::High
+
+        Stats _stats {};
+
+        // Take the request that goes next off its list, or nullptr if the queue is empty.
+        auto next_request() -> Request*;
+
+        // Take the first high priority request off its list, reads first.
+        auto next_urgent() -> Request*;
+
+        // Take the next request of [direction] in sector order from _position, wrapping around.
+        auto next_in_order(ahci::Direction direction) -> Request*;
+
+        // The request of [direction] with the earliest deadline, if that has passed.
+        auto expired(ahci::Direction direction) -> Request*;
+
+        // Take [request] off its list, given the one before it (or nullptr).
+        void unlink(Request* prev, Request* request);
+
+        // Merge the requests that follow [first] on the disk into [cmd], and send it. [urgent]
+        // if [first] came from next_urgent rather than the current batch.
+        void send(command& cmd, Request* first, bool urgent);
+
+        void static complete(ahci::Request& io);
+    };
+}; // namespace wlib::block
+
+extern wlib::Option<wlib::block::Queue&> disk0_queue;
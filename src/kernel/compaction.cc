@@ -0,0 +1,67 @@
+#include "kernel/compaction.hh"
+#include "kernel/alloc.hh"
+#include "kernel/kernel.hh"
+#include "kernel/swap.hh"
+#include "klib/assert.hh"
+#include "klib/pagetables.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+// Idle calls skipped after compact_idle fails to make a pageblock
+auto static constexpr IDLE_BACKOFF = 64_u32;
+
+static u32 idle_skips = 0;
+
+void wlib::alloc::track_movable_page(uptr const page, uptr const frame) {
+    simple_allocator.set_owner(frame, reinterpret_cast<void*>(page));
+}
+
+// migrate_page: Copy the page over and point its mapping at the copy. Nothing else runs
+// in the meantime, so no write can land in the old frame after it has been copied.
+auto static migrate_page(uptr const frame, uptr const destination) -> bool {
+    auto const page = reinterpret_cast<uptr>(simple_allocator.owner(frame));
+
+    util::memcpy<u32>(reinterpret_cast<void*>(destination),
+                      reinterpret_cast<void const*>(frame), PAGESIZE / sizeof(u32));
+
+    auto const old_addr = kernel_pagedir.remap(page, util::kernel_to_physical_addr(destination));
+
+    if (old_addr.none()) {
+        return false;
+    }
+
+    assert(old_addr.unwrap() == util::kernel_to_physical_addr(frame),
+           "Movable page was remapped behind our back");
+
+    move_anonymous_page(frame, destination);
+    track_movable_page(page, destination);
+    return true;
+}
+
+auto wlib::alloc::compact_memory(u8 const order) -> bool {
+    return simple_allocator.compact(order, migrate_page);
+}
+
+void wlib::alloc::compact_idle() {
+    auto constexpr order = BuddyAllocator::PAGEBLOCK_ORDER;
+
+    if (idle_skips > 0) {
+        --idle_skips;
+        return;
+    }
+
+    auto const& free_counts = simple_allocator.free_counts();
+
+    for (auto i = order; i < BuddyAllocator::NUM_LISTS; ++i) {
+        if (free_counts[i] > 0) {
+            return;
+        }
+    }
+
+    // Leave some memory for everything else; compaction needs a free frame per page moved
+    if (simple_allocator.free_pages() < (2_u32 << order) || !compact_memory(order)) {
+        idle_skips = IDLE_BACKOFF;
+    }
+}
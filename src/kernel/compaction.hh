@@ -0,0 +1,24 @@
+#pragma once
+#include "klib/int.hh"
+
+namespace wlib::alloc {
+    // Compaction: over time, the few unmovable pages in a range keep it from ever coalescing
+    // into a large block, and high-order kallocs fail while plenty of single pages are free.
+    // Movable pages whose mapping we know can be copied to a frame elsewhere and remapped,
+    // which empties a whole range so that simple_allocator can hand it out in one piece.
+    //
+    // Only pages mapped in kernel_pagedir are moved: demand pages (see kernel/demand.hh) and
+    // vmalloc pages. Pages shared copy-on-write are left alone.
+
+    // Record that the Movable frame at kernel address [frame] backs [page] in kernel_pagedir,
+    // so that compaction may move it. Forgotten once the frame is freed and allocated again.
+    void track_movable_page(uptr page, uptr frame);
+
+    // Move pages out of the way until there is a free block of 2^[order] pages. Returns whether
+    // one was made. Called by kalloc when a request of that order would fail otherwise.
+    auto compact_memory(u8 order) -> bool;
+
+    // Called when there is nothing better to do: rebuild a free pageblock if there is none left.
+    // Backs off for a while after failing, since nothing is likely to have changed.
+    void compact_idle();
+}; // namespace wlib::alloc
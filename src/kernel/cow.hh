@@ -0,0 +1,77 @@
+#pragma once
+#include "kernel/alloc.hh"
+#include "klib/int.hh"
+#include "klib/pagetables.hh"
+#include "klib/util.hh"
+
+namespace wlib::pagetables::cow {
+    // Copy-on-write helpers shared by every paging mode. [Entry] is a pagetable entry,
+    // PageTableEntry or pae::Entry.
+
+    // Whether the frame at physical [addr] is RAM handed out by simple_allocator, as opposed
+    // to e.g. device memory, which is simply shared.
+    [[nodiscard]] inline auto managed(u64 const addr) -> bool {
+        return addr < simple_allocator.end_address();
+    }
+
+    // Map the page of [parent] in [child] as well. If it is writable RAM, it becomes read-only
+    // and PTE_COW in both. Either way a RAM frame gains a reference.
+    template<typename Entry>
+    void share_page(Entry& parent, Entry& child) {
+        auto perm = parent.perm();
+
+        if (!managed(parent.page_address())) {
+            child.set(parent.page_address(), perm);
+            return;
+        }
+
+        if (perm & PTE_W) {
+            perm = u16((perm & ~PTE_W) | PTE_COW);
+            parent.set(parent.page_address(), perm);
+        }
+
+        child.set(parent.page_address(), perm);
+        simple_allocator.add_ref(util::physical_addr_to_kernel(uptr(parent.page_address())));
+    }
+
+    // Drop the reference the present [pte] holds on its frame.
+    template<typename Entry>
+    void release_page(Entry& pte) {
+        if (managed(pte.page_address())) {
+            simple_allocator.kfree(util::physical_addr_to_kernel(uptr(pte.page_address())));
+        }
+        pte.set(0, 0);
+    }
+
+    // Give the PTE_COW page behind [pte], mapped at [virtual_addr], a private writable frame.
+    // The last one to write to a shared frame gets to keep it without copying.
+    template<typename Entry>
+    [[nodiscard]] auto break_cow(Entry& pte, uptr const virtual_addr) -> bool {
+        if (!pte.present() || !(pte.perm() & PTE_COW)) {
+            return false;
+        }
+
+        auto const perm = u16((pte.perm() & ~PTE_COW) | PTE_W);
+        auto const frame = util::physical_addr_to_kernel(uptr(pte.page_address()));
+
+        if (simple_allocator.ref_count(frame) == 1) {
+            pte.set(pte.page_address(), perm);
+        } else {
+            // Compaction only moves pages of kernel_pagedir, and this one belongs to some other
+            // address space, so it would pin a Movable pageblock
+            auto copy = simple_allocator.kalloc(PAGESIZE, alloc::Mobility::Unmovable);
+
+            if (copy.none()) {
+                return false;
+            }
+
+            util::memcpy<u32>(reinterpret_cast<void*>(copy.unwrap()),
+                              reinterpret_cast<void const*>(frame), PAGESIZE / sizeof(u32));
+            pte.set(util::kernel_to_physical_addr(copy.unwrap()), perm);
+            simple_allocator.kfree(frame);
+        }
+
+        invalidate_page(virtual_addr);
+        return true;
+    }
+};
@@ -0,0 +1,126 @@
+#include "kernel/demand.hh"
+#include "kernel/alloc.hh"
+#include "kernel/kernel.hh"
+#include "kernel/swap.hh"
+#include "kernel/zeroed_pages.hh"
+#include "klib/array.hh"
+#include "klib/assert.hh"
+#include "klib/pagetables.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+struct region {
+    uptr start;
+    uptr end; // 0 if this slot is unused
+    u16 perm;
+};
+
+auto static constexpr MAX_REGIONS = 32_usize;
+
+static Array<region, MAX_REGIONS> regions;
+
+auto static find_region(uptr const address) -> region* {
+    for (auto& r : regions) {
+        if (r.end != 0 && r.start <= address && address < r.end) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+auto wlib::alloc::reserve_on_demand(uptr const start, usize const size,
+                                    u16 const perm) -> Result<Null, Null> {
+    assert(start % PAGESIZE == 0 && size % PAGESIZE == 0, "Demand region must be page aligned");
+
+    region* free_slot = nullptr;
+
+    for (auto& r : regions) {
+        if (r.end == 0) {
+            free_slot = free_slot == nullptr ? &r : free_slot;
+        } else if (start < r.end && r.start < start + size) {
+            return Result<Null, Null>::Err();
+        }
+    }
+
+    if (free_slot == nullptr || size == 0) {
+        return Result<Null, Null>::Err();
+    }
+
+    *free_slot = region { start, start + size, perm };
+    return Result<Null, Null>::Ok();
+}
+
+void wlib::alloc::release_on_demand(uptr const start) {
+    auto* const r = find_region(start);
+
+    assert(r != nullptr && r->start == start, "Attempted to release an unknown demand region");
+
+    for (auto page = r->start; page < r->end; page += PAGESIZE) {
+        free_anonymous_page(page);
+    }
+
+    r->end = 0;
+}
+
+// handle_page_fault: A write to a present page may be to a copy-on-write page. Any other
+// protection violation is never ours to fix. A missing kernel page may only be missing from
+// a cloned address space, whose kernel pagetables are synced with kernel_pagedir. Faults
+// outside every region, or accesses the region does not allow, aren't ours either. Otherwise
+// bring the page back from swap, or map a fresh zeroed frame if it was never touched. If
+// memory is short, kalloc swaps something else out to make room. Either way, the faulting
+// instruction is then restarted.
+auto wlib::alloc::handle_page_fault(uptr const address, u32 const error_code) -> bool {
+    auto constexpr cow_fault = u32(PageFaultError::Present) | u32(PageFaultError::Write);
+
+    if ((error_code & (cow_fault | u32(PageFaultError::Reserved))) == cow_fault) {
+        return pagetables::AddressSpace::current().resolve_cow(address);
+    }
+
+    if (error_code & (u32(PageFaultError::Present) | u32(PageFaultError::Reserved))) {
+        return false;
+    }
+
+    auto& current = pagetables::AddressSpace::current();
+
+    if (&current != &kernel_pagedir && current.sync_kernel(kernel_pagedir, address)) {
+        return true;
+    }
+
+    auto const* const r = find_region(address);
+
+    if (r == nullptr) {
+        return false;
+    }
+
+    if ((error_code & u32(PageFaultError::Write)) && !(r->perm & PTE_W)) {
+        return false;
+    }
+
+    if ((error_code & u32(PageFaultError::User)) && !(r->perm & PTE_U)) {
+        return false;
+    }
+
+    auto const page = address & ~uptr(PAGESIZE - 1);
+
+    if (kernel_pagedir.swap_slot(page).some()) {
+        return swap_in(page, r->perm);
+    }
+
+    auto frame = kalloc_zeroed(Mobility::Movable);
+
+    if (frame.none()) {
+        return false;
+    }
+
+    auto const physical = util::kernel_to_physical_addr(frame.unwrap());
+
+    if (kernel_pagedir.try_map(page, physical, r->perm).is_err()) {
+        simple_allocator.kfree(frame.unwrap());
+        return false;
+    }
+
+    add_anonymous_page(page, frame.unwrap());
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/result.hh"
+
+namespace wlib::alloc {
+    // Demand paging: virtual regions which are reserved up front but only backed by page
+    // frames when first touched. The page fault handler maps a zeroed frame for each page
+    // on its first access, so a sparse region only costs memory for the pages actually used.
+    // Under memory pressure, those pages may be swapped out again (see kernel/swap.hh).
+
+    // Bits of the error code pushed by the CPU on a page fault (#PF, vector 14).
+    enum class PageFaultError : u32 {
+        Present  = 0b00001, // Set: protection violation. Clear: the page was not present.
+        Write    = 0b00010, // The access was a write
+        User     = 0b00100, // The access came from ring 3
+        Reserved = 0b01000, // A reserved bit was set in a paging structure
+        Fetch    = 0b10000, // The access was an instruction fetch
+    };
+
+    auto constexpr PAGE_FAULT_VECTOR = 14_u32;
+
+    // Reserve [start, start + size) in kernel_pagedir, to be backed on demand with [perm].
+    // [start] and [size] must be page aligned, and nothing may be mapped there yet.
+    // Fails if the range overlaps another region or there is no room to track it.
+    [[nodiscard]] auto reserve_on_demand(uptr start, usize size, u16 perm) -> Result<Null, Null>;
+
+    // Forget the region starting at [start], freeing the frames and swap slots of touched pages.
+    void release_on_demand(uptr start);
+
+    // Called on #PF. Back the page containing [address] if it is an untouched page of a
+    // reserved region and the access is allowed by the region's permissions.
+    // Returns false if the fault is genuinely invalid.
+    [[nodiscard]] auto handle_page_fault(uptr address, u32 error_code) -> bool;
+}; // namespace wlib::alloc
@@ -0,0 +1,40 @@
+#include "kernel/dma.hh"
+#include "kernel/alloc.hh"
+#include "klib/assert.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+auto wlib::alloc::dma_alloc(usize const size, usize const align,
+                            usize const boundary) -> Option<DmaBuffer> {
+    assert((align & (align - 1)) == 0, "DMA alignment must be a power of two");
+    assert((boundary & (boundary - 1)) == 0, "DMA boundary must be a power of two");
+
+    auto const rounded = round_up_pow2(u32(util::max(size, align)));
+
+    if (size == 0 || (boundary != 0 && rounded > boundary)) [[unlikely]] {
+        return Option<DmaBuffer>::None();
+    }
+
+    auto maybe_virt = kmalloc(rounded);
+
+    if (maybe_virt.none()) {
+        return Option<DmaBuffer>::None();
+    }
+
+    auto const virt = maybe_virt.unwrap();
+    auto const phys = util::kernel_to_physical_addr(virt);
+
+    // Neither should happen, but a device must never see such a buffer
+    if (u64(phys) + rounded > 0x100000000 || phys % rounded != 0) [[unlikely]] {
+        kmfree(virt);
+        return Option<DmaBuffer>::None();
+    }
+
+    return Option<DmaBuffer>::Some(DmaBuffer { virt, phys, size });
+}
+
+void wlib::alloc::dma_free(DmaBuffer const& buffer) {
+    kmfree(buffer.virt);
+}
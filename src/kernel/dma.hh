@@ -0,0 +1,29 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/option.hh"
+
+namespace wlib::alloc {
+    // A physically contiguous buffer that a device can access.
+    // `virt` is where the kernel reads and writes it, `phys` is what gets programmed into the device.
+    struct DmaBuffer {
+        uptr virt;
+        uptr phys;
+        usize size;
+    };
+
+    // Allocate [size] bytes of physically contiguous memory such that:
+    //   - the physical address is a multiple of [align] (a power of two),
+    //   - the buffer does not cross any multiple of [boundary] (a power of two, or 0 for none),
+    //   - the whole buffer lies below 4 GiB, so 32-bit DMA engines can reach it.
+    //
+    // kmalloc memory is aligned to its size rounded up to a power of two (slab size classes and
+    // buddy blocks are both naturally aligned), so rounding the request up to [align] is enough
+    // for the alignment, and such a block can only cross a boundary that is smaller than itself.
+    //
+    // Returns none if out of memory, if [size] is larger than [boundary], or if kmalloc's block
+    // doesn't meet the requirements after all.
+    [[nodiscard]] auto dma_alloc(usize size, usize align, usize boundary = 0) -> Option<DmaBuffer>;
+
+    // Free a buffer returned by dma_alloc. The device must be done with it.
+    void dma_free(DmaBuffer const& buffer);
+}; // namespace wlib::alloc
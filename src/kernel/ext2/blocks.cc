@@ -1,4 +1,5 @@
 #include "kernel/ext2/blocks.hh"
+#include "kernel/block_queue.hh"
 #include "kernel/ext2/ext2.hh"
 #include "kernel/ext2/group_descriptor.hh"
 #include "kernel/ext2/inodes.hh"
@@ -8,10 +9,10 @@
 using namespace wlib;
 using namespace kernel::ext2;
 
-auto Superblock::cache_read(ahci::AHCIState *disk)
+auto Superblock::cache_read(block::Queue *disk)
     -> Result<Null, ahci::IOError> {
     Slice slice(_cache);
-    return disk->read(slice, BYTE_OFFSET);
+    return disk->read(slice, BYTE_OFFSET, ahci::Priority::High);
 }
 
 auto Superblock::format_superblock() -> Result<Null, ahci::IOError> {
@@ -72,7 +73,13 @@ auto Superblock::format_superblock() -> Result<Null, ahci::IOError> {
     *(u16 *)(&_cache[u8(Field16::ReservedBlocksUserID)]) = 0;
     *(u16 *)(&_cache[u8(Field16::ReservedBlocksGroupID)]) = 0;
 
-    return sata_disk0.unwrap().write(Slice(_cache), BYTE_OFFSET);
+    auto const result = disk0_queue.unwrap().write(Slice(_cache), BYTE_OFFSET, ahci::Priority::High);
+
+    if (result.is_err()) {
+        return result;
+    }
+
+    return disk0_queue.unwrap().flush();
 }
 
 auto Superblock::read_32(Field32 offset) -> u32 {
@@ -1,4 +1,5 @@
 #pragma once
+#include "kernel/block_queue.hh"
 #include "kernel/ext2/inodes.hh"
 #include "klib/ahci/ahci.hh"
 #include "klib/array.hh"
@@ -67,7 +68,7 @@ class Superblock {
     Superblock() {}
 
     // Read the superblock into cache.
-    [[nodiscard]] auto cache_read(wlib::ahci::AHCIState *disk)
+    [[nodiscard]] auto cache_read(wlib::block::Queue *disk)
         -> wlib::Result<wlib::Null, wlib::ahci::IOError>;
 
     // Returns whether the ext2 signature is present in the mounted disk.
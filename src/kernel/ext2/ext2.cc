@@ -15,7 +15,7 @@ namespace kernel::ext2 {
 template <typename T> using IOResult = Result<T, Ext2FS::IOError>;
 
 // TODO: Support other block sizes besides 1024 bytes
-Ext2FS::Ext2FS(wlib::ahci::AHCIState *disk) : _disk(*disk) {
+Ext2FS::Ext2FS(wlib::block::Queue *disk) : _disk(*disk) {
     // We want to assert here instead of making this function falliable,
     // since if we can't even do this, then the entire disk is effectively
     // borked. Perhaps in the future we would simply ignore the disk and pretend
@@ -65,21 +65,21 @@ auto adjust_block_num(Superblock &superblock, u32 block_num) -> u32 {
 auto Ext2FS::read_block_descriptor(wlib::Slice<u8> &buffer)
     -> Result<Null, IOError> {
     u32 block_num = this->superblock.block_size() == 1024 ? 2 : 1;
-    return this->read_block(block_num, buffer);
+    return this->read_block(block_num, buffer, ahci::Priority::High);
 }
 
 auto Ext2FS::inode_block(INodeNum inode_num) -> u32 {
     Array<u8, 1024> buf;
     Slice slice(buf);
-    this->read_block(2_u32, slice);
+    this->read_block(2_u32, slice, ahci::Priority::High);
 }
 
-auto Ext2FS::read_block(u32 block_num, wlib::Slice<u8> &buffer)
-    -> IOResult<Null> {
+auto Ext2FS::read_block(u32 block_num, wlib::Slice<u8> &buffer,
+                        ahci::Priority priority) -> IOResult<Null> {
     assert_debug(buffer.len() >= superblock.block_size(), "Bad block size");
     u32 adjusted_block_num = adjust_block_num(this->superblock, block_num);
     auto res =
-        this->_disk.read(buffer, superblock.block_size() * adjusted_block_num);
+        this->_disk.read(buffer, superblock.block_size() * adjusted_block_num, priority);
     if (res.is_err()) {
         return IOResult<Null>::Err();
     }
@@ -1,6 +1,7 @@
 #pragma once
 #include "kernel/ext2/blocks.hh"
 #include "kernel/ext2/inodes.hh"
+#include "kernel/block_queue.hh"
 #include "klib/ahci/ahci.hh"
 #include "klib/result.hh"
 
@@ -43,7 +44,7 @@ class Ext2FS {
 
     enum class INodeNum : u8 {};
 
-    Ext2FS(wlib::ahci::AHCIState *disk);
+    Ext2FS(wlib::block::Queue *disk);
 
     auto find_inode(INodeNum parent_dir, wlib::str const name)
         -> wlib::Result<INodeNum, IOError>;
@@ -61,12 +62,14 @@ class Ext2FS {
         -> wlib::Result<wlib::Null, IOError>;
 
   private:
-    wlib::ahci::AHCIState &_disk;
+    wlib::block::Queue &_disk;
     Superblock superblock;
     auto inode_block(INodeNum inode_num) -> u32;
     auto get_inode(INodeNum inode_num) -> wlib::Result<INode *, IOError>;
 
-    auto read_block(u32 block_num, wlib::Slice<u8> &buffer)
+    // Metadata blocks should be read with Priority::High (see block::Queue::read).
+    auto read_block(u32 block_num, wlib::Slice<u8> &buffer,
+                    wlib::ahci::Priority priority = wlib::ahci::Priority::Normal)
         -> wlib::Result<wlib::Null, IOError>;
     void release_inode(INode *inode);
 };
@@ -9,10 +9,16 @@
 #include "klib/ports.hh"
 #include "klib/x86.hh"
 #include "klib/ahci/ahci.hh"
+#include "kernel/demand.hh"
+#include "kernel/kernel.hh"
 
 using namespace wlib;
 using namespace ps2;
 
+Idt idt;
+Idtr idtr;
+extern void *isr_stub_table[];
+
 usize timer = 0;
 
 void end_of_interrupt(usize vector_code) {
@@ -23,13 +29,35 @@ void end_of_interrupt(usize vector_code) {
 }
 
 extern "C" void exception_handler(regstate& regs) {
+    if (regs.vector_code == alloc::PAGE_FAULT_VECTOR) {
+        auto const address = x86::read_cr2();
+
+        // #PF comes in through an interrupt gate, so interrupts are off. Resolving the fault
+        // may wait for the disk (swap_in, or reclaim from kalloc), whose completions are
+        // interrupts too, so turn them back on if the faulting code had them. Otherwise it
+        // is in a critical section or an interrupt handler, and swap stays out of the way.
+        // CR2 is read, so a nested fault can't clobber it.
+        if (regs.interrupts_enabled()) {
+            Idt::enable_interrupts();
+        }
+
+        if (!alloc::handle_page_fault(address, regs.error_code)) {
+            terminal.print_line("Page fault at ", (void*)(address),
+                                " EIP = ", (void*)(regs.instruction_pointer()),
+                                " error = ", u32(regs.error_code));
+            assert(false, "Invalid memory access!");
+        }
+        // CPU exceptions don't come from the PIC, so there is nothing to acknowledge
+        return;
+    }
+
     if (sata_disk0.some() && 
         regs.vector_code == 0x20 + sata_disk0.unwrap().irq()) {
         sata_disk0->handle_interrupt();
     } else {
         terminal.print_line("Exception ", u32(regs.vector_code), 
-                            " at EIP = ", (void*)(regs.reg_eip),
-                            " CR2 = ", x86::read_cr2());
+                            " at EIP = ", (void*)(regs.instruction_pointer()),
+                            " CR2 = ", (void*)(x86::read_cr2()));
         assert(false, "Exception!");
     }
     end_of_interrupt(regs.vector_code);
@@ -80,3 +108,19 @@ extern "C" void keyboard_handler() {
     }
     ports::outb(0x20, 0x20);
 }
+
+void Idt::init() {
+    idtr.set_base(reinterpret_cast<uptr>(&_idt[0]));
+    idtr.set_limit(sizeof(IdtEntry) * 63);
+    for (usize i = 0; i < 64; ++i) {
+        auto const ptr =
+            reinterpret_cast<uptr>(isr_stub_table[i]) - kernel::KERNEL_START;
+        auto const code_segment =
+            u16((ptr / kernel::SEGMENT_SIZE) + kernel::KERNEL_CS_SEG_START);
+        _idt[i].set(isr_stub_table[i], 0x8E, code_segment);
+    }
+
+    // _idt[0x21].set(reinterpret_cast<void*>(keyboard_handler), 0x8E);
+
+    __asm__ volatile("lidt %0" : : "m"(idtr)); // load the new IDT
+}
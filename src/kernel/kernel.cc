@@ -1,7 +1,14 @@
 #include "kernel/kernel.hh"
 #include "kernel/alloc.hh"
+#include "kernel/block_queue.hh"
 #include "kernel/ext2/blocks.hh"
 #include "kernel/ext2/ext2.hh"
+#include "kernel/multiboot.hh"
+#include "kernel/shrinker.hh"
+#include "kernel/slab.hh"
+#include "kernel/swap.hh"
+#include "kernel/zeroed_pages.hh"
+#include "kernel/vmalloc.hh"
 #include "klib/ahci/ahci.hh"
 #include "klib/apic.hh"
 #include "klib/array.hh"
@@ -15,6 +22,7 @@
 #include "klib/ps2/keyboard.hh"
 #include "klib/ps2/ps2.hh"
 #include "klib/result.hh"
+#include "klib/serial.hh"
 #include "klib/strings.hh"
 #include "userspace/shell/shell.hh"
 #include "wnfs/cache.hh"
@@ -23,28 +31,37 @@
 using namespace wlib;
 
 using kernel::ext2::Superblock;
-using pagetables::PageDirectory;
-using pagetables::PageTable;
 using ps2::Ps2Keyboard;
 
-// Special, static variables for the starting page directory.
-PageDirectory kernel_pagedir;
-static PageTable starter_pt;
-static PageTable io_pt;
-
 Option<ahci::AHCIState &> sata_disk0 = Option<ahci::AHCIState &>::None();
+Option<block::Queue &> disk0_queue = Option<block::Queue &>::None();
 
-Idt idt;
-Idtr idtr;
-extern void *isr_stub_table[];
 Ps2Keyboard keyboard;
 wnfs::BufCache bufcache;
 
-extern "C" void kernel_main() {
+void static setup_swap(Superblock& superblock);
+
+// [multiboot_info] has already been moved into the direct map by crt0.
+extern "C" void kernel_main(u32 const multiboot_magic,
+                            kernel::multiboot::Info const* multiboot_info) {
     using enum ps2::KeyboardCommand;
     terminal.clear();
     terminal.print_line("Press F1 to exit.");
+    com1.init();
+
+    assert(multiboot_magic == kernel::multiboot::BOOTLOADER_MAGIC,
+           "Not booted by a multiboot-compliant loader");
+
+    simple_allocator.init(*multiboot_info);
+
+    // Cheapest first. Swap only starts doing anything once setup_swap has run.
+    auto const shrinkers = alloc::register_shrinker(alloc::zeroed_pages_shrinker).is_ok()
+                        && alloc::register_shrinker(alloc::kmalloc_shrinker).is_ok()
+                        && alloc::register_shrinker(alloc::swap_shrinker).is_ok();
+    assert(shrinkers, "Could not register shrinkers");
+
     setup_pagedir();
+    map_console();
 
     // Remap master to 0x20, slave to 0x28
     Pic::remap(0x20, 0x28);
@@ -67,9 +84,16 @@ extern "C" void kernel_main() {
 
     sata_disk0.unwrap().enable_interrupts();
 
+    // Everything but the interrupt handler goes to the disk through its queue
+    auto* const queue = alloc::knew<block::Queue>();
+
+    assert(queue != nullptr, "Could not allocate the disk queue");
+
+    disk0_queue = *::new (queue) block::Queue(sata_disk0.unwrap());
+
     Superblock superblock;
 
-    auto result = superblock.cache_read(&sata_disk0.unwrap());
+    auto result = superblock.cache_read(&disk0_queue.unwrap());
 
     assert(result.is_ok(), "Error reading ext2 superblock");
 
@@ -81,8 +105,10 @@ extern "C" void kernel_main() {
         // assert(result2.is_ok(), "Error formating disk with superblock");
     }
 
+    setup_swap(superblock);
+
     // terminal.print_line("Formatting disk...");
-    // assert(wnfs::format_disk(&sata_disk0.unwrap()).is_ok(),
+    // assert(wnfs::format_disk(&disk0_queue.unwrap()).is_ok(),
     // "Error formatting sata disk 0");
     // terminal.print_line("Done formatting");
 
@@ -92,37 +118,42 @@ extern "C" void kernel_main() {
     shell_main();
 }
 
-/// Enable paging by setting up the kernel pagedir and switching to it.
-void setup_pagedir() {
-    kernel_pagedir.add_pagetable(0, starter_pt, PTE_PW);
-    kernel_pagedir.add_pagetable(1019, io_pt, PTE_PW);
-
-    auto result = kernel_pagedir.try_map(0, 0, 0);
-
-    assert(result.is_ok(), "Failure on initial maps!");
+/// Swap to whatever part of the disk lies past both filesystems, if there is any. WNFS shares
+/// the disk with ext2, so the area starts past the end of whichever reaches further. Everything
+/// is counted in 64-bit sectors, so large disks and filesystems can't wrap around.
+void static setup_swap(Superblock& superblock) {
+    auto const ext2_end = u64(superblock.read_32(Superblock::Field32::TotalBlocks))
+                        * (superblock.block_size() / ahci::SECTOR_SIZE);
+    auto const fs_end = util::max(ext2_end, u64(wnfs::END_SECTOR));
+    auto const first = (fs_end + alloc::SWAP_SECTORS_PER_PAGE - 1)
+                     & ~(alloc::SWAP_SECTORS_PER_PAGE - 1);
+    auto const disk_end = u64(sata_disk0.unwrap().num_sectors())
+                        & ~(alloc::SWAP_SECTORS_PER_PAGE - 1);
+
+    if (disk_end <= first) {
+        terminal.print_line("No room on disk for swap");
+        return;
+    }
 
-    // Identity map everything else
-    for (uptr address = 0x1000; address < 0x400000; address += PAGESIZE) {
-        auto result = kernel_pagedir[0].try_map(address, address, PTE_PW);
-        assert(result.is_ok(), "Failure on initial maps!");
+    if (alloc::init_swap(disk0_queue.unwrap(), first, disk_end - first).is_err()) {
+        terminal.print_line("Could not set up swap");
+        return;
     }
 
-    kernel_pagedir.set_page_directory();
-    pagetables::enable_paging();
+    terminal.print_line("Swap: ", alloc::swap_stats().free_slots * (PAGESIZE / 1024), " KiB");
 }
 
-void Idt::init() {
-    idtr.set_base(reinterpret_cast<uptr>(&_idt[0]));
-    idtr.set_limit(sizeof(IdtEntry) * 63);
-    for (usize i = 0; i < 64; ++i) {
-        auto const ptr =
-            reinterpret_cast<uptr>(isr_stub_table[i]) - kernel::KERNEL_START;
-        auto const code_segment =
-            u16((ptr / kernel::SEGMENT_SIZE) + kernel::KERNEL_CS_SEG_START);
-        _idt[i].set(isr_stub_table[i], 0x8E, code_segment);
-    }
+/// Move the console from the direct map to a write-combining mapping so that scrolling and
+/// clearing go out in bursts. If the mapping fails, nothing changes. The direct map keeps its
+/// alias of the buffer, which the fixed-range MTRRs already make uncached, so that the first
+/// large page doesn't have to be split just to unmap it.
+void map_console() {
+    using pagetables::MemoryType;
 
-    // _idt[0x21].set(reinterpret_cast<void*>(keyboard_handler), 0x8E);
+    auto const page = alloc::ioremap(console::Console::TEXT_BUFFER, PAGESIZE,
+                                     PTE_PW | PTE_G | pagetables::memory_type(MemoryType::WriteCombining));
 
-    __asm__ volatile("lidt %0" : : "m"(idtr)); // load the new IDT
+    if (page.some()) {
+        terminal.set_page(reinterpret_cast<u16*>(page.unwrap()));
+    }
 }
@@ -1,11 +1,28 @@
 #pragma once
-#include "klib/pagetables.hh"
+#include "klib/address_space.hh"
+#include "klib/util.hh"
 
 void setup_pagedir();
-extern wlib::pagetables::PageDirectory kernel_pagedir;
+void map_console();
+extern wlib::pagetables::AddressSpace kernel_pagedir;
+
+// Defined by the linker script (ldconfig.ld): the first byte past the kernel image.
+extern "C" u8 kernel_end[];
 
 namespace kernel {
     auto constexpr SEGMENT_SIZE = 0x10000;
-    auto constexpr KERNEL_START = 0x100000;
+    auto constexpr KERNEL_START = wlib::util::KERNEL_VIRTUAL_BASE + 0x100000;
     auto constexpr KERNEL_CS_SEG_START = 0x10;
+
+    // Kernel address space layout. Everything below KERNEL_VIRTUAL_BASE is left for user space.
+    //
+    // [KERNEL_VIRTUAL_BASE, DIRECT_MAP_END): physical memory from 0, mapped linearly
+    // [VMALLOC_START, VMALLOC_END):          vmalloc window (see kernel/vmalloc.hh)
+    //
+    // Device memory is mapped into the vmalloc window too, with ioremap. RAM beyond what fits
+    // in the direct map is never managed. The x86_64 build keeps the same sizes in the top
+    // 2 GiB, so -mcmodel=kernel works.
+    auto constexpr DIRECT_MAP_END = wlib::util::KERNEL_VIRTUAL_BASE + 0x30000000;
+    auto constexpr VMALLOC_START  = DIRECT_MAP_END;
+    auto constexpr VMALLOC_END    = VMALLOC_START + 0x0E000000;
 };
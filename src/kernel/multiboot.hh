@@ -0,0 +1,70 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/util.hh"
+
+// Structures handed to us by a Multiboot (version 1) compliant loader such as GRUB.
+// All addresses inside them are physical.
+// See https://www.gnu.org/software/grub/manual/multiboot/multiboot.html
+namespace kernel::multiboot {
+    // Value found in %eax when the loader jumps to our entry point.
+    auto constexpr BOOTLOADER_MAGIC = 0x2BADB002_u32;
+
+    enum class InfoFlag : u32 {
+        Memory    = 0x1,  // mem_lower/mem_upper are valid
+        MemoryMap = 0x40, // mmap_length/mmap_addr are valid
+    };
+
+    enum class RegionType : u32 {
+        Available       = 1,
+        Reserved        = 2,
+        ACPIReclaimable = 3,
+        ACPINVS         = 4,
+        BadMemory       = 5,
+    };
+
+    struct MmapEntry {
+        u32 size;       // Size of the rest of this entry, *not* including this field
+        u64 base_addr;
+        u64 length;
+        RegionType type;
+    } __attribute__((packed));
+
+    struct Info {
+        u32 flags;
+        u32 mem_lower;   // KiB of memory below 1 MiB
+        u32 mem_upper;   // KiB of memory above 1 MiB, up to the first hole
+        u32 boot_device;
+        u32 cmdline;
+        u32 mods_count;
+        u32 mods_addr;
+        u32 syms[4];
+        u32 mmap_length; // Length of the memory map buffer in bytes
+        u32 mmap_addr;   // Physical address of the first MmapEntry
+
+        [[nodiscard]] auto constexpr has(InfoFlag flag) const -> bool {
+            return flags & u32(flag);
+        }
+
+        // Call `func(base, length)` for every region the loader reports as available RAM.
+        // Regions (or parts of regions) above 4 GiB are skipped since we cannot address them.
+        template<typename F>
+        void for_each_available(F func) const {
+            // mmap_addr is physical; the map sits in low memory, which is in the direct map
+            auto entry_addr = wlib::util::physical_addr_to_kernel(mmap_addr);
+            auto const end_addr = entry_addr + mmap_length;
+
+            while (entry_addr < end_addr) {
+                auto const* entry = reinterpret_cast<MmapEntry const*>(entry_addr);
+                entry_addr += entry->size + sizeof(entry->size);
+
+                if (entry->type != RegionType::Available || entry->base_addr > 0xFFFFFFFF) {
+                    continue;
+                }
+
+                auto const end = entry->base_addr + entry->length;
+                auto const clamped_end = end > 0x100000000 ? 0x100000000 : end;
+                func(u64(entry->base_addr), u64(clamped_end - entry->base_addr));
+            }
+        }
+    } __attribute__((packed));
+}; // namespace kernel::multiboot
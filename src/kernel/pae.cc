@@ -0,0 +1,538 @@
+#include "klib/pae.hh"
+#include "kernel/alloc.hh"
+#include "kernel/cow.hh"
+#include "kernel/kernel.hh"
+#include "kernel/swap_entry.hh"
+#include "kernel/zeroed_pages.hh"
+#include "klib/result.hh"
+#include "klib/x86.hh"
+
+namespace wlib::pagetables::pae {
+    void Entry::set(u64 const addr, u16 const perm) {
+        _internal = addr | (perm & ~PTE_NX);
+
+        if ((perm & PTE_NX) && no_execute_enabled()) {
+            _internal |= NX_BIT;
+        }
+    }
+
+    // The table [entry] points to.
+    auto static table_at(Entry const& entry) -> Table& {
+        return *reinterpret_cast<Table*>(util::physical_addr_to_kernel(uptr(entry.address())));
+    }
+
+    // Clone the user mappings under entries [first, end) of [parent] into [child], sharing every
+    // page (see cow::share_page). [levels] is how far above the pagetables [parent] is: 0 if it
+    // is one. Large pages are only ever kernel or device memory, so they are copied as they are.
+    auto static clone_table(Table& parent, Table& child, u32 const levels,
+                            usize const first, usize const end) -> Result<Null, Null> {
+        for (auto i = first; i < end; ++i) {
+            auto& entry = parent[i];
+
+            if (!entry.present()) {
+                continue;
+            }
+
+            if (levels == 0) {
+                cow::share_page(entry, child[i]);
+                continue;
+            }
+
+            if (entry.large()) {
+                child[i].copy_from(entry);
+                continue;
+            }
+
+            auto new_table = alloc::kalloc_zeroed();
+
+            if (new_table.none()) {
+                return Result<Null, Null>::Err();
+            }
+
+            child[i].copy_from(entry);
+            child[i].set_address(util::kernel_to_physical_addr(new_table.unwrap()));
+
+            auto result = clone_table(table_at(entry), table_at(child[i]), levels - 1,
+                                      0, Table::NUM_ENTRIES);
+
+            if (result.is_err()) {
+                return result;
+            }
+        }
+
+        return Result<Null, Null>::Ok();
+    }
+
+    // Undo clone_table: drop every page under entries [first, end) and free the tables.
+    void static release_table(Table& table, u32 const levels, usize const first, usize const end) {
+        for (auto i = first; i < end; ++i) {
+            auto& entry = table[i];
+
+            if (!entry.present()) {
+                continue;
+            }
+
+            if (levels == 0) {
+                cow::release_page(entry);
+            } else if (!entry.large()) {
+                auto& next = table_at(entry);
+                release_table(next, levels - 1, 0, Table::NUM_ENTRIES);
+                simple_allocator.kfree(uptr(&next));
+            }
+
+            entry.clear();
+        }
+    }
+
+    PageDirectoryPointerTable::PageDirectoryPointerTable() {
+        for (usize i = 0; i < NUM_ENTRIES; ++i) {
+            _pointers[i] = 0;
+        }
+    }
+
+    auto PageDirectoryPointerTable::directory(uptr const address, bool const create) const -> Option<Table&> {
+        auto& pointer = _pointers[pdpt_idx(address)];
+
+        if (!(pointer & PTE_P)) {
+            if (!create) {
+                return Option<Table&>::None();
+            }
+
+            auto new_pd = alloc::kalloc_zeroed();
+
+            if (new_pd.none()) {
+                return Option<Table&>::None();
+            }
+
+            uptr cr3;
+            asm volatile("mov %%cr3, %0" : "=r"(cr3));
+            auto const loaded = cr3 == util::kernel_to_physical_addr(uptr(&_pointers[0]));
+
+            // Only P (and the cache bits) are allowed up here
+            pointer = util::kernel_to_physical_addr(new_pd.unwrap()) | PTE_P;
+
+            if (loaded) {
+                set_page_directory();
+            }
+        }
+
+        auto& pd = *reinterpret_cast<Table*>(util::physical_addr_to_kernel(uptr(pointer & ~u64(PAGESIZE - 1))));
+        return Option<Table&>::Some(pd);
+    }
+
+    auto PageDirectoryPointerTable::get_pt(uptr const address) const -> Option<Table&> {
+        auto const pd = directory(address, false);
+
+        if (pd.none()) {
+            return Option<Table&>::None();
+        }
+
+        auto const& pde = pd.unwrap()[Table::pd_idx(address)];
+
+        if (!pde.present() || pde.large()) {
+            return Option<Table&>::None();
+        }
+
+        auto& pt = *reinterpret_cast<Table*>(util::physical_addr_to_kernel(uptr(pde.address())));
+        return Option<Table&>::Some(pt);
+    }
+
+    auto PageDirectoryPointerTable::try_map(uptr const virtual_addr,
+                                            u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+        auto pd = directory(virtual_addr, true);
+
+        if (pd.none()) {
+            return Result<Null, Null>::Err();
+        }
+
+        auto& pde = pd.unwrap()[Table::pd_idx(virtual_addr)];
+
+        if (pde.large()) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
+        if (!pde.present()) {
+            // New page tables must start out empty, just like in non-PAE mode
+            auto new_pt = alloc::kalloc_zeroed();
+
+            if (new_pt.none()) {
+                return Result<Null, Null>::Err();
+            }
+
+            pde.set(util::kernel_to_physical_addr(new_pt.unwrap()), PTE_P | PTE_W);
+        }
+
+        auto& pt = get_pt(virtual_addr).unwrap();
+        pt[Table::pt_idx(virtual_addr)].set(physical_addr, perm);
+
+        return Result<Null, Null>::Ok();
+    }
+
+    auto PageDirectoryPointerTable::map_large(uptr const virtual_addr,
+                                              u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+        if (virtual_addr % LARGE_PAGESIZE != 0 || physical_addr % LARGE_PAGESIZE != 0) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
+        auto pd = directory(virtual_addr, true);
+
+        if (pd.none()) {
+            return Result<Null, Null>::Err();
+        }
+
+        auto& pde = pd.unwrap()[Table::pd_idx(virtual_addr)];
+
+        if (pde.present()) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
+        pde.set_large(physical_addr, perm);
+        return Result<Null, Null>::Ok();
+    }
+
+    auto PageDirectoryPointerTable::unmap(uptr const virtual_addr) -> Nullable<u64, u64(-1)> {
+        auto maybe_pt = get_pt(virtual_addr);
+
+        if (maybe_pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto& pte = maybe_pt.unwrap()[Table::pt_idx(virtual_addr)];
+
+        if (!pte.present()) {
+            // Drop the swap entry, if there is one
+            pte.clear();
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto const physical_addr = pte.address();
+        pte.clear();
+        invalidate_page(virtual_addr);
+
+        return physical_addr;
+    }
+
+    auto PageDirectoryPointerTable::va_to_pa(uptr const address) const -> Nullable<u64, u64(-1)> {
+        auto const pd = directory(address, false);
+
+        if (pd.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto const& pde = pd.unwrap()[Table::pd_idx(address)];
+
+        if (pde.large()) {
+            return pde.large_page_address() | (address & (LARGE_PAGESIZE - 1) & ~uptr(PAGESIZE - 1));
+        }
+
+        auto const pt = get_pt(address);
+
+        if (pt.none() || !pt.unwrap()[Table::pt_idx(address)].present()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        return pt.unwrap()[Table::pt_idx(address)].address();
+    }
+
+    auto PageDirectoryPointerTable::clone_into(PageDirectoryPointerTable& child) -> Result<Null, Null> {
+        auto const kernel_directory = pdpt_idx(util::KERNEL_VIRTUAL_BASE);
+
+        for (usize d = 0; d < kernel_directory; ++d) {
+            auto const address = uptr(d) << 30;
+            auto pd = directory(address, false);
+
+            if (pd.none()) {
+                continue;
+            }
+
+            auto child_pd = child.directory(address, true);
+
+            if (child_pd.none()
+                || clone_table(pd.unwrap(), child_pd.unwrap(), 1, 0, Table::NUM_ENTRIES).is_err()) {
+                return Result<Null, Null>::Err();
+            }
+        }
+
+        // The kernel half's directory is shared, so later kernel mappings show up in [child] too
+        child._pointers[kernel_directory] = _pointers[kernel_directory];
+
+        // We just took write access away from our own pages
+        flush_tlb();
+        return Result<Null, Null>::Ok();
+    }
+
+    // clone_into shares the kernel half's whole directory, so no kernel entry can be missing
+    auto PageDirectoryPointerTable::sync_kernel(PageDirectoryPointerTable const&, uptr) -> bool {
+        return false;
+    }
+
+    void PageDirectoryPointerTable::release_user() {
+        for (usize d = 0; d < pdpt_idx(util::KERNEL_VIRTUAL_BASE); ++d) {
+            auto pd = directory(uptr(d) << 30, false);
+
+            if (pd.none()) {
+                continue;
+            }
+
+            release_table(pd.unwrap(), 1, 0, Table::NUM_ENTRIES);
+            simple_allocator.kfree(uptr(&pd.unwrap()));
+            _pointers[d] = 0;
+        }
+
+        flush_tlb();
+    }
+
+    auto PageDirectoryPointerTable::resolve_cow(uptr const address) -> bool {
+        auto pt = get_pt(address);
+        return pt.some() && cow::break_cow(pt.unwrap()[Table::pt_idx(address)], address);
+    }
+
+    auto PageDirectoryPointerTable::test_and_clear_accessed(uptr const address) -> bool {
+        auto pt = get_pt(address);
+        return pt.some()
+            && swap_entry::test_and_clear_accessed(pt.unwrap()[Table::pt_idx(address)], address);
+    }
+
+    auto PageDirectoryPointerTable::swap_out(uptr const address, u32 const slot) -> Nullable<u64, u64(-1)> {
+        auto pt = get_pt(address);
+
+        if (pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        return swap_entry::swap_out(pt.unwrap()[Table::pt_idx(address)], slot, address);
+    }
+
+    auto PageDirectoryPointerTable::remap(uptr const address, u64 const physical_addr) -> Nullable<u64, u64(-1)> {
+        auto pt = get_pt(address);
+
+        if (pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        return swap_entry::remap(pt.unwrap()[Table::pt_idx(address)], physical_addr, address);
+    }
+
+    auto PageDirectoryPointerTable::swap_slot(uptr const address) const -> Nullable<u32, u32(-1)> {
+        auto pt = get_pt(address);
+
+        if (pt.none()) {
+            return Nullable<u32, u32(-1)>();
+        }
+
+        return swap_entry::slot(pt.unwrap()[Table::pt_idx(address)]);
+    }
+
+    void PageDirectoryPointerTable::set_page_directory() const {
+        asm volatile("mov %0, %%cr3" : : "r"(util::kernel_to_physical_addr(uptr(&_pointers[0])))
+                     : "memory");
+    }
+
+#ifdef __x86_64__
+    // Follow [entry] down a level, allocating an empty table for it if it is missing and [create].
+    auto static next_level(Entry& entry, bool const create) -> Option<Table&> {
+        if (entry.large()) {
+            return Option<Table&>::None();
+        }
+
+        if (!entry.present()) {
+            if (!create) {
+                return Option<Table&>::None();
+            }
+
+            auto new_table = alloc::kalloc_zeroed();
+
+            if (new_table.none()) {
+                return Option<Table&>::None();
+            }
+
+            entry.set(util::kernel_to_physical_addr(new_table.unwrap()), PTE_P | PTE_W);
+        }
+
+        auto& table = *reinterpret_cast<Table*>(util::physical_addr_to_kernel(uptr(entry.address())));
+        return Option<Table&>::Some(table);
+    }
+
+    auto PageMapLevel4::directory(uptr const address, bool const create) const -> Option<Table&> {
+        auto pdpt = next_level(_entries[pml4_idx(address)], create);
+
+        if (pdpt.none()) {
+            return Option<Table&>::None();
+        }
+
+        return next_level(pdpt.unwrap()[pdpt_idx(address)], create);
+    }
+
+    auto PageMapLevel4::get_pt(uptr const address) const -> Option<Table&> {
+        auto pd = directory(address, false);
+
+        if (pd.none()) {
+            return Option<Table&>::None();
+        }
+
+        return next_level(pd.unwrap()[Table::pd_idx(address)], false);
+    }
+
+    auto PageMapLevel4::try_map(uptr const virtual_addr,
+                                u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+        auto pd = directory(virtual_addr, true);
+
+        if (pd.none()) {
+            return Result<Null, Null>::Err();
+        }
+
+        auto pt = next_level(pd.unwrap()[Table::pd_idx(virtual_addr)], true);
+
+        if (pt.none()) {
+            return Result<Null, Null>::Err();
+        }
+
+        pt.unwrap()[Table::pt_idx(virtual_addr)].set(physical_addr, perm);
+        return Result<Null, Null>::Ok();
+    }
+
+    auto PageMapLevel4::map_large(uptr const virtual_addr,
+                                  u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+        if (virtual_addr % LARGE_PAGESIZE != 0 || physical_addr % LARGE_PAGESIZE != 0) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
+        auto pd = directory(virtual_addr, true);
+
+        if (pd.none()) {
+            return Result<Null, Null>::Err();
+        }
+
+        auto& pde = pd.unwrap()[Table::pd_idx(virtual_addr)];
+
+        if (pde.present()) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
+        pde.set_large(physical_addr, perm);
+        return Result<Null, Null>::Ok();
+    }
+
+    auto PageMapLevel4::unmap(uptr const virtual_addr) -> Nullable<u64, u64(-1)> {
+        auto pt = get_pt(virtual_addr);
+
+        if (pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto& pte = pt.unwrap()[Table::pt_idx(virtual_addr)];
+
+        if (!pte.present()) {
+            pte.clear();
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto const physical_addr = pte.address();
+        pte.clear();
+        invalidate_page(virtual_addr);
+
+        return physical_addr;
+    }
+
+    auto PageMapLevel4::va_to_pa(uptr const address) const -> Nullable<u64, u64(-1)> {
+        auto pd = directory(address, false);
+
+        if (pd.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto const& pde = pd.unwrap()[Table::pd_idx(address)];
+
+        if (pde.large()) {
+            return pde.large_page_address() | (address & (LARGE_PAGESIZE - 1) & ~uptr(PAGESIZE - 1));
+        }
+
+        auto pt = get_pt(address);
+
+        if (pt.none() || !pt.unwrap()[Table::pt_idx(address)].present()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        return pt.unwrap()[Table::pt_idx(address)].address();
+    }
+
+    // The lower half of the PML4 is user space; the kernel's half is shared by pointing at
+    // the same page directory pointer tables, so kernel mappings made later show up everywhere.
+    auto static constexpr FIRST_KERNEL_PML4E = Table::NUM_ENTRIES / 2;
+
+    auto PageMapLevel4::clone_into(PageMapLevel4& child) -> Result<Null, Null> {
+        for (auto i = FIRST_KERNEL_PML4E; i < Table::NUM_ENTRIES; ++i) {
+            child._entries[i].copy_from(_entries[i]);
+        }
+
+        if (clone_table(_entries, child._entries, 3, 0, FIRST_KERNEL_PML4E).is_err()) {
+            return Result<Null, Null>::Err();
+        }
+
+        flush_tlb();
+        return Result<Null, Null>::Ok();
+    }
+
+    // Below the top level, kernel tables are shared, so only a new top level entry can be missing
+    auto PageMapLevel4::sync_kernel(PageMapLevel4 const& kernel, uptr const address) -> bool {
+        auto const idx = pml4_idx(address);
+
+        if (idx < FIRST_KERNEL_PML4E || _entries[idx].present() || !kernel._entries[idx].present()) {
+            return false;
+        }
+
+        _entries[idx].copy_from(kernel._entries[idx]);
+        return true;
+    }
+
+    void PageMapLevel4::release_user() {
+        release_table(_entries, 3, 0, FIRST_KERNEL_PML4E);
+        flush_tlb();
+    }
+
+    auto PageMapLevel4::resolve_cow(uptr const address) -> bool {
+        auto pt = get_pt(address);
+        return pt.some() && cow::break_cow(pt.unwrap()[Table::pt_idx(address)], address);
+    }
+
+    auto PageMapLevel4::test_and_clear_accessed(uptr const address) -> bool {
+        auto pt = get_pt(address);
+        return pt.some()
+            && swap_entry::test_and_clear_accessed(pt.unwrap()[Table::pt_idx(address)], address);
+    }
+
+    auto PageMapLevel4::swap_out(uptr const address, u32 const slot) -> Nullable<u64, u64(-1)> {
+        auto pt = get_pt(address);
+
+        if (pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        return swap_entry::swap_out(pt.unwrap()[Table::pt_idx(address)], slot, address);
+    }
+
+    auto PageMapLevel4::remap(uptr const address, u64 const physical_addr) -> Nullable<u64, u64(-1)> {
+        auto pt = get_pt(address);
+
+        if (pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        return swap_entry::remap(pt.unwrap()[Table::pt_idx(address)], physical_addr, address);
+    }
+
+    auto PageMapLevel4::swap_slot(uptr const address) const -> Nullable<u32, u32(-1)> {
+        auto pt = get_pt(address);
+
+        if (pt.none()) {
+            return Nullable<u32, u32(-1)>();
+        }
+
+        return swap_entry::slot(pt.unwrap()[Table::pt_idx(address)]);
+    }
+
+    void PageMapLevel4::set_page_directory() const {
+        asm volatile("mov %0, %%cr3" : : "r"(util::kernel_to_physical_addr(uptr(this))) : "memory");
+    }
+#endif
+};
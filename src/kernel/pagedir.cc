@@ -0,0 +1,44 @@
+#include "kernel/kernel.hh"
+#include "kernel/alloc.hh"
+#include "klib/assert.hh"
+#include "klib/pagetables.hh"
+
+using namespace wlib;
+
+using pagetables::AddressSpace;
+using pagetables::PageTable;
+
+// Special, static variables for the starting page directory.
+AddressSpace kernel_pagedir;
+#ifndef __x86_64__
+static PageTable io_pt;
+#endif
+
+/// Switch from the boot page directory (see grub/crt0.asm) to the kernel pagedir.
+/// Paging, and PSE or PAE, are already enabled by then.
+void setup_pagedir() {
+    pagetables::enable_global_pages();
+    pagetables::enable_no_execute();
+    pagetables::enable_pat();
+    pagetables::enable_write_protect();
+
+#ifndef __x86_64__
+    if (!pagetables::pae_enabled()) {
+        kernel_pagedir.legacy().add_pagetable(1019, io_pt, PTE_PW);
+    }
+#endif
+
+    // Direct map all of managed RAM with large pages, so anything simple_allocator hands
+    // out is addressable. Unlike the boot page directory, nothing is mapped in the lower
+    // half: it is left for user space, and null pointers fault. Kernel mappings are the
+    // same in every address space, so they are global.
+    auto const step = kernel_pagedir.large_page_size();
+
+    for (uptr address = 0; address < simple_allocator.end_address(); address += step) {
+        auto result = kernel_pagedir.map_large(util::physical_addr_to_kernel(address),
+                                               address, PTE_PW | PTE_G);
+        assert(result.is_ok(), "Failure mapping physical memory!");
+    }
+
+    kernel_pagedir.set_page_directory();
+}
@@ -4,48 +4,57 @@
 #include "klib/nullable.hh"
 #include "kernel/kernel.hh"
 #include "kernel/alloc.hh"
+#include "kernel/cow.hh"
+#include "kernel/swap_entry.hh"
+#include "kernel/zeroed_pages.hh"
 #include "klib/result.hh"
+#include "klib/x86.hh"
 
 namespace wlib::pagetables {
     auto PageDirectory::map(uptr const virtual_addr, 
-                            uptr const physical_addr, u8 const perm) -> Result<Null, Null> {
+                            uptr const physical_addr, u16 const perm) -> Result<Null, Null> {
         auto const pd_idx = va_to_idx(virtual_addr);
         auto& pagedir = _entries[pd_idx];
         return pagedir.map(virtual_addr, physical_addr, perm);
     }
 
     auto PageDirectory::try_map(uptr const virtual_addr, 
-                                uptr const physical_addr, u8 const perm) -> Result<Null, Null> {
+                                uptr const physical_addr, u16 const perm) -> Result<Null, Null> {
         auto const pd_idx = va_to_idx(virtual_addr);
 
         auto& pagedir = _entries[pd_idx];
+
+        if (pagedir.large()) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
         if (pagedir.pt_address() == 0) {
-            auto new_pt = simple_allocator.kalloc(PAGESIZE);
+            // New page tables must start out empty, or else weird bugs start to occur
+            auto new_pt = alloc::kalloc_zeroed();
 
             if (new_pt.none()) {
                 return Result<Null, Null>::Err();
             }
 
-            if (pagedir.add_pt(new_pt.unwrap_as<uptr>(), perm).is_err()) {
+            if (pagedir.add_pt(new_pt.unwrap_as<uptr>(), u8(perm)).is_err()) {
                 simple_allocator.kfree(new_pt.unwrap());
                 return Result<Null, Null>::Err();
             }
-            
-            // Need to zero out pages, or else weird bugs
-            // start to occur 
-            auto ptr = new_pt.unwrap_as<int*>();
-            
-            for (u16 i = 0; i < PAGESIZE / sizeof(int); ++i) {
-                // We can assume PAGSIZE is divisible by 4 reasonably
-                *ptr = 0;
-                ++ptr;
-            }
         }
 
         return pagedir.try_map(virtual_addr, physical_addr, perm);
     }
 
 
+    auto PageDirectory::map_large(uptr const virtual_addr,
+                                  uptr const physical_addr, u16 const perm) -> Result<Null, Null> {
+        if (virtual_addr % LARGE_PAGESIZE != 0) [[unlikely]] {
+            return Result<Null, Null>::Err();
+        }
+
+        return _entries[va_to_idx(virtual_addr)].map_large(physical_addr, perm);
+    }
+
     auto PageDirectory::add_pagetable(usize const idx, 
                                       PageTable const& ptable, u8 const perm) -> Result<Null, Null> {
         auto const ptable_addr = reinterpret_cast<uptr>(&ptable);
@@ -54,20 +63,156 @@ namespace wlib::pagetables {
 
     /// Enable the paging [PG] bit in cr0.
     void enable_paging() {
-        u32 cr0;
+        uptr cr0;
         asm volatile("mov %%cr0, %0" : "=r"(cr0));
         cr0 |= 0x80000000;
         asm volatile("mov %0, %%cr0" : : "r"(cr0));
     }
 
+#ifdef __x86_64__
+    // Long mode always uses the PAE entry format
+    auto pae_enabled() -> bool {
+        return true;
+    }
+#else
+    // Set by crt0 when it enabled PAE paging
+    extern "C" u8 boot_pae_enabled;
+
+    auto pae_enabled() -> bool {
+        return boot_pae_enabled != 0;
+    }
+#endif
+
+    auto static constexpr MSR_EFER = 0xC0000080_u32;
+    auto static constexpr EFER_NXE = 1_u32 << 11;
+
+    static bool no_execute = false;
+
+    auto enable_no_execute() -> bool {
+        // NX is only available in the extended leaves (CPUID 0x80000001, EDX bit 20), and
+        // only means anything with 64-bit entries
+        if (!pae_enabled() || x86::cpuid(0x80000000).eax < 0x80000001
+            || !(x86::cpuid(0x80000001).edx & (1 << 20))) {
+            return false;
+        }
+
+        auto const efer = x86::rdmsr(MSR_EFER);
+        x86::wrmsr(MSR_EFER, efer.eax | EFER_NXE, efer.edx);
+        no_execute = true;
+        return true;
+    }
+
+    auto no_execute_enabled() -> bool {
+        return no_execute;
+    }
+
+    auto static constexpr MSR_PAT = 0x277_u32;
+
+    // Each byte is one PAT entry, indexed by PAT:PCD:PWT. Entries 0-6 keep their power-on
+    // values (WB, WT, UC-, UC, WB, WT, UC-) so mappings without PTE_PAT behave as before;
+    // entry 7 becomes write-combining.
+    auto static constexpr PAT_LOW  = 0x00070406_u32;
+    auto static constexpr PAT_HIGH = 0x01070406_u32;
+
+    static bool pat = false;
+
+    void enable_pat() {
+        // CPUID leaf 1, EDX bit 16: Page Attribute Table
+        if (!(x86::cpuid(1).edx & (1 << 16))) {
+            return;
+        }
+
+        x86::wrmsr(MSR_PAT, PAT_LOW, PAT_HIGH);
+        flush_tlb_all();
+        pat = true;
+    }
+
+    auto memory_type(MemoryType const type) -> u16 {
+        using enum MemoryType;
+
+        switch (type) {
+            case WriteBack:
+                return 0;
+            case Uncached:
+                return PTE_PCD | PTE_PWT;
+            case WriteCombining:
+                return pat ? PTE_PAT | PTE_PCD | PTE_PWT : PTE_PCD | PTE_PWT;
+        }
+
+        return PTE_PCD | PTE_PWT;
+    }
+
+    // Beyond this many pages, invalidate_range flushes everything rather than using invlpg.
+    auto static constexpr INVLPG_MAX_PAGES = 32_usize;
+
+    auto static read_cr4() -> uptr {
+        uptr cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        return cr4;
+    }
+
+    void static write_cr4(uptr const cr4) {
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+
+    auto static constexpr CR4_PGE = uptr(0x80);
+
+    void enable_global_pages() {
+        // CPUID leaf 1, EDX bit 13: Page Global Enable
+        if (x86::cpuid(1).edx & (1 << 13)) {
+            write_cr4(read_cr4() | CR4_PGE);
+        }
+    }
+
+    void invalidate_page(uptr const virtual_addr) {
+        x86::invlpg(virtual_addr);
+    }
+
+    void invalidate_range(uptr const virtual_addr, usize const size) {
+        auto const start = virtual_addr & ~uptr(PAGESIZE - 1);
+        auto const end = virtual_addr + size;
+
+        if ((end - start + PAGESIZE - 1) / PAGESIZE > INVLPG_MAX_PAGES) {
+            flush_tlb_all();
+            return;
+        }
+
+        for (auto address = start; address < end; address += PAGESIZE) {
+            x86::invlpg(address);
+        }
+    }
+
+    void flush_tlb() {
+        uptr cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+
+    void flush_tlb_all() {
+        auto const cr4 = read_cr4();
+
+        if (cr4 & CR4_PGE) {
+            // Clearing PGE flushes global entries as well
+            write_cr4(cr4 & ~CR4_PGE);
+            write_cr4(cr4);
+        } else {
+            flush_tlb();
+        }
+    }
+
     /// Set this page directory as the new page directory.
     void PageDirectory::set_page_directory() const {
-        asm volatile("mov %0, %%cr3" : : "r"(this));
+        asm volatile("mov %0, %%cr3" : : "r"(util::kernel_to_physical_addr(uptr(this))));
     }
 
     
     auto PageDirectory::va_to_pa(uptr const address) const -> Nullable<uptr, uptr(-1)> {
         usize const pd_idx = va_to_idx(address);
+
+        if (_entries[pd_idx].large()) {
+            return _entries[pd_idx].large_page_address() | (address & 0x3FF000);
+        }
+
         auto const pt = _entries[pd_idx].get_pt();
         if (pt.some()) {
             return pt.unwrap().va_to_pa(address);
@@ -76,11 +221,167 @@ namespace wlib::pagetables {
         }
     }
 
+    auto PageDirectory::unmap(uptr const virtual_addr) -> Nullable<uptr, uptr(-1)> {
+        auto maybe_pt = _entries[va_to_idx(virtual_addr)].get_pt();
+
+        if (maybe_pt.none()) {
+            return Nullable<uptr, uptr(-1)>();
+        }
+
+        auto& pt = maybe_pt.unwrap();
+        auto& pte = pt[pt.pt_idx(virtual_addr)];
+
+        if (!pte.present()) {
+            // Drop the swap entry, if there is one
+            pte.unmap();
+            return Nullable<uptr, uptr(-1)>();
+        }
+
+        auto const physical_addr = pte.page_address();
+        pte.unmap();
+        invalidate_page(virtual_addr);
+
+        return physical_addr;
+    }
+
+    // Entries from here on map the kernel, which is the same in every address space
+    auto static constexpr FIRST_KERNEL_PDE = usize((util::KERNEL_VIRTUAL_BASE & 0xFFC00000) >> 22);
+
+    auto PageDirectory::clone_into(PageDirectory& child) -> Result<Null, Null> {
+        for (usize idx = 0; idx < NUM_ENTRIES; ++idx) {
+            auto& pde = _entries[idx];
+
+            // Kernel, empty and large entries (never used for user memory) are shared as they are
+            if (idx >= FIRST_KERNEL_PDE || pde.pt_address() == 0) {
+                child._entries[idx].copy_from(pde);
+                continue;
+            }
+
+            auto new_pt = alloc::kalloc_zeroed();
+
+            if (new_pt.none()) {
+                return Result<Null, Null>::Err();
+            }
+
+            child._entries[idx].copy_from(pde);
+            child._entries[idx].set_pt_address(new_pt.unwrap());
+
+            auto& parent_pt = pde.get_pt().unwrap();
+            auto& child_pt = child._entries[idx].get_pt().unwrap();
+
+            for (usize i = 0; i < PageTable::NUM_ENTRIES; ++i) {
+                if (parent_pt[i].present()) {
+                    cow::share_page(parent_pt[i], child_pt[i]);
+                }
+            }
+        }
+
+        // We just took write access away from our own pages
+        flush_tlb();
+        return Result<Null, Null>::Ok();
+    }
+
+    auto PageDirectory::sync_kernel(PageDirectory const& kernel, uptr const address) -> bool {
+        auto const idx = va_to_idx(address);
+
+        if (idx < FIRST_KERNEL_PDE || _entries[idx].present() || !kernel._entries[idx].present()) {
+            return false;
+        }
+
+        _entries[idx].copy_from(kernel._entries[idx]);
+        return true;
+    }
+
+    void PageDirectory::release_user() {
+        for (usize idx = 0; idx < FIRST_KERNEL_PDE; ++idx) {
+            auto maybe_pt = _entries[idx].get_pt();
+
+            if (maybe_pt.none()) {
+                continue;
+            }
+
+            auto& pt = maybe_pt.unwrap();
+
+            for (usize i = 0; i < PageTable::NUM_ENTRIES; ++i) {
+                if (pt[i].present()) {
+                    cow::release_page(pt[i]);
+                }
+            }
+
+            _entries[idx].clear();
+            simple_allocator.kfree(uptr(&pt));
+        }
+
+        flush_tlb();
+    }
+
+    auto PageDirectory::resolve_cow(uptr const address) -> bool {
+        auto maybe_pt = _entries[va_to_idx(address)].get_pt();
+
+        if (maybe_pt.none()) {
+            return false;
+        }
+
+        auto& pt = maybe_pt.unwrap();
+        return cow::break_cow(pt[pt.pt_idx(address)], address);
+    }
+
+    auto PageDirectory::test_and_clear_accessed(uptr const address) -> bool {
+        auto maybe_pt = _entries[va_to_idx(address)].get_pt();
+
+        if (maybe_pt.none()) {
+            return false;
+        }
+
+        auto& pt = maybe_pt.unwrap();
+        return swap_entry::test_and_clear_accessed(pt[pt.pt_idx(address)], address);
+    }
+
+    auto PageDirectory::swap_out(uptr const address, u32 const slot) -> Nullable<u64, u64(-1)> {
+        auto maybe_pt = _entries[va_to_idx(address)].get_pt();
+
+        if (maybe_pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto& pt = maybe_pt.unwrap();
+        return swap_entry::swap_out(pt[pt.pt_idx(address)], slot, address);
+    }
+
+    auto PageDirectory::remap(uptr const address, u64 const physical_addr) -> Nullable<u64, u64(-1)> {
+        auto maybe_pt = _entries[va_to_idx(address)].get_pt();
+
+        if (maybe_pt.none()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto& pt = maybe_pt.unwrap();
+        return swap_entry::remap(pt[pt.pt_idx(address)], physical_addr, address);
+    }
+
+    auto PageDirectory::swap_slot(uptr const address) const -> Nullable<u32, u32(-1)> {
+        auto maybe_pt = _entries[va_to_idx(address)].get_pt();
+
+        if (maybe_pt.none()) {
+            return Nullable<u32, u32(-1)>();
+        }
+
+        auto const& pt = maybe_pt.unwrap();
+        return swap_entry::slot(pt[pt.pt_idx(address)]);
+    }
+
+    void enable_write_protect() {
+        uptr cr0;
+        asm volatile("mov %%cr0, %0" : "=r"(cr0));
+        cr0 |= 0x10000;
+        asm volatile("mov %0, %%cr0" : : "r"(cr0));
+    }
+
     auto PageDirectoryEntry::add_pt(uptr const ptable_addr, u8 const perm) -> Result<Null, Null> {
         if (pt_address() != 0) [[unlikely]] {
             return Result<Null, Null>::Err({});
         } 
-        _internal = ptable_addr | PTE_P | PTE_W;
+        _internal = util::kernel_to_physical_addr(ptable_addr) | PTE_P | PTE_W;
         return Result<Null, Null>::Ok();
     }
 
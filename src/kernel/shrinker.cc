@@ -0,0 +1,53 @@
+#include "kernel/shrinker.hh"
+#include "klib/array.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+auto static constexpr MAX_SHRINKERS = 8_usize;
+
+static Array<Shrinker, MAX_SHRINKERS> shrinkers;
+static usize num_shrinkers = 0;
+
+// Set while the shrinkers run: if one of them allocates and that fails too, it fails for real
+static bool shrinking = false;
+
+auto wlib::alloc::register_shrinker(Shrinker const shrinker) -> Result<Null, Null> {
+    if (num_shrinkers == MAX_SHRINKERS) {
+        return Result<Null, Null>::Err();
+    }
+
+    shrinkers[num_shrinkers] = shrinker;
+    ++num_shrinkers;
+    return Result<Null, Null>::Ok();
+}
+
+// shrink_caches: Go down the list until enough has been freed, skipping shrinkers with
+// nothing to give so that e.g. swap isn't asked to do I/O for nothing.
+auto wlib::alloc::shrink_caches(u32 const pages) -> u32 {
+    if (shrinking) {
+        return 0;
+    }
+
+    shrinking = true;
+    u32 freed = 0;
+
+    for (usize i = 0; i < num_shrinkers && freed < pages; ++i) {
+        if (shrinkers[i].count() > 0) {
+            freed += shrinkers[i].scan(pages - freed);
+        }
+    }
+
+    shrinking = false;
+    return freed;
+}
+
+auto wlib::alloc::reclaimable_pages() -> u32 {
+    u32 total = 0;
+
+    for (usize i = 0; i < num_shrinkers; ++i) {
+        total += shrinkers[i].count();
+    }
+
+    return total;
+}
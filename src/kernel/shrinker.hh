@@ -0,0 +1,28 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/result.hh"
+
+namespace wlib::alloc {
+    // Shrinkers: anything that holds on to memory it could do without (caches, pools, pages
+    // that could be swapped out) registers one, and simple_allocator calls them when kalloc
+    // is about to fail. That way caches can grow as large as they like while memory is plentiful.
+    struct Shrinker {
+        // The number of pages that could be given back right now.
+        auto (*count)() -> u32;
+
+        // Give back up to about [pages] pages to simple_allocator. Returns how many were freed.
+        // Must not rely on kalloc succeeding; it may wait for the disk.
+        auto (*scan)(u32 pages) -> u32;
+    };
+
+    // Shrinkers are asked in the order they were registered, so register the cheapest first.
+    // Fails if there is no room for another one.
+    [[nodiscard]] auto register_shrinker(Shrinker shrinker) -> Result<Null, Null>;
+
+    // Ask the shrinkers to free [pages] pages. Returns how many they freed, which may be more
+    // or less. Calls made from within a shrinker do nothing.
+    auto shrink_caches(u32 pages) -> u32;
+
+    // Total of every shrinker's count.
+    [[nodiscard]] auto reclaimable_pages() -> u32;
+}; // namespace wlib::alloc
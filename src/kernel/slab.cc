@@ -0,0 +1,214 @@
+#include "kernel/slab.hh"
+#include "kernel/alloc.hh"
+#include "klib/array.hh"
+#include "klib/assert.hh"
+#include "klib/pagetables.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+// Size classes for kmalloc: 16, 32, ..., 2048 bytes, each aligned to its own size.
+auto static constexpr SMALLEST_CLASS_SIZE = 4_u8; // log2(16)
+auto static constexpr NUM_SIZE_CLASSES = 8_u8;
+auto static constexpr LARGEST_CLASS = usize(1) << (SMALLEST_CLASS_SIZE + NUM_SIZE_CLASSES - 1);
+
+static Array<SlabCache, NUM_SIZE_CLASSES> size_classes {
+    SlabCache(16, 16),   SlabCache(32, 32),   SlabCache(64, 64),     SlabCache(128, 128),
+    SlabCache(256, 256), SlabCache(512, 512), SlabCache(1024, 1024), SlabCache(2048, 2048),
+};
+
+// alloc: Take an object from the first partial slab.
+// If there is none, reuse the cached empty slab, or failing that, grow by a new slab.
+// A slab whose last free object is taken becomes full and leaves the partial list.
+auto SlabCache::alloc() -> Nullable<uptr, 0> {
+    auto* s = _partial;
+
+    if (s == nullptr) {
+        if (_empty != nullptr) {
+            s = _empty;
+            _empty = nullptr;
+        } else {
+            s = grow();
+        }
+
+        if (s == nullptr) [[unlikely]] {
+            return Nullable<uptr, 0>();
+        }
+
+        push_partial(s);
+    }
+
+    auto* const object = s->free_list;
+    s->free_list = object->next;
+    ++s->in_use;
+
+    if (s->free_list == nullptr) {
+        remove_partial(s);
+    }
+
+    return uptr(object);
+}
+
+// free: Push the object back on its slab's free list.
+// A full slab becomes partial again, and an empty slab is either kept as
+// this cache's empty slab or given back to the buddy allocator.
+void SlabCache::free(uptr const ptr) {
+    auto* const s = static_cast<slab*>(simple_allocator.owner(ptr));
+
+    assert(s != nullptr && s->cache == this, "Attempted to free an object into the wrong cache");
+
+    auto* const object = reinterpret_cast<free_object*>(ptr);
+    auto const was_full = s->free_list == nullptr;
+
+    object->next = s->free_list;
+    s->free_list = object;
+    --s->in_use;
+
+    if (was_full) {
+        push_partial(s);
+    }
+
+    if (s->in_use == 0) {
+        remove_partial(s);
+
+        if (_empty == nullptr) {
+            _empty = s;
+        } else {
+            release(s);
+        }
+    }
+}
+
+auto SlabCache::release_empty() -> usize {
+    if (_empty == nullptr) {
+        return 0;
+    }
+
+    release(_empty);
+    _empty = nullptr;
+    return 1_usize << _order;
+}
+
+auto SlabCache::cache_of(uptr const ptr) -> SlabCache* {
+    auto const* const s = static_cast<slab*>(simple_allocator.owner(ptr));
+    return s == nullptr ? nullptr : s->cache;
+}
+
+// grow: Get a new slab from the buddy allocator, point all of its frames at the
+// slab header, then thread every object onto the free list.
+auto SlabCache::grow() -> slab* {
+    auto const slab_size = usize(PAGESIZE) << _order;
+    auto maybe_block = simple_allocator.kalloc(slab_size);
+
+    if (maybe_block.none()) {
+        return nullptr;
+    }
+
+    auto const block = maybe_block.unwrap();
+    auto* const s = reinterpret_cast<slab*>(block);
+
+    s->next = nullptr;
+    s->prev = nullptr;
+    s->cache = this;
+    s->in_use = 0;
+    s->free_list = nullptr;
+
+    for (auto page = block; page < block + slab_size; page += PAGESIZE) {
+        simple_allocator.set_owner(page, s);
+    }
+
+    // Thread the free list back to front so that objects are handed out in address order
+    for (auto i = _objects_per_slab; i > 0; --i) {
+        auto* const object = reinterpret_cast<free_object*>(block + _first_offset +
+                                                             (i - 1) * _object_size);
+        object->next = s->free_list;
+        s->free_list = object;
+    }
+
+    return s;
+}
+
+void SlabCache::release(slab* const s) {
+    auto const block = uptr(s);
+    auto const slab_size = usize(PAGESIZE) << _order;
+
+    for (auto page = block; page < block + slab_size; page += PAGESIZE) {
+        simple_allocator.set_owner(page, nullptr);
+    }
+
+    simple_allocator.kfree(block);
+}
+
+void SlabCache::push_partial(slab* const s) {
+    s->prev = nullptr;
+    s->next = _partial;
+
+    if (_partial != nullptr) {
+        _partial->prev = s;
+    }
+
+    _partial = s;
+}
+
+void SlabCache::remove_partial(slab* const s) {
+    if (s->prev != nullptr) {
+        s->prev->next = s->next;
+    } else {
+        _partial = s->next;
+    }
+
+    if (s->next != nullptr) {
+        s->next->prev = s->prev;
+    }
+
+    s->next = nullptr;
+    s->prev = nullptr;
+}
+
+auto wlib::alloc::kmalloc(usize const size) -> Nullable<uptr, 0> {
+    if (size > LARGEST_CLASS) {
+        return simple_allocator.kalloc(size);
+    }
+
+    auto const rounded = round_up_pow2(u32(size < (1 << SMALLEST_CLASS_SIZE) ?
+                                           (1 << SMALLEST_CLASS_SIZE) :
+                                           size));
+    auto const class_idx = log2(rounded) - SMALLEST_CLASS_SIZE;
+
+    return size_classes[class_idx].alloc();
+}
+
+void wlib::alloc::kmfree(uptr const ptr) {
+    auto* const cache = SlabCache::cache_of(ptr);
+
+    if (cache != nullptr) {
+        cache->free(ptr);
+    } else {
+        simple_allocator.kfree(ptr);
+    }
+}
+
+auto static empty_slab_pages() -> u32 {
+    u32 pages = 0;
+
+    for (auto const& cache : size_classes) {
+        pages += u32(cache.empty_pages());
+    }
+
+    return pages;
+}
+
+auto static release_empty_slabs(u32 const pages) -> u32 {
+    u32 released = 0;
+
+    for (usize i = 0; i < NUM_SIZE_CLASSES && released < pages; ++i) {
+        released += u32(size_classes[i].release_empty());
+    }
+
+    return released;
+}
+
+Shrinker const wlib::alloc::kmalloc_shrinker {
+    .count = empty_slab_pages,
+    .scan = release_empty_slabs,
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/new.hh"
+#include "klib/nullable.hh"
+#include "klib/type_traits.hh"
+#include "kernel/alloc.hh"
+#include "kernel/shrinker.hh"
+
+namespace wlib::alloc {
+    // SlabCache: A cache of equally-sized objects carved out of buddy blocks ("slabs").
+    //
+    // Each slab starts with a small header, followed by as many objects as fit. Every frame of
+    // a slab has its owner (see BuddyAllocator::set_owner) pointed at the header, so any object
+    // can find its slab, and therefore its cache, in constant time.
+    //
+    // Objects are aligned to `align`. Slabs are at most 2^MAX_SLAB_ORDER pages, picking the
+    // smallest order that wastes no more than an eighth of the slab.
+    //
+    // Empty slabs are given back to simple_allocator straight away, except for one which is
+    // kept around so that alloc/free pairs don't bounce pages in and out of the buddy allocator.
+    class SlabCache {
+      public:
+        constexpr SlabCache(u16 const object_size, u16 const align)
+            : _object_size(round_up(object_size < MIN_OBJECT_SIZE ? MIN_OBJECT_SIZE : object_size,
+                                    align < MIN_OBJECT_SIZE ? MIN_OBJECT_SIZE : align)),
+              _first_offset(round_up(sizeof(slab), align < MIN_OBJECT_SIZE ? MIN_OBJECT_SIZE : align)),
+              _order(slab_order(_object_size, _first_offset)),
+              _objects_per_slab(u16(((PAGESIZE << _order) - _first_offset) / _object_size)) {}
+
+        SlabCache(SlabCache const&) = delete;
+
+        [[nodiscard]] auto alloc() -> Nullable<uptr, 0>;
+
+        void free(uptr ptr);
+
+        // Give the cached empty slab (if any) back to simple_allocator.
+        // Returns the number of pages released.
+        auto release_empty() -> usize;
+
+        // Pages that release_empty would give back.
+        [[nodiscard]] auto empty_pages() const -> usize {
+            return _empty == nullptr ? 0 : 1_usize << _order;
+        }
+
+        [[nodiscard]] auto constexpr object_size() const -> u16 { return _object_size; }
+
+        // The cache which the object at [ptr] was allocated from, or nullptr
+        // if [ptr] was not allocated from a slab.
+        [[nodiscard]] auto static cache_of(uptr ptr) -> SlabCache*;
+
+      private:
+        // Smallest object we can hand out: free objects need to hold a pointer to the next one.
+        auto static constexpr MIN_OBJECT_SIZE = u16(sizeof(void*));
+
+        // Largest slab: 2^3 = 8 pages.
+        auto static constexpr MAX_SLAB_ORDER = 3_u8;
+
+        struct free_object {
+            free_object* next;
+        };
+
+        struct slab {
+            slab* next;
+            slab* prev;
+            SlabCache* cache;
+            free_object* free_list;
+            u16 in_use;
+        };
+
+        // Slabs with at least one free object. Full slabs are on no list at all.
+        slab* _partial = nullptr;
+        slab* _empty = nullptr;
+
+        u16 const _object_size;
+        u16 const _first_offset;
+        u8 const _order;
+        u16 const _objects_per_slab;
+
+        auto grow() -> slab*;
+        void release(slab* s);
+        void push_partial(slab* s);
+        void remove_partial(slab* s);
+
+        [[nodiscard]] auto static constexpr round_up(usize const num, usize const align) -> u16 {
+            return u16((num + align - 1) / align * align);
+        }
+
+        [[nodiscard]] auto static constexpr slab_order(u16 const object_size,
+                                                       u16 const first_offset) -> u8 {
+            for (u8 order = 0; order < MAX_SLAB_ORDER; ++order) {
+                auto const slab_size = usize(PAGESIZE) << order;
+                auto const wasted = (slab_size - first_offset) % object_size + first_offset;
+                if (first_offset + object_size <= slab_size && wasted * 8 <= slab_size) {
+                    return order;
+                }
+            }
+            return MAX_SLAB_ORDER;
+        }
+    };
+
+    // ObjectCache: A SlabCache for one type, which constructs and destructs objects in place.
+    template<typename T>
+    class ObjectCache {
+      public:
+        constexpr ObjectCache() : _cache(sizeof(T), alignof(T)) {}
+        ObjectCache(ObjectCache const&) = delete;
+
+        // Allocate and construct a T with [args]. Returns nullptr if out of memory.
+        template<typename... Args>
+        [[nodiscard]] auto create(Args&&... args) -> T* {
+            auto ptr = _cache.alloc();
+            if (ptr.none()) {
+                return nullptr;
+            }
+            return new (ptr.unwrap_as<void*>()) T(type_traits::forward<Args>(args)...);
+        }
+
+        // Destruct [object] and give its memory back to the cache.
+        void destroy(T* const object) {
+            object->~T();
+            _cache.free(uptr(object));
+        }
+
+        auto release_empty() -> usize { return _cache.release_empty(); }
+
+      private:
+        SlabCache _cache;
+    };
+
+    // Releases the empty slabs the kmalloc size classes keep around.
+    extern Shrinker const kmalloc_shrinker;
+}; // namespace wlib::alloc
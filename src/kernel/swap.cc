@@ -0,0 +1,453 @@
+#include "kernel/swap.hh"
+#include "kernel/alloc.hh"
+#include "kernel/block_queue.hh"
+#include "kernel/compaction.hh"
+#include "kernel/kernel.hh"
+#include "kernel/vmalloc.hh"
+#include "klib/array.hh"
+#include "klib/assert.hh"
+#include "klib/idt.hh"
+#include "klib/pagetables.hh"
+#include "klib/slice.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+auto static constexpr NO_FRAME = 0xFFFFFFFF_u32;
+
+enum class List : u8 {
+    None,
+    Active,
+    Inactive,
+};
+
+// One per page frame, like the buddy allocator's block metadata, so a frame's list links
+// are found without searching.
+struct frame_record {
+    Nullable<u32, NO_FRAME> next;
+    Nullable<u32, NO_FRAME> prev;
+    uptr page; // The virtual address the frame backs
+    List list;
+};
+
+struct lru_list {
+    Nullable<u32, NO_FRAME> head;
+    Nullable<u32, NO_FRAME> tail;
+    u32 count;
+};
+
+static block::Queue* swap_disk = nullptr;
+static u64 swap_start = 0; // First sector of the swap area
+static u32 num_slots = 0;
+
+// One bit per slot of the swap area, set if it is in use
+static u32* slot_map = nullptr;
+static u32 next_slot = 0;
+static u32 used_slots = 0;
+
+static frame_record* records = nullptr;
+static u32 num_records = 0;
+
+static lru_list active;
+static lru_list inactive;
+
+static u32 swap_outs = 0;
+static u32 swap_ins = 0;
+
+auto static list_of(List const list) -> lru_list& {
+    return list == List::Active ? active : inactive;
+}
+
+void static push_front(List const list, u32 const idx) {
+    auto& l = list_of(list);
+    auto& record = records[idx];
+
+    record.list = list;
+    record.prev = Nullable<u32, NO_FRAME>();
+    record.next = l.head;
+
+    if (l.head.some()) {
+        records[l.head.unwrap()].prev = idx;
+    } else {
+        l.tail = idx;
+    }
+
+    l.head = idx;
+    ++l.count;
+}
+
+void static remove(u32 const idx) {
+    auto& record = records[idx];
+    auto& l = list_of(record.list);
+
+    assert(record.list != List::None, "Frame is not on an LRU list");
+
+    if (record.prev.some()) {
+        records[record.prev.unwrap()].next = record.next;
+    } else {
+        l.head = record.next;
+    }
+
+    if (record.next.some()) {
+        records[record.next.unwrap()].prev = record.prev;
+    } else {
+        l.tail = record.prev;
+    }
+
+    record.list = List::None;
+    --l.count;
+}
+
+auto static frame_index(u64 const physical_addr) -> u32 {
+    return u32(physical_addr / PAGESIZE);
+}
+
+// alloc_slot: Next fit, so consecutive swap-outs tend to land next to each other on disk.
+auto static alloc_slot() -> Nullable<u32, u32(-1)> {
+    if (used_slots == num_slots) {
+        return Nullable<u32, u32(-1)>();
+    }
+
+    for (u32 n = 0; n < num_slots; ++n) {
+        auto const slot = (next_slot + n) % num_slots;
+
+        if (!(slot_map[slot / 32] & (1_u32 << (slot % 32)))) {
+            slot_map[slot / 32] |= 1_u32 << (slot % 32);
+            next_slot = slot + 1;
+            ++used_slots;
+            return slot;
+        }
+    }
+
+    return Nullable<u32, u32(-1)>();
+}
+
+void static free_slot(u32 const slot) {
+    assert(slot_map[slot / 32] & (1_u32 << (slot % 32)), "Double free of a swap slot");
+    slot_map[slot / 32] &= ~(1_u32 << (slot % 32));
+    --used_slots;
+}
+
+// Most pages a swap area holds. Past this, the slot metadata would crowd the vmalloc window,
+// so the rest of a larger area goes unused.
+auto static constexpr MAX_SLOTS = 1_u32 << 20;
+
+// init_swap made sure every slot's sector fits in a usize
+auto static slot_sector(u32 const slot) -> usize {
+    return usize(swap_start + u64(slot) * SWAP_SECTORS_PER_PAGE);
+}
+
+auto wlib::alloc::init_swap(block::Queue& disk, u64 const first_sector,
+                            u64 const sectors) -> Result<Null, Null> {
+    assert(first_sector % SWAP_SECTORS_PER_PAGE == 0 && sectors % SWAP_SECTORS_PER_PAGE == 0,
+           "Swap area must be page aligned");
+
+    if (swap_disk != nullptr || sectors < SWAP_SECTORS_PER_PAGE) {
+        return Result<Null, Null>::Err();
+    }
+
+    auto const slots = u32(util::min(sectors / SWAP_SECTORS_PER_PAGE, u64(MAX_SLOTS)));
+
+    // ahci::Request can't address sectors past usize
+    if (first_sector + u64(slots) * SWAP_SECTORS_PER_PAGE - 1 > u64(usize(-1))) {
+        return Result<Null, Null>::Err();
+    }
+
+    auto const frames = u32(simple_allocator.end_address() / PAGESIZE);
+
+    auto map = vmalloc((slots + 31) / 32 * sizeof(u32));
+    auto table = vmalloc(frames * sizeof(frame_record));
+
+    if (map.none() || table.none()) {
+        if (map.some()) {
+            vfree(map.unwrap());
+        }
+        if (table.some()) {
+            vfree(table.unwrap());
+        }
+        return Result<Null, Null>::Err();
+    }
+
+    slot_map = reinterpret_cast<u32*>(map.unwrap());
+    util::memset<u32>(slot_map, 0_u32, (slots + 31) / 32);
+
+    records = reinterpret_cast<frame_record*>(table.unwrap());
+    for (u32 i = 0; i < frames; ++i) {
+        records[i].list = List::None;
+    }
+
+    num_slots = slots;
+    num_records = frames;
+    swap_start = first_sector;
+    swap_disk = &disk;
+    return Result<Null, Null>::Ok();
+}
+
+void wlib::alloc::add_anonymous_page(uptr const page, uptr const frame) {
+    track_movable_page(page, frame);
+
+    if (records == nullptr) {
+        return;
+    }
+
+    auto const idx = frame_index(util::kernel_to_physical_addr(frame));
+
+    assert(idx < num_records && records[idx].list == List::None, "Frame is already tracked");
+
+    records[idx].page = page;
+    push_front(List::Active, idx);
+}
+
+void wlib::alloc::move_anonymous_page(uptr const frame, uptr const destination) {
+    if (records == nullptr) {
+        return;
+    }
+
+    auto const from = frame_index(util::kernel_to_physical_addr(frame));
+    auto const to = frame_index(util::kernel_to_physical_addr(destination));
+
+    if (records[from].list == List::None) {
+        return;
+    }
+
+    assert(records[to].list == List::None, "Frame is already tracked");
+
+    auto& record = records[to];
+    auto& l = list_of(records[from].list);
+
+    record = records[from];
+    records[from].list = List::None;
+
+    if (record.prev.some()) {
+        records[record.prev.unwrap()].next = to;
+    } else {
+        l.head = to;
+    }
+
+    if (record.next.some()) {
+        records[record.next.unwrap()].prev = to;
+    } else {
+        l.tail = to;
+    }
+}
+
+void wlib::alloc::free_anonymous_page(uptr const page) {
+    auto const slot = kernel_pagedir.swap_slot(page);
+
+    if (slot.some()) {
+        free_slot(slot.unwrap());
+    }
+
+    // Also drops the swap entry
+    auto const frame = kernel_pagedir.unmap(page);
+
+    if (frame.none()) {
+        return;
+    }
+
+    if (records != nullptr && records[frame_index(frame.unwrap())].list != List::None) {
+        remove(frame_index(frame.unwrap()));
+    }
+
+    simple_allocator.kfree(util::physical_addr_to_kernel(uptr(frame.unwrap())));
+}
+
+auto wlib::alloc::swap_in(uptr const page, u16 const perm) -> bool {
+    auto const slot = kernel_pagedir.swap_slot(page);
+
+    if (slot.none() || !Idt::interrupts_enabled()) {
+        return false;
+    }
+
+    // If memory is short, this swaps out something else (see swap_shrinker)
+    auto frame = simple_allocator.kalloc(PAGESIZE, Mobility::Movable);
+
+    if (frame.none()) {
+        return false;
+    }
+
+    auto request = block::Request {
+        .buffer = Slice<u8>(reinterpret_cast<u8*>(frame.unwrap()), PAGESIZE),
+        .sector = slot_sector(slot.unwrap()),
+        .direction = ahci::Direction::Read,
+    };
+
+    swap_disk->submit(request);
+
+    if (swap_disk->wait(request).is_err()) {
+        simple_allocator.kfree(frame.unwrap());
+        return false;
+    }
+
+    auto const physical_addr = util::kernel_to_physical_addr(frame.unwrap());
+
+    if (kernel_pagedir.try_map(page, physical_addr, perm).is_err()) {
+        simple_allocator.kfree(frame.unwrap());
+        return false;
+    }
+
+    free_slot(slot.unwrap());
+    add_anonymous_page(page, frame.unwrap());
+    ++swap_ins;
+    return true;
+}
+
+// age_active_page: Move the page at the tail of the active list to the inactive list,
+// unless it was used since it was last looked at.
+void static age_active_page() {
+    auto const idx = active.tail.unwrap();
+    remove(idx);
+
+    if (kernel_pagedir.test_and_clear_accessed(records[idx].page)) {
+        push_front(List::Active, idx);
+    } else {
+        push_front(List::Inactive, idx);
+    }
+}
+
+// Swap-outs written to the disk at once, so that it can work on all of them together
+auto static constexpr WRITE_BATCH = 16_u32;
+
+struct pending_write {
+    u32 idx;
+    u32 slot;
+    block::Request request;
+};
+
+static Array<pending_write, WRITE_BATCH> writes;
+
+// queue_swap_out: Give the frame at [idx] a fresh slot to be written to by write_swap_outs,
+// taking it off the lists meanwhile. Nothing else runs until then, so the page can't change
+// under us.
+auto static queue_swap_out(u32 const idx, pending_write& write) -> bool {
+    auto const slot = alloc_slot();
+
+    if (slot.none()) {
+        return false;
+    }
+
+    remove(idx);
+
+    write.idx = idx;
+    write.slot = slot.unwrap();
+    return true;
+}
+
+// write_swap_outs: Write out the first [count] queued pages, then replace each page's mapping
+// with a swap entry and free its frame. Slots are handed out next fit, so consecutive pages
+// usually have consecutive slots, and the block queue merges each such run into one write.
+// Pages that could not be written go back on the active list.
+auto static write_swap_outs(u32 const count) -> u32 {
+    for (u32 i = 0; i < count; ++i) {
+        auto const frame = util::physical_addr_to_kernel(uptr(writes[i].idx) * PAGESIZE);
+
+        writes[i].request = block::Request {
+            .buffer = Slice<u8>(reinterpret_cast<u8*>(frame), PAGESIZE),
+            .sector = slot_sector(writes[i].slot),
+            .direction = ahci::Direction::Write,
+        };
+
+        swap_disk->submit(writes[i].request);
+    }
+
+    u32 freed = 0;
+
+    for (u32 i = 0; i < count; ++i) {
+        auto const idx = writes[i].idx;
+
+        if (swap_disk->wait(writes[i].request).is_err()) {
+            free_slot(writes[i].slot);
+            push_front(List::Active, idx);
+            continue;
+        }
+
+        auto const physical_addr = kernel_pagedir.swap_out(records[idx].page, writes[i].slot);
+
+        assert(physical_addr.some() && frame_index(physical_addr.unwrap()) == idx,
+               "Tracked page was unmapped behind our back");
+
+        simple_allocator.kfree(util::physical_addr_to_kernel(uptr(idx) * PAGESIZE));
+        ++swap_outs;
+        ++freed;
+    }
+
+    return freed;
+}
+
+// reclaim_pages: Keep the inactive list at least as long as the active one, then take pages
+// from its tail, writing them out WRITE_BATCH at a time. Each page is looked at a bounded
+// number of times, so a working set that is entirely hot gives up rather than spinning.
+auto wlib::alloc::reclaim_pages(u32 const count) -> u32 {
+    if (swap_disk == nullptr || !Idt::interrupts_enabled()) {
+        return 0;
+    }
+
+    u32 freed = 0;
+    u32 batched = 0;
+    auto budget = 2 * (active.count + inactive.count);
+
+    while (freed + batched < count && budget > 0) {
+        --budget;
+
+        if (active.count > 0 && inactive.count < active.count) {
+            age_active_page();
+            continue;
+        }
+
+        if (inactive.tail.none()) {
+            break;
+        }
+
+        auto const idx = inactive.tail.unwrap();
+
+        if (kernel_pagedir.test_and_clear_accessed(records[idx].page)) {
+            remove(idx);
+            push_front(List::Active, idx);
+            continue;
+        }
+
+        if (!queue_swap_out(idx, writes[batched])) {
+            break;
+        }
+
+        if (++batched == WRITE_BATCH) {
+            freed += write_swap_outs(batched);
+            batched = 0;
+        }
+    }
+
+    return freed + write_swap_outs(batched);
+}
+
+// Pages swapped out at once when the shrinker is asked for fewer, so the next few
+// allocations don't each have to wait for the disk.
+auto static constexpr RECLAIM_BATCH = 16_u32;
+
+auto static swappable_pages() -> u32 {
+    if (swap_disk == nullptr || !Idt::interrupts_enabled()) {
+        return 0;
+    }
+
+    return util::min(active.count + inactive.count, num_slots - used_slots);
+}
+
+auto static shrink_swap(u32 const pages) -> u32 {
+    return reclaim_pages(util::max(pages, RECLAIM_BATCH));
+}
+
+Shrinker const wlib::alloc::swap_shrinker {
+    .count = swappable_pages,
+    .scan = shrink_swap,
+};
+
+auto wlib::alloc::swap_stats() -> SwapStats {
+    return SwapStats {
+        .active = active.count,
+        .inactive = inactive.count,
+        .swapped = used_slots,
+        .free_slots = num_slots - used_slots,
+        .swap_outs = swap_outs,
+        .swap_ins = swap_ins,
+    };
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "kernel/block_queue.hh"
+#include "kernel/shrinker.hh"
+#include "klib/int.hh"
+#include "klib/pagetables.hh"
+#include "klib/result.hh"
+
+namespace wlib::alloc {
+    // Swap: when memory runs short, cold anonymous pages (the ones backing demand regions,
+    // see kernel/demand.hh) are written to a swap area on disk and their frames are freed.
+    // The pagetable entry keeps the swap slot (PTE_SWAPPED), and the page is read back in
+    // by the page fault handler on its next access.
+    //
+    // Resident anonymous pages sit on one of two lists, most recently added first. New pages
+    // start out active. Reclaim ages pages from the tail of the active list onto the
+    // inactive one, and swaps out inactive pages whose accessed bit is still clear when they
+    // reach its tail. Pages touched since are given another round on the active list.
+    //
+    // Only kernel_pagedir is scanned. Until init_swap succeeds, nothing is ever swapped out.
+
+    struct SwapStats {
+        u32 active;      // Resident pages on the active list
+        u32 inactive;    // Resident pages on the inactive list
+        u32 swapped;     // Pages currently out on disk
+        u32 free_slots;  // Pages that still fit in the swap area
+        u32 swap_outs;
+        u32 swap_ins;
+    };
+
+    // Sectors per swap slot. Swap areas are a whole number of slots.
+    auto constexpr SWAP_SECTORS_PER_PAGE = u64(PAGESIZE / ahci::SECTOR_SIZE);
+
+    // Use [sectors] sectors of [disk] from [first_sector] on as the swap area. Both must be
+    // multiples of SWAP_SECTORS_PER_PAGE, and nothing else may use that part of the disk.
+    // Sector numbers are 64 bits so that byte offsets on large disks can't wrap around.
+    // Fails if the area lies past the sectors ahci::Request can address, we are out of memory
+    // for the metadata, or swap is already set up.
+    [[nodiscard]] auto init_swap(block::Queue& disk, u64 first_sector,
+                                 u64 sectors) -> Result<Null, Null>;
+
+    // Put the page at [page], just backed by the frame at kernel address [frame], on the active list.
+    void add_anonymous_page(uptr page, uptr frame);
+
+    // Compaction moved the page backed by [frame] to [destination]: it keeps its place on the lists.
+    void move_anonymous_page(uptr frame, uptr destination);
+
+    // Unmap the anonymous page at [page] and free whatever backs it, frame or swap slot.
+    void free_anonymous_page(uptr page);
+
+    // Called on #PF for a page that is not present: if [page] was swapped out, read it back
+    // in and map it with [perm]. Returns false if it wasn't, or it couldn't be brought back,
+    // which includes when interrupts are disabled: the read would never complete.
+    [[nodiscard]] auto swap_in(uptr page, u16 perm) -> bool;
+
+    // Try to free [count] page frames by swapping out inactive pages. Returns how many were freed.
+    // Waits for the disk, so with interrupts disabled it frees nothing.
+    auto reclaim_pages(u32 count) -> u32;
+
+    // Swaps pages out when kalloc runs dry. The most expensive shrinker, so register it last.
+    extern Shrinker const swap_shrinker;
+
+    [[nodiscard]] auto swap_stats() -> SwapStats;
+}; // namespace wlib::alloc
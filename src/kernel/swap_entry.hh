@@ -0,0 +1,56 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/nullable.hh"
+#include "klib/pagetables.hh"
+
+namespace wlib::pagetables::swap_entry {
+    // Pagetable entry helpers for swapping and compaction, shared by every paging mode.
+    // [Entry] is a PageTableEntry or pae::Entry.
+
+    template<typename Entry>
+    [[nodiscard]] auto test_and_clear_accessed(Entry& pte, uptr const virtual_addr) -> bool {
+        if (!pte.present() || !(pte.perm() & PTE_A)) {
+            return false;
+        }
+
+        pte.set(pte.page_address(), u16(pte.perm() & ~PTE_A));
+        // Otherwise the CPU keeps using the cached translation and never sets the bit again
+        invalidate_page(virtual_addr);
+        return true;
+    }
+
+    template<typename Entry>
+    auto swap_out(Entry& pte, u32 const slot, uptr const virtual_addr) -> Nullable<u64, u64(-1)> {
+        if (!pte.present()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto const physical_addr = u64(pte.page_address());
+        pte.set(u64(slot) * PAGESIZE, PTE_SWAPPED);
+        invalidate_page(virtual_addr);
+
+        return physical_addr;
+    }
+
+    template<typename Entry>
+    auto remap(Entry& pte, u64 const physical_addr, uptr const virtual_addr) -> Nullable<u64, u64(-1)> {
+        if (!pte.present()) {
+            return Nullable<u64, u64(-1)>();
+        }
+
+        auto const old_addr = u64(pte.page_address());
+        pte.set(physical_addr, pte.perm());
+        invalidate_page(virtual_addr);
+
+        return old_addr;
+    }
+
+    template<typename Entry>
+    [[nodiscard]] auto slot(Entry const& pte) -> Nullable<u32, u32(-1)> {
+        if (pte.present() || !(pte.perm() & PTE_SWAPPED)) {
+            return Nullable<u32, u32(-1)>();
+        }
+
+        return u32(pte.page_address() / PAGESIZE);
+    }
+};
@@ -11,7 +11,7 @@ wnfs::BufCache buf_cache;
 // TODO: Make this support all file systems we're gonna support...
 // for now, just doing this for wnfs
 
-auto FileHandle::create(wlib::ahci::AHCIState *drive, 
+auto FileHandle::create(wlib::block::Queue *drive, 
                         str const name) -> Result<FileHandle, FileError> {
 
     auto const maybe_id = wnfs::create_file(drive, name);
@@ -29,12 +29,12 @@ auto FileHandle::create(wlib::ahci::AHCIState *drive,
                                                     0_u32);
 }
 
-auto FileHandle::open(ahci::AHCIState* const drive, 
+auto FileHandle::open(block::Queue* const drive, 
                       u32 const file_id) -> Result<FileHandle, FileError> {
 
     auto const sector = wnfs::inode_sector(file_id);
 
-    auto const maybe_inode_sector = buf_cache.read_buf_sector(sector);
+    auto const maybe_inode_sector = buf_cache.read_buf_sector(sector, ahci::Priority::High);
 
     if (maybe_inode_sector.is_err()) {
         return Result<FileHandle, FileError>::ErrInPlace(FileError::FSError);
@@ -52,7 +52,7 @@ auto FileHandle::open(ahci::AHCIState* const drive,
 }
 
 auto FileHandle::sector_of_position() -> Nullable<u32, u32(-1)> {
-    auto const maybe_inode = buf_cache.read_buf_sector(_sector);
+    auto const maybe_inode = buf_cache.read_buf_sector(_sector, ahci::Priority::High);
 
     if (maybe_inode.is_err()) {
         return Nullable<u32, u32(-1)>::None();
@@ -95,6 +95,14 @@ auto FileHandle::write(Slice<u8> const& buffer) -> Result<u32, WriteError> {
     }
 }
 
+auto FileHandle::sync() -> Result<Null, WriteError> {
+    if (_drive->flush().is_err()) {
+        return Result<Null, WriteError>::ErrInPlace(WriteError::DiskError);
+    }
+
+    return Result<Null, WriteError>::OkInPlace();
+}
+
 auto FileHandle::read(Slice<u8>& buffer) -> Result<u32, ReadError> {
     terminal.print_line("VFS: reading from ", _position);
     auto result = wnfs::read_from_file(_drive, buffer, wnfs::INodeID(_file_id), _position);
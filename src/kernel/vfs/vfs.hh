@@ -4,6 +4,7 @@
 #include "klib/strings.hh"
 #include "klib/nullable.hh"
 #include "klib/ahci/ahci.hh"
+#include "kernel/block_queue.hh"
 
 namespace kernel::vfs {
     struct file_metadata {
@@ -41,7 +42,7 @@ namespace kernel::vfs {
 
     class FileHandle {
       public:
-        FileHandle(wlib::ahci::AHCIState* drive, u32 file_id, u32 sector, u32 size)
+        FileHandle(wlib::block::Queue* drive, u32 file_id, u32 sector, u32 size)
             : _drive(drive), _file_id(file_id), _position(0), _size(size), _sector(sector) {};
 
         FileHandle(FileHandle&& handle) 
@@ -61,18 +62,18 @@ namespace kernel::vfs {
         
         // Attempt to create a file with the given name `name`.
         // On success, returns a file handle. Otherwise, returns an error (see enum for details).
-        [[nodiscard]] auto static create(wlib::ahci::AHCIState* drive, 
+        [[nodiscard]] auto static create(wlib::block::Queue* drive, 
                                          wlib::str const name) -> wlib::Result<FileHandle, FileError>;
 
         // Attempt to find a file using a tag of some sort. 
         // Note that *in non-WNFS file-systems, the only supported tag is a name*.
         // On success, returns a file handle. Otherwise, returns an error (see enum for details).
-        [[nodiscard]] auto static find_file(wlib::ahci::AHCIState* drive,
+        [[nodiscard]] auto static find_file(wlib::block::Queue* drive,
                                             wlib::str const name) -> wlib::Result<FileHandle, FileError>;
 
         // Attempt to open a file with the given id `file_id`.
         // If you wish to find a file by name, use the `find_file` function.
-        [[nodiscard]] auto static open(wlib::ahci::AHCIState* drive, 
+        [[nodiscard]] auto static open(wlib::block::Queue* drive, 
                                        u32 file_id) -> wlib::Result<FileHandle, FileError>;
 
         // Attempt to read up to buffer.size() bytes from the open file managed by this file handle.
@@ -83,6 +84,9 @@ namespace kernel::vfs {
         // On success, returns the number of bytes written. Otherwise, returns an error (see enum for details).
         [[nodiscard]] auto write(wlib::Slice<u8> const& buffer)-> wlib::Result<u32, WriteError>;
 
+        // Make everything written to the file so far durable, rather than just in the disk's cache.
+        [[nodiscard]] auto sync() -> wlib::Result<wlib::Null, WriteError>;
+
         // Attempt to seek to a certain position in the file, either for reading or writing.
         // On success, returns nothing. Otherwise, returns an error (see enum for details).
         [[nodiscard]] auto seek(u32 position) -> wlib::Result<wlib::Null, SeekError>;
@@ -93,7 +97,7 @@ namespace kernel::vfs {
         }
 
       private:
-        wlib::ahci::AHCIState* _drive;
+        wlib::block::Queue* _drive;
         u32 _file_id;
         u32 _position;
         u32 _size;
@@ -0,0 +1,222 @@
+#include "kernel/vmalloc.hh"
+#include "kernel/alloc.hh"
+#include "kernel/compaction.hh"
+#include "kernel/demand.hh"
+#include "kernel/kernel.hh"
+#include "klib/array.hh"
+#include "klib/assert.hh"
+#include "klib/pagetables.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+auto static constexpr WINDOW_PAGES = (kernel::VMALLOC_END - kernel::VMALLOC_START) / PAGESIZE;
+auto static constexpr WINDOW_WORDS = WINDOW_PAGES / 32;
+
+// One bit per page of the window. A page is in use if it is mapped or is a guard page.
+static Array<u32, WINDOW_WORDS> used_pages;
+
+// One bit per page of the window, set on the first and the last page of every allocation.
+// This is how vfree knows its pointer is an allocation, and where that ends.
+static Array<u32, WINDOW_WORDS> first_pages;
+static Array<u32, WINDOW_WORDS> last_pages;
+
+// One bit per page of the window, set on the first page of every vmalloc_lazy allocation.
+static Array<u32, WINDOW_WORDS> lazy_pages;
+
+// Likewise for ioremap, whose frames don't belong to us.
+static Array<u32, WINDOW_WORDS> io_pages;
+
+auto static constexpr page_addr(u32 const idx) -> uptr {
+    return kernel::VMALLOC_START + uptr(idx) * PAGESIZE;
+}
+
+auto static test(Array<u32, WINDOW_WORDS> const& bits, u32 const idx) -> bool {
+    return bits[idx / 32] & (1_u32 << (idx % 32));
+}
+
+void static set(Array<u32, WINDOW_WORDS>& bits, u32 const idx) {
+    bits[idx / 32] |= 1_u32 << (idx % 32);
+}
+
+void static clear(Array<u32, WINDOW_WORDS>& bits, u32 const idx) {
+    bits[idx / 32] &= ~(1_u32 << (idx % 32));
+}
+
+// find_free: First fit over the window, skipping fully used words 32 pages at a time.
+auto static find_free(u32 const count) -> Nullable<u32, u32(-1)> {
+    u32 run = 0;
+
+    for (u32 idx = 0; idx < WINDOW_PAGES; ++idx) {
+        if (idx % 32 == 0 && used_pages[idx / 32] == ~0_u32) {
+            idx += 31;
+            run = 0;
+            continue;
+        }
+
+        if (test(used_pages, idx)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == count) {
+            return idx + 1 - count;
+        }
+    }
+
+    return Nullable<u32, u32(-1)>();
+}
+
+// Record [pages] pages from [first] on as one allocation, followed by its guard page.
+void static claim(u32 const first, u32 const pages) {
+    for (auto idx = first; idx <= first + pages; ++idx) {
+        set(used_pages, idx);
+    }
+
+    set(first_pages, first);
+    set(last_pages, first + pages - 1);
+}
+
+// Unmap [count] pages starting at page [first] and, if [free_frames], give their frames back.
+void static unmap_pages(u32 const first, u32 const count, bool const free_frames = true) {
+    for (auto idx = first; idx < first + count; ++idx) {
+        auto const frame = kernel_pagedir.unmap(page_addr(idx));
+        assert(frame.some(), "vmalloc page was not mapped");
+
+        if (free_frames) {
+            simple_allocator.kfree(util::physical_addr_to_kernel(uptr(frame.unwrap())));
+        }
+    }
+}
+
+// vmalloc: Reserve the pages plus a guard page, then back each page with its own frame.
+// If we run out of frames partway, everything mapped so far is undone.
+auto wlib::alloc::vmalloc(usize const size) -> Nullable<uptr, 0> {
+    if (size == 0) [[unlikely]] {
+        return Nullable<uptr, 0>();
+    }
+
+    auto const pages = u32((size + PAGESIZE - 1) / PAGESIZE);
+    auto const maybe_first = find_free(pages + 1);
+
+    if (maybe_first.none()) {
+        return Nullable<uptr, 0>();
+    }
+
+    auto const first = maybe_first.unwrap();
+
+    for (u32 i = 0; i < pages; ++i) {
+        auto frame = simple_allocator.kalloc(PAGESIZE, Mobility::Movable);
+
+        if (frame.none()) {
+            unmap_pages(first, i);
+            return Nullable<uptr, 0>();
+        }
+
+        auto const physical = util::kernel_to_physical_addr(frame.unwrap());
+
+        if (kernel_pagedir.try_map(page_addr(first + i), physical, PTE_PW | PTE_G).is_err()) {
+            simple_allocator.kfree(frame.unwrap());
+            unmap_pages(first, i);
+            return Nullable<uptr, 0>();
+        }
+
+        track_movable_page(page_addr(first + i), frame.unwrap());
+    }
+
+    claim(first, pages);
+
+    return page_addr(first);
+}
+
+auto wlib::alloc::vmalloc_lazy(usize const size) -> Nullable<uptr, 0> {
+    if (size == 0) [[unlikely]] {
+        return Nullable<uptr, 0>();
+    }
+
+    auto const pages = u32((size + PAGESIZE - 1) / PAGESIZE);
+    auto const maybe_first = find_free(pages + 1);
+
+    if (maybe_first.none()) {
+        return Nullable<uptr, 0>();
+    }
+
+    auto const first = maybe_first.unwrap();
+
+    if (reserve_on_demand(page_addr(first), pages * PAGESIZE, PTE_PW | PTE_G).is_err()) {
+        return Nullable<uptr, 0>();
+    }
+
+    claim(first, pages);
+    set(lazy_pages, first);
+
+    return page_addr(first);
+}
+
+auto wlib::alloc::ioremap(u64 const physical_addr, usize const size,
+                          u16 const perm) -> Nullable<uptr, 0> {
+    if (size == 0) [[unlikely]] {
+        return Nullable<uptr, 0>();
+    }
+
+    auto const offset = uptr(physical_addr % PAGESIZE);
+    auto const base = physical_addr - offset;
+    auto const pages = u32((offset + size + PAGESIZE - 1) / PAGESIZE);
+    auto const maybe_first = find_free(pages + 1);
+
+    if (maybe_first.none()) {
+        return Nullable<uptr, 0>();
+    }
+
+    auto const first = maybe_first.unwrap();
+
+    for (u32 i = 0; i < pages; ++i) {
+        if (kernel_pagedir.try_map(page_addr(first + i), base + u64(i) * PAGESIZE, perm).is_err()) {
+            unmap_pages(first, i, false);
+            return Nullable<uptr, 0>();
+        }
+    }
+
+    claim(first, pages);
+    set(io_pages, first);
+
+    return page_addr(first) + offset;
+}
+
+void wlib::alloc::vfree(uptr const addr) {
+    assert(addr >= kernel::VMALLOC_START && addr < kernel::VMALLOC_END,
+           "Attempted to vfree a pointer not from vmalloc");
+
+    auto const first = u32((addr - kernel::VMALLOC_START) / PAGESIZE);
+
+    assert(test(first_pages, first), "Attempted to vfree a pointer not from vmalloc");
+    assert(addr % PAGESIZE == 0 || test(io_pages, first), "Attempted to vfree a misaligned pointer");
+
+    auto last = first;
+
+    while (last + 1 < WINDOW_PAGES && !test(last_pages, last)) {
+        ++last;
+    }
+
+    assert(test(last_pages, last), "vmalloc allocation has no end");
+
+    if (test(lazy_pages, first)) {
+        // Only the touched pages are mapped
+        release_on_demand(addr);
+        clear(lazy_pages, first);
+    } else if (test(io_pages, first)) {
+        unmap_pages(first, last - first + 1, false);
+        clear(io_pages, first);
+    } else {
+        unmap_pages(first, last - first + 1);
+    }
+
+    // Release the guard page along with the rest
+    for (auto idx = first; idx <= last + 1; ++idx) {
+        clear(used_pages, idx);
+    }
+
+    clear(first_pages, first);
+    clear(last_pages, last);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/nullable.hh"
+
+namespace wlib::alloc {
+    // Allocate [size] bytes (rounded up to whole pages) that are contiguous in kernel virtual
+    // memory, backed by page frames that need not be physically contiguous. The range lives in
+    // the window [kernel::VMALLOC_START, kernel::VMALLOC_END) of kernel_pagedir and is followed
+    // by an unmapped guard page, so running off the end faults instead of corrupting a neighbour.
+    //
+    // Unlike kmalloc, this succeeds as long as enough free pages remain, no matter how fragmented
+    // they are. The memory is *not* suitable for DMA; use dma_alloc for that.
+    [[nodiscard]] auto vmalloc(usize size) -> Nullable<uptr, 0>;
+
+    // Like vmalloc, but no frames are allocated up front: each page is backed by a zeroed frame
+    // on first touch (see kernel/demand.hh). Use this for large, sparsely used buffers.
+    [[nodiscard]] auto vmalloc_lazy(usize size) -> Nullable<uptr, 0>;
+
+    // Map the physical range [physical_addr, physical_addr + size) into the vmalloc window with
+    // [perm]issions, typically including a pagetables::memory_type. This is how device memory
+    // gets mapped: physical memory is only reachable through the direct map otherwise, which
+    // stops well short of where devices sit, and is write-back.
+    // Returns the address [physical_addr] is mapped at. Release it with vfree.
+    [[nodiscard]] auto ioremap(u64 physical_addr, usize size, u16 perm) -> Nullable<uptr, 0>;
+
+    // Unmap and free memory returned by vmalloc, vmalloc_lazy or ioremap.
+    // Frames mapped by ioremap are not freed, of course.
+    void vfree(uptr addr);
+}; // namespace wlib::alloc
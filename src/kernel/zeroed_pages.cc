@@ -0,0 +1,78 @@
+#include "kernel/zeroed_pages.hh"
+#include "kernel/alloc.hh"
+#include "klib/array.hh"
+#include "klib/pagetables.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using namespace wlib::alloc;
+
+// Enough for a burst of page table allocations; any bigger and it just hides free memory.
+auto static constexpr POOL_SIZE = 64_u32;
+
+static Array<uptr, POOL_SIZE> pool;
+static u32 pool_count = 0;
+
+void static zero_page(uptr const page) {
+    util::memset<u32>(reinterpret_cast<void*>(page), 0_u32, PAGESIZE / sizeof(u32));
+}
+
+auto wlib::alloc::kalloc_zeroed(Mobility const mobility) -> Nullable<uptr, 0> {
+    if (pool_count > 0 && mobility == Mobility::Unmovable) {
+        --pool_count;
+        return pool[pool_count];
+    }
+
+    auto page = simple_allocator.kalloc(PAGESIZE, mobility);
+
+    if (page.some()) {
+        zero_page(page.unwrap());
+    }
+
+    return page;
+}
+
+auto wlib::alloc::refill_zeroed_pages(u32 const max_pages) -> u32 {
+    u32 added = 0;
+
+    while (added < max_pages && pool_count < POOL_SIZE) {
+        auto page = simple_allocator.kalloc(PAGESIZE);
+
+        if (page.none()) {
+            break;
+        }
+
+        zero_page(page.unwrap());
+        pool[pool_count] = page.unwrap();
+        ++pool_count;
+        ++added;
+    }
+
+    return added;
+}
+
+// Give up to [max_pages] pooled pages back to simple_allocator.
+auto static drain(u32 const max_pages) -> u32 {
+    u32 released = 0;
+
+    while (released < max_pages && pool_count > 0) {
+        --pool_count;
+        simple_allocator.kfree(pool[pool_count]);
+        ++released;
+    }
+
+    return released;
+}
+
+auto wlib::alloc::drain_zeroed_pages() -> u32 {
+    return drain(POOL_SIZE);
+}
+
+auto static pooled_pages() -> u32 {
+    return pool_count;
+}
+
+Shrinker const wlib::alloc::zeroed_pages_shrinker {
+    .count = pooled_pages,
+    .scan = drain,
+};
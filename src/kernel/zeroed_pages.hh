@@ -0,0 +1,28 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/nullable.hh"
+#include "kernel/alloc.hh"
+#include "kernel/shrinker.hh"
+
+namespace wlib::alloc {
+    // A small pool of page frames which have already been cleared, so that callers who need
+    // a zeroed page (page tables, mostly) don't pay for clearing 4 KiB on the spot.
+    //
+    // The pool is refilled from the buddy allocator when there is nothing better to do,
+    // i.e. right before the shell halts waiting for input.
+
+    // Allocate one zeroed page. Comes from the pool if possible, otherwise it is
+    // allocated and cleared right away. Free it with simple_allocator.kfree as usual.
+    // The pool only holds Unmovable pages; Movable ones are always cleared on the spot.
+    [[nodiscard]] auto kalloc_zeroed(Mobility mobility = Mobility::Unmovable) -> Nullable<uptr, 0>;
+
+    // Clear up to [max_pages] pages into the pool, stopping early if the pool is full or
+    // memory is short. Returns the number of pages added.
+    auto refill_zeroed_pages(u32 max_pages) -> u32;
+
+    // Give every pooled page back to simple_allocator. Returns the number of pages released.
+    auto drain_zeroed_pages() -> u32;
+
+    // Gives pooled pages back when memory is short. Costs nothing but the clearing.
+    extern Shrinker const zeroed_pages_shrinker;
+}; // namespace wlib::alloc
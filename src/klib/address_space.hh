@@ -0,0 +1,227 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/new.hh"
+#include "klib/nullable.hh"
+#include "klib/pae.hh"
+#include "klib/pagetables.hh"
+#include "klib/result.hh"
+
+namespace wlib::pagetables {
+#ifdef __x86_64__
+    // A set of page mappings. Long mode only has 4-level paging, so this is a thin wrapper.
+    class AddressSpace {
+      public:
+        AddressSpace(AddressSpace const& as) = delete;
+        AddressSpace() {}
+
+        [[nodiscard]] auto try_map(uptr const virtual_addr,
+                                   u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+            return _pml4.try_map(virtual_addr, physical_addr, perm);
+        }
+
+        [[nodiscard]] auto large_page_size() const -> usize { return pae::LARGE_PAGESIZE; }
+
+        [[nodiscard]] auto map_large(uptr const virtual_addr,
+                                     u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+            return _pml4.map_large(virtual_addr, physical_addr, perm);
+        }
+
+        auto unmap(uptr const virtual_addr) -> Nullable<u64, u64(-1)> {
+            return _pml4.unmap(virtual_addr);
+        }
+
+        auto va_to_pa(uptr const address) const -> Nullable<u64, u64(-1)> {
+            return _pml4.va_to_pa(address);
+        }
+
+        [[nodiscard]] auto clone_into(AddressSpace& child) -> Result<Null, Null> {
+            return _pml4.clone_into(child._pml4);
+        }
+
+        [[nodiscard]] auto sync_kernel(AddressSpace const& kernel, uptr const address) -> bool {
+            return _pml4.sync_kernel(kernel._pml4, address);
+        }
+
+        void release_user() { _pml4.release_user(); }
+
+        [[nodiscard]] auto resolve_cow(uptr const address) -> bool {
+            return _pml4.resolve_cow(address);
+        }
+
+        [[nodiscard]] auto test_and_clear_accessed(uptr const address) -> bool {
+            return _pml4.test_and_clear_accessed(address);
+        }
+
+        auto swap_out(uptr const address, u32 const slot) -> Nullable<u64, u64(-1)> {
+            return _pml4.swap_out(address, slot);
+        }
+
+        auto remap(uptr const address, u64 const physical_addr) -> Nullable<u64, u64(-1)> {
+            return _pml4.remap(address, physical_addr);
+        }
+
+        [[nodiscard]] auto swap_slot(uptr const address) const -> Nullable<u32, u32(-1)> {
+            return _pml4.swap_slot(address);
+        }
+
+        void set_page_directory() {
+            _pml4.set_page_directory();
+            _current = this;
+        }
+
+        [[nodiscard]] auto static current() -> AddressSpace& { return *_current; }
+
+      private:
+        pae::PageMapLevel4 _pml4;
+        inline static AddressSpace* _current = nullptr;
+    };
+#else
+    // A set of page mappings in whichever paging mode crt0 picked: PAE when the CPU has it,
+    // the original 32-bit two level tables otherwise. Physical addresses are 64 bits wide;
+    // anything at or above 4 GiB can only be mapped in PAE mode.
+    class AddressSpace {
+      public:
+        AddressSpace(AddressSpace const& as) = delete;
+
+        // crt0 sets the paging mode before any constructor runs, so this works for globals too
+        AddressSpace() {
+            if (pae_enabled()) {
+                new (&_pae) pae::PageDirectoryPointerTable();
+            } else {
+                new (&_legacy) PageDirectory();
+            }
+        }
+
+        [[nodiscard]] auto try_map(uptr const virtual_addr,
+                                   u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+            if (pae_enabled()) {
+                return _pae.try_map(virtual_addr, physical_addr, perm);
+            }
+            if (physical_addr > u64(uptr(-1))) [[unlikely]] {
+                return Result<Null, Null>::Err();
+            }
+            return _legacy.try_map(virtual_addr, uptr(physical_addr), perm);
+        }
+
+        // Size and alignment of the pages map_large deals in: 2 MiB with PAE, 4 MiB without.
+        [[nodiscard]] auto large_page_size() const -> usize {
+            return pae_enabled() ? pae::LARGE_PAGESIZE : LARGE_PAGESIZE;
+        }
+
+        [[nodiscard]] auto map_large(uptr const virtual_addr,
+                                     u64 const physical_addr, u16 const perm) -> Result<Null, Null> {
+            if (pae_enabled()) {
+                return _pae.map_large(virtual_addr, physical_addr, perm);
+            }
+            if (physical_addr > u64(uptr(-1))) [[unlikely]] {
+                return Result<Null, Null>::Err();
+            }
+            return _legacy.map_large(virtual_addr, uptr(physical_addr), perm);
+        }
+
+        auto unmap(uptr const virtual_addr) -> Nullable<u64, u64(-1)> {
+            if (pae_enabled()) {
+                return _pae.unmap(virtual_addr);
+            }
+            auto const physical_addr = _legacy.unmap(virtual_addr);
+            return physical_addr.some() ? Nullable<u64, u64(-1)>(physical_addr.unwrap())
+                                        : Nullable<u64, u64(-1)>();
+        }
+
+        auto va_to_pa(uptr const address) const -> Nullable<u64, u64(-1)> {
+            if (pae_enabled()) {
+                return _pae.va_to_pa(address);
+            }
+            auto const physical_addr = _legacy.va_to_pa(address);
+            return physical_addr.some() ? Nullable<u64, u64(-1)>(physical_addr.unwrap())
+                                        : Nullable<u64, u64(-1)>();
+        }
+
+        // Spawning: give [child], which must be empty, the same user mappings as this address
+        // space, with writable pages shared copy-on-write. This only copies pagetables.
+        // Kernel mappings are copied as of now; kernel pagetables created later are picked up
+        // by sync_kernel when [child] first faults on them. On failure, [child] must still be
+        // release_user()d.
+        [[nodiscard]] auto clone_into(AddressSpace& child) -> Result<Null, Null> {
+            return pae_enabled() ? _pae.clone_into(child._pae) : _legacy.clone_into(child._legacy);
+        }
+
+        // Called on #PF for a page that is not present: if [address] is in the kernel half and
+        // [kernel] has a pagetable for it that this address space was cloned without, copy
+        // that entry over. Returns whether it did, which means the fault is fixed.
+        [[nodiscard]] auto sync_kernel(AddressSpace const& kernel, uptr const address) -> bool {
+            return pae_enabled() ? _pae.sync_kernel(kernel._pae, address)
+                                 : _legacy.sync_kernel(kernel._legacy, address);
+        }
+
+        // Unmap all of user space, dropping this address space's reference to each frame.
+        void release_user() {
+            if (pae_enabled()) {
+                _pae.release_user();
+            } else {
+                _legacy.release_user();
+            }
+        }
+
+        // Called on a write to a present page: if it is copy-on-write, give this address space
+        // its own copy. Returns false if it isn't, i.e. the write is a genuine protection fault.
+        [[nodiscard]] auto resolve_cow(uptr const address) -> bool {
+            return pae_enabled() ? _pae.resolve_cow(address) : _legacy.resolve_cow(address);
+        }
+
+        // Swapping (see kernel/swap.hh). Whether the page at [address] was accessed since the
+        // last call; the accessed bit is cleared so the next access sets it again.
+        [[nodiscard]] auto test_and_clear_accessed(uptr const address) -> bool {
+            return pae_enabled() ? _pae.test_and_clear_accessed(address)
+                                 : _legacy.test_and_clear_accessed(address);
+        }
+
+        // Replace the mapping for [address] with a swap entry for [slot]. Returns the physical
+        // address it mapped to, which the caller is now responsible for. unmap drops swap entries.
+        auto swap_out(uptr const address, u32 const slot) -> Nullable<u64, u64(-1)> {
+            return pae_enabled() ? _pae.swap_out(address, slot) : _legacy.swap_out(address, slot);
+        }
+
+        // Compaction (see kernel/compaction.hh): map the page at [address] to [physical_addr]
+        // instead, keeping its permissions. Returns the physical address it mapped to, which the
+        // caller is now responsible for. Does nothing if the page is not present.
+        auto remap(uptr const address, u64 const physical_addr) -> Nullable<u64, u64(-1)> {
+            if (pae_enabled()) {
+                return _pae.remap(address, physical_addr);
+            }
+            if (physical_addr > u64(uptr(-1))) [[unlikely]] {
+                return Nullable<u64, u64(-1)>();
+            }
+            return _legacy.remap(address, physical_addr);
+        }
+
+        // The swap slot the page at [address] was swapped out to, if it was.
+        [[nodiscard]] auto swap_slot(uptr const address) const -> Nullable<u32, u32(-1)> {
+            return pae_enabled() ? _pae.swap_slot(address) : _legacy.swap_slot(address);
+        }
+
+        void set_page_directory() {
+            if (pae_enabled()) {
+                _pae.set_page_directory();
+            } else {
+                _legacy.set_page_directory();
+            }
+            _current = this;
+        }
+
+        // The address space in %cr3.
+        [[nodiscard]] auto static current() -> AddressSpace& { return *_current; }
+
+        // The non-PAE page directory, for the few things specific to that mode.
+        auto legacy() -> PageDirectory& { return _legacy; }
+
+      private:
+        // Only the format in use is ever constructed
+        union {
+            PageDirectory _legacy;
+            pae::PageDirectoryPointerTable _pae;
+        };
+        inline static AddressSpace* _current = nullptr;
+    };
+#endif
+};
@@ -1,6 +1,7 @@
 #include "klib/ahci/ahci.hh"
 #include "kernel/alloc.hh"
 #include "kernel/kernel.hh"
+#include "kernel/vmalloc.hh"
 #include "klib/ahci/cache.hh"
 #include "klib/assert.hh"
 #include "klib/console.hh"
@@ -24,7 +25,11 @@ void AHCIState::handle_interrupt() {
     _port_registers.interrupt_status = ~0U;
     _drive_registers.interrupt_status = ~0U;
 
-    auto acks = _slots_outstanding_mask & ~(_port_registers.ncq_active);
+    // An NCQ command is done once its PxSACT bit clears. Non-queued ones (FLUSH CACHE EXT)
+    // never set it, and are only done once their PxCI bit clears. PxCI of an NCQ command
+    // clears before its PxSACT bit does, so a slot with neither bit set is done either way.
+    auto acks = _slots_outstanding_mask
+              & ~(_port_registers.ncq_active | _port_registers.command_mask);
 
     for (u32 slot = 0; acks != 0; ++slot, acks >>= 1) {
         if (acks & 1) {
@@ -83,12 +88,14 @@ auto AHCIState::find(pci::PCIState::bus_slot_addr addr, u32 slot)
             continue;
         }
 
-        auto result = kernel_pagedir.try_map(phys_addr, phys_addr, PTE_PWU);
+        // BAR5 lies outside the direct map, so it needs a mapping of its own, and an uncached one
+        auto const mapping = alloc::ioremap(
+            phys_addr, sizeof(registers),
+            PTE_PW | PTE_G | pagetables::memory_type(pagetables::MemoryType::Uncached));
 
-        assert(result.is_ok(), "Couldn't map AHCI address in pagetable!");
+        assert(mapping.some(), "Couldn't map AHCI address in pagetable!");
 
-        auto drive_regs = reinterpret_cast<volatile registers *>(
-            util::physical_addr_to_kernel(phys_addr));
+        auto drive_regs = reinterpret_cast<volatile registers *>(mapping.unwrap());
 
         if (!(drive_regs->global_hba_control & u32(GHCMasks::AHCIEnable))) {
             drive_regs->global_hba_control = u32(GHCMasks::AHCIEnable);
@@ -97,25 +104,29 @@ auto AHCIState::find(pci::PCIState::bus_slot_addr addr, u32 slot)
         for (; slot < 32; ++slot) {
             if ((drive_regs->port_mask & (1U << slot)) &&
                 drive_regs->port_regs[slot].sstatus) {
-                auto maybe_ahci_ptr =
-                    simple_allocator.kalloc(sizeof(AHCIState));
+                auto *ahci_ptr = alloc::knew<AHCIState>();
 
-                assert(maybe_ahci_ptr.some(),
+                assert(ahci_ptr != nullptr,
                        "Could not allocate enough space for AHCI metadata");
 
+                // The command list must be 1K-aligned and the FIS area 256-aligned;
+                // both sit inside dma_state, which is aligned to its strictest member.
+                auto maybe_dma = alloc::dma_alloc(sizeof(dma_state), alignof(dma_state));
+
+                assert(maybe_dma.some(),
+                       "Could not allocate AHCI command list and tables");
+
                 auto maybe_cache_ptr =
                     simple_allocator.kalloc(sizeof(BufferCache<>));
 
                 assert(maybe_cache_ptr.some(),
                        "Could not allocate enough space for AHCI cache");
 
-                auto *ahci_ptr =
-                    reinterpret_cast<AHCIState *>(maybe_ahci_ptr.unwrap());
                 auto *cache_ptr =
                     reinterpret_cast<BufferCache<> *>(maybe_cache_ptr.unwrap());
 
                 ::new (ahci_ptr) AHCIState(addr.bus, addr.slot, addr.func, slot,
-                                           *drive_regs, cache_ptr);
+                                           *drive_regs, cache_ptr, maybe_dma.unwrap());
                 return Option<AHCIState &>::Some(*ahci_ptr);
             }
         }
@@ -134,14 +145,14 @@ auto AHCIState::find(pci::PCIState::bus_slot_addr addr, u32 slot)
 // PCI devices and wishes to avoid repeating work.
 AHCIState::AHCIState(u8 const bus, u8 const slot, u8 const func_number,
                      u32 const sata_port, volatile registers &dr,
-                     BufferCache<> *cache)
-    : _bus(bus), _slot(slot), _func(func_number), _sata_port(sata_port),
+                     BufferCache<> *cache, alloc::DmaBuffer const& dma)
+    : _dma(*reinterpret_cast<dma_state *>(dma.virt)), _dma_phys(dma.phys), _bus(bus), _slot(slot), _func(func_number), _sata_port(sata_port),
       _drive_registers(dr), _port_registers(dr.port_regs[sata_port]),
       _num_ncq_slots(1), _num_slots_available(1), _slots_outstanding_mask(0),
       _cache(*cache) {
 
-    for (auto &slot : _slot_status) {
-        slot = nullptr;
+    for (auto &request : _slot_requests) {
+        request = nullptr;
     }
 
     auto &pci_state = pci::PCIState::get();
@@ -169,16 +180,20 @@ AHCIState::AHCIState(u8 const bus, u8 const slot, u8 const func_number,
 
     util::memset<u8>((void *)(&_dma), 0_u8, sizeof(_dma));
 
+    // The upper halves are only nonzero if the DMA area ended up above 4 GiB
     for (auto i = 0; i < 32; ++i) {
-        _dma.ch[i].command_table_address =
-            util::kernel_to_physical_addr(uptr(&_dma.ct[i]));
+        auto const table_addr = dma_phys(&_dma.ct[i]);
+        _dma.ch[i].command_table_address = u32(table_addr);
+        _dma.ch[i].command_table_address_upper = u32(table_addr >> 32);
     }
 
-    _port_registers.cmdlist_addr =
-        util::kernel_to_physical_addr(uptr(&_dma.ch[0]));
+    auto const cmdlist_addr = dma_phys(&_dma.ch[0]);
+    _port_registers.cmdlist_addr = u32(cmdlist_addr);
+    _port_registers.cmdlist_addr_upper = u32(cmdlist_addr >> 32);
 
-    _port_registers.rfis_base_addr =
-        util::kernel_to_physical_addr(uptr(&_dma.rfis));
+    auto const rfis_addr = dma_phys(&_dma.rfis);
+    _port_registers.rfis_base_addr = u32(rfis_addr);
+    _port_registers.rfis_base_addr_upper = u32(rfis_addr >> 32);
 
     // Clear all SATA errors/interrupt status, and power up
     _port_registers.serror = ~0U;
@@ -267,21 +282,39 @@ AHCIState::AHCIState(u8 const bus, u8 const slot, u8 const func_number,
     _drive_registers.interrupt_status = ~0U;
 }
 
+auto AHCIState::free_slot() const -> Option<u32> {
+    auto const free = _slots_full_mask & ~_slots_outstanding_mask;
+
+    if (free == 0 || _flushing) {
+        return Option<u32>::None();
+    }
+
+    return Option<u32>::Some(x86::tzcnt_32(free));
+}
+
 // Prepare `slot` to receive a command
 inline void AHCIState::clear_slot(u16 const slot) {
     _dma.ch[slot].num_buffers = 0;
     _dma.ch[slot].buffer_byte_pos = 0;
 }
 
+// Add [size] bytes at [data] to the command in `slot`, one PRD per MAX_PRD_BYTES
 void AHCIState::push_buffer(u32 const slot, void *data, usize const size) {
-    auto const phys_addr = util::kernel_to_physical_addr(uptr(data));
+    auto const phys_addr = u64(util::kernel_to_physical_addr(uptr(data)));
+
+    for (usize pushed = 0; pushed < size; pushed += MAX_PRD_BYTES) {
+        auto const num_buffers = _dma.ch[slot].num_buffers;
+        auto const chunk = util::min(size - pushed, MAX_PRD_BYTES);
 
-    auto const num_buffers = _dma.ch[slot].num_buffers;
+        assert(num_buffers < MAX_PRDS, "Too many AHCI PRDs for one command");
 
-    _dma.ct[slot].prdt[num_buffers].address = phys_addr;
-    _dma.ct[slot].prdt[num_buffers].data_byte_count = size - 1;
+        _dma.ct[slot].prdt[num_buffers].address = u32(phys_addr + pushed);
+        _dma.ct[slot].prdt[num_buffers].address_upper = u32((phys_addr + pushed) >> 32);
+        _dma.ct[slot].prdt[num_buffers].data_byte_count = chunk - 1;
+
+        _dma.ch[slot].num_buffers = num_buffers + 1;
+    }
 
-    _dma.ch[slot].num_buffers = num_buffers + 1;
     _dma.ch[slot].buffer_byte_pos += size;
 }
 
@@ -289,6 +322,7 @@ void AHCIState::push_buffer(u32 const slot, void *data, usize const size) {
 // Must preceed with clear_slot(slot) and push_buffer(slot).
 // `fua`: If true, then don't acknowledge the write until data has been durably
 // written to disk. `priority`: 0 is normal priority, 2 is high priority
+// submit never sets `fua`: writes go to the drive's cache, and flush makes them durable.
 void AHCIState::issue_ncq(u32 const slot,
                           pci::IDEController::Command const command,
                           usize const sector, bool const fua,
@@ -360,45 +394,108 @@ void AHCIState::await_basic(u32 const slot) {
 
 // Acknowledge a command waiting in `slot`
 void AHCIState::acknowledge(u32 const slot, u32 const result) {
-    _slots_outstanding_mask ^= 1U << slot;
+    _slots_outstanding_mask &= ~(1U << slot);
     ++_num_slots_available;
 
-    if (_slot_status[slot] != nullptr) {
-        *_slot_status[slot] = result;
-        _slot_status[slot] = nullptr;
-    }
-}
+    // A flush is only ever issued alone
+    _flushing = false;
 
-auto AHCIState::read_or_write(IDEController::Command const command,
-                              Slice<u8> &buf, usize const offset)
-    -> Result<Null, IOError> {
-    // IMPORTANT: this whole function needs to protected by a lock when we add
-    // multicore up until we start polling (which should block instead)
+    auto *const request = _slot_requests[slot];
 
-    // TODO: We should block here in a multicore/async environment, waiting for
-    // there to be a free slot using _slots_outstanding_mask
+    if (request == nullptr) {
+        return;
+    }
 
-    volatile u32 r;
-    {
-        InterruptGuard guard;
+    _slot_requests[slot] = nullptr;
+    request->status = result;
 
-        r = u32(IOError::TryAgain);
-        _slot_status[0] = &r;
+    // The request may be gone once the callback returns
+    if (request->on_complete != nullptr) {
+        request->on_complete(*request);
+    }
+}
 
-        this->clear_slot(0);
-        this->push_buffer(0, (void *)(buf.to_raw_ptr()), buf.len());
-        this->issue_ncq(0, command, offset / SECTOR_SIZE, true);
+// submit: Issue the command in any free slot, so that up to _num_ncq_slots commands can be in
+// flight at once. handle_interrupt acknowledges each as soon as the disk is done with it,
+// in whatever order the disk finishes them.
+void AHCIState::submit(Request &request) {
+    // IMPORTANT: claiming a slot needs to be protected by a lock when we add
+    // multicore
+
+    auto const command = request.direction == Direction::Write
+                             ? IDEController::Command::WriteFPDMAQueued
+                             : IDEController::Command::ReadFPDMAQueued;
+
+    request.status = u32(IOError::TryAgain);
+
+    for (;;) {
+        {
+            InterruptGuard guard;
+            auto const slot = this->free_slot();
+
+            if (slot.some()) {
+                _slot_requests[slot.unwrap()] = &request;
+
+                this->clear_slot(slot.unwrap());
+
+                if (request.segments.empty()) {
+                    this->push_buffer(slot.unwrap(), (void *)(request.buffer.to_raw_ptr()),
+                                      request.buffer.len());
+                } else {
+                    for (auto &segment : request.segments) {
+                        this->push_buffer(slot.unwrap(), (void *)(segment.to_raw_ptr()),
+                                          segment.len());
+                    }
+                }
+
+                assert(_dma.ch[slot.unwrap()].buffer_byte_pos % SECTOR_SIZE == 0 &&
+                           _dma.ch[slot.unwrap()].buffer_byte_pos / SECTOR_SIZE <= MAX_SECTORS,
+                       "Bad AHCI transfer size");
+
+                this->issue_ncq(slot.unwrap(), command, request.sector, false,
+                                u32(request.priority));
+                return;
+            }
+        }
+
+        // Interrupts are back as the caller had them. They must be on for a completion to
+        // free up a slot; block::Queue only submits when one is free anyway.
+        x86::pause();
     }
+}
 
+auto AHCIState::wait(Request const &request) -> Result<Null, IOError> {
     // TODO: This should block instead of polling after we add wait queues
-    // interrupts.
-    while (r == u32(IOError::TryAgain)) {
+    while (!request.done()) {
         x86::pause();
     }
 
-    _slot_status[0] = nullptr;
+    return request.result();
+}
+
+// flush: FLUSH CACHE EXT is not an NCQ command, so it has to have the disk to itself. It waits
+// for every outstanding command to finish, and holds off submit until it is done.
+auto AHCIState::flush() -> Result<Null, IOError> {
+    auto request = Request { .sector = 0, .direction = Direction::Write };
+
+    for (;;) {
+        {
+            InterruptGuard guard;
+
+            if (_slots_outstanding_mask == 0) {
+                _slot_requests[0] = &request;
+                _flushing = true;
+
+                this->clear_slot(0);
+                this->issue_meta(0, IDEController::Command::CacheFlushExt, 0);
+                break;
+            }
+        }
+
+        x86::pause();
+    }
 
-    return Result<Null, IOError>::Ok({});
+    return wait(request);
 }
 
 auto AHCIState::read_sector(usize sector)
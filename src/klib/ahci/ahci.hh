@@ -10,6 +10,7 @@
 #include "klib/pci/pci.hh"
 #include "klib/ahci/cache.hh"
 #include "klib/ahci/error.hh"
+#include "kernel/dma.hh"
 
 namespace wlib {
     namespace ahci {
@@ -26,15 +27,66 @@ namespace wlib {
             SET_DEVICE_BITS    = 0xA1, // 
         };
 
+        auto constexpr SECTOR_SIZE = 512_usize; // IMPORTANT: May not be true for all drives?
+
+        // Limits on a single Request. Each segment takes one PRD per started MAX_PRD_BYTES.
+        auto constexpr MAX_PRDS = 112_usize;
+        auto constexpr MAX_PRD_BYTES = 4_usize << 20;
+        auto constexpr MAX_SECTORS = 0xFFFF_usize; // The sector count field is 16 bits
+
+        enum class Direction : u8 {
+            Read,
+            Write,
+        };
+
+        // The PRIO field of an NCQ command: the disk tries to finish High requests first
+        enum class Priority : u8 {
+            Normal = 0,
+            High   = 2,
+        };
+
+        // An asynchronous request (see AHCIState::submit). The request is its own token:
+        // it, and its buffers, must stay put until it is done.
+        struct Request {
+            Slice<u8> buffer;    // Physically contiguous, a whole number of sectors
+
+            // Vectored I/O: if not empty, these are transferred one after the other in place of
+            // [buffer], all in one command. Each must be physically contiguous and an even
+            // number of bytes long; together, a whole number of sectors.
+            Slice<Slice<u8>> segments {};
+
+            usize sector;
+            Direction direction;
+            Priority priority = Priority::Normal;
+
+            // Called from the interrupt handler once the request is done. It may submit
+            // another request in its place, but must not wait for anything.
+            void (*on_complete)(Request& request) = nullptr;
+            void* context = nullptr; // For on_complete
+
+            // IOError::TryAgain while in flight, then 0 or the error it failed with
+            volatile u32 status = u32(IOError::TryAgain);
+
+            [[nodiscard]] auto done() const -> bool { return status != u32(IOError::TryAgain); }
+
+            // Only meaningful once done()
+            [[nodiscard]] auto result() const -> Result<Null, IOError> {
+                if (status != 0) {
+                    return Result<Null, IOError>::Err(IOError(status));
+                }
+                return Result<Null, IOError>::Ok({});
+            }
+        };
+
         // Made with help from Chickadee OS source (https://github.com/CS161/chickadee/)
         class AHCIState {
           private:
             // See page 23 of Serial ATA AHCI 1.3.1 specification for details (31 on PDF)
             struct port_registers {
                 u32 cmdlist_addr;        // PxCLB -- Port x Command List Base Address
-                u32 reserved;            // IMPORTANT: this assumes we are using 32-bit. if porting to 64-bit, change
+                u32 cmdlist_addr_upper;  // PxCLBU -- upper 32 bits of the above
                 u32 rfis_base_addr;      // PxRFIS -- Port x RFIS Base Address -- the base address of rfis_state
-                u32 reserved1;           // IMPORTANT: see above
+                u32 rfis_base_addr_upper;// PxFBU -- upper 32 bits of the above
                 u32 interrupt_status;    // PxIS 
                 u32 interrupt_enable;    // PxIE
                 u32 command_and_status;  // PxCMD -- Port x Command and Status
@@ -105,7 +157,7 @@ namespace wlib {
             // PRD -- this is distinct from the ATA PRD/PRDT (see pci/prdt.hh)
             struct prd {
                 u32 address;
-                u32 reserved_64;     // IMPORTANT: If porting to 64-bits, change address to 64-bits
+                u32 address_upper;   // Upper 32 bits of address, for buffers above 4 GiB
                 u32 reserved;
                 u32 data_byte_count; // Bit 31: Interrupt on completion flag
                                      // The byte count is the number of bytes in the buffer - 1
@@ -116,7 +168,7 @@ namespace wlib {
                 Array<u32, 16> cfis;    // Command definitions
                 Array<u32, 4> acmd;
                 Array<u32, 12> reserved;
-                Array<prd, 16> prdt;
+                Array<prd, MAX_PRDS> prdt; // Sized so that dma_state fits in 64 KiB
             };
             
             struct command_header {
@@ -124,7 +176,7 @@ namespace wlib {
                 u16 num_buffers;
                 u32 buffer_byte_pos;
                 u32 command_table_address;
-                u32 reserved_64; // IMPORTANT: When porting, change above u32 to u64
+                u32 command_table_address_upper;
                 Array<u64, 2> reserved;
             };
 
@@ -138,9 +190,10 @@ namespace wlib {
                 Array<command_table, 32> ct;
             };
 
-            auto static constexpr CFIS_COMMAND = 0x8027;
+            // dma_alloc rounds up to a power of two
+            static_assert(sizeof(dma_state) <= 0x10000, "AHCI command tables got too big");
 
-            auto static constexpr SECTOR_SIZE = 512_usize; // IMPORTANT: May not be true for all drives?
+            auto static constexpr CFIS_COMMAND = 0x8027;
 
             enum class CHFlag {
                 Clear = 0x400,
@@ -148,7 +201,9 @@ namespace wlib {
             };
 
             // Actual variable layout:
-            dma_state _dma;
+            // _dma lives in its own dma_alloc buffer; _dma_phys is its physical address.
+            dma_state& _dma;
+            uptr _dma_phys;
             u32 _bus;
             u32 _slot;
             u32 _func;
@@ -164,11 +219,16 @@ namespace wlib {
 
             // This is modifiable
             u16 _num_slots_available;
-            u16 _slots_outstanding_mask;
-            Array<volatile u32*, 32> _slot_status; // IMPORTANT: This should become atomic once multicore is set up
+            u32 _slots_outstanding_mask;
+            Array<Request*, 32> _slot_requests; // IMPORTANT: This should become atomic once multicore is set up
+            bool _flushing = false; // A FLUSH CACHE EXT is in flight, so nothing else may be issued
             BufferCache<>& _cache;
 
 
+            // The lowest command slot that is not in use, if any. Interrupts must be disabled
+            // until the slot is claimed by issuing a command in it.
+            auto free_slot() const -> Option<u32>;
+
             void clear_slot(u16 slot);
             void push_buffer(u32 slot, void* data, usize sz);
             void issue_meta(u32 slot, pci::IDEController::Command command, 
@@ -181,16 +241,20 @@ namespace wlib {
 
             void await_basic(u32 slot);    
 
+            // Physical address of [field], which must be inside _dma.
+            auto inline dma_phys(void const volatile* field) const -> u64 {
+                return u64(_dma_phys + (uptr(field) - uptr(&_dma)));
+            }
+
             auto static inline sstatus_active(u32 sstatus) -> bool {
                 return (sstatus & 0x03) == 3
                     || ((1U << ((sstatus & 0xF00) >> 8)) & 0x144) != 0;
             }
 
-            auto read_or_write(pci::IDEController::Command command,
-                               Slice<u8>& buf, usize offset) -> Result<Null, IOError>;
             
           public:
-            AHCIState(u8 bus, u8 slot, u8 func_number, u32 sata_port, volatile registers& dr, BufferCache<>* cache);
+            AHCIState(u8 bus, u8 slot, u8 func_number, u32 sata_port, volatile registers& dr,
+                      BufferCache<>* cache, alloc::DmaBuffer const& dma);
             AHCIState(AHCIState const&) = delete;
 
             inline auto irq() -> u32 { return _irq; }
@@ -200,6 +264,8 @@ namespace wlib {
 
             auto inline num_sectors() -> usize { return _num_sectors; }
 
+            auto inline num_ncq_slots() -> u32 { return _num_ncq_slots; }
+
             inline void enable_interrupts() {
                 _drive_registers.global_hba_control 
                     = _drive_registers.global_hba_control | u32(GHCMasks::InterruptEnable);
@@ -210,6 +276,19 @@ namespace wlib {
                     = _drive_registers.global_hba_control & (~u32(GHCMasks::InterruptEnable));
             }
             
+            // Start [request] and return without waiting for it. If every command slot is busy,
+            // waits for one to free up first. The request's status says when it is done.
+            // The request must be within MAX_PRDS and MAX_SECTORS.
+            void submit(Request& request);
+
+            // Wait for [request] to be done, and return its result.
+            [[nodiscard]] auto wait(Request const& request) -> Result<Null, IOError>;
+
+            // Write the drive's cache out to the medium. Writes are only acknowledged once they
+            // reach the cache, so this is what makes them durable. Covers every write that is
+            // done by the time it is called; it waits for the ones still in flight first.
+            [[nodiscard]] auto flush() -> Result<Null, IOError>;
+
             [[nodiscard]] auto static find(pci::PCIState::bus_slot_addr = {}, 
                                            u32 sata_port = 0) -> Option<AHCIState&>;
 
@@ -218,15 +297,35 @@ namespace wlib {
             [[nodiscard]] auto read_sector(usize sector) -> Result<BufferCache<>::Buffer, IOError>;
 
             [[nodiscard]] inline auto read(Slice<u8>& buf, usize offset) -> Result<Null, IOError> {
-                return read_or_write(pci::IDEController::Command::ReadFPDMAQueued, 
-                                     buf, offset);
+                auto request = Request { .buffer = buf, .sector = offset / SECTOR_SIZE,
+                                         .direction = Direction::Read };
+                submit(request);
+                return wait(request);
             }
 
             [[nodiscard]] inline auto write(Slice<u8> const& buf, usize offset) -> Result<Null, IOError> {
-                // const_cast is OK here since we won't be writing to this buffer
-                // when we use the write command
-                return read_or_write(pci::IDEController::Command::WriteFPDMAQueued, 
-                                     const_cast<Slice<u8>&>(buf), offset);
+                auto request = Request { .buffer = buf, .sector = offset / SECTOR_SIZE,
+                                         .direction = Direction::Write };
+                submit(request);
+                return wait(request);
+            }
+
+            // Read the sectors from [offset] on into [segments], in a single command.
+            [[nodiscard]] inline auto readv(Slice<Slice<u8>> const& segments,
+                                            usize offset) -> Result<Null, IOError> {
+                auto request = Request { .segments = segments, .sector = offset / SECTOR_SIZE,
+                                         .direction = Direction::Read };
+                submit(request);
+                return wait(request);
+            }
+
+            // Write [segments] to the sectors from [offset] on, in a single command.
+            [[nodiscard]] inline auto writev(Slice<Slice<u8>> const& segments,
+                                             usize offset) -> Result<Null, IOError> {
+                auto request = Request { .segments = segments, .sector = offset / SECTOR_SIZE,
+                                         .direction = Direction::Write };
+                submit(request);
+                return wait(request);
             }
 
             void constexpr take_buffer(u8 buf_num) {
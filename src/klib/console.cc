@@ -112,6 +112,19 @@ namespace wlib::console {
         move(digits + 1);
     }
 
+#ifdef __x86_64__
+    void Console::put(u64 num) {
+        auto const digits = num_digits(num, 10);
+        move(digits - 1);
+        do {
+            auto const digit = char(num % 10 + '0');
+            put_char_back(digit);
+            num /= 10;
+        } while (num > 0);
+        move(digits + 1);
+    }
+#endif
+
     void Console::put(bool const b) {
         static constexpr Array<str const, 2> outputs {"false", "true"};
         put(outputs[b]);
@@ -2,6 +2,7 @@
 #include "klib/strings.hh"
 #include "klib/int.hh"
 #include "klib/ports.hh"
+#include "klib/util.hh"
 
 namespace wlib::console {
     enum class Color : u8 {
@@ -78,7 +79,11 @@ namespace wlib::console {
             move_cursor(m_row, m_col);
         }
 
-        Console() : m_col(0), m_row(0), console_page(reinterpret_cast<u16 *const>(0xb8000)) {
+        // Physical address of the VGA text buffer
+        auto static constexpr TEXT_BUFFER = uptr(0xb8000);
+
+        Console() : m_col(0), m_row(0),
+                    console_page(reinterpret_cast<u16 *>(util::physical_addr_to_kernel(TEXT_BUFFER))) {
             ports::outb(Console::SET_REGISTER, Console::CURSOR_START);
             ports::outb(Console::CURSOR_CONTROL, 0x20);
             ports::outb(Console::SET_REGISTER, Console::CURSOR_START);
@@ -128,6 +133,10 @@ namespace wlib::console {
         void put(str const string);
         void put(void* const ptr);
         void put(u32 num);
+#ifdef __x86_64__
+        // usize and uptr are 64 bits wide here
+        void put(u64 num);
+#endif
         void put(i32 const num) {
             put(u32(num));
         }
@@ -157,11 +166,17 @@ namespace wlib::console {
         }
 
         void put(bool b);
+
+        /// Write to the text buffer through [page] from now on, e.g. a write-combining mapping of
+        /// TEXT_BUFFER. The contents are left alone.
+        void set_page(u16* const page) {
+            console_page = page;
+        }
         
       private:
         u8 m_col;
         u8 m_row;
-        u16 *const console_page;
+        u16* console_page;
 
         static u8 const MAX_ROWS = 25;
         static u8 const MAX_COLS = 80;
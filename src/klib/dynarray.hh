@@ -8,9 +8,8 @@
 namespace wlib {
     // DynArray -- Like a regular vector, but with a fixed size. 
     // The size cannot be changed after initialization.
-    // NOTE: It is much preferred to avoid dynamic allocation if at all possible
-    // since we only have a page frame allocator (buddy allocator).
-    // We need a slab allocator to make this cheaper to use
+    // Backed by kmalloc, so small arrays come out of the slab size classes
+    // rather than costing a whole page.
     template<typename T>
     class DynArray {
       public:
@@ -25,7 +24,7 @@ namespace wlib {
         }
 
         [[nodiscard]] auto static initialize(usize size) -> Option<DynArray> {
-            auto const ptr = simple_allocator.kalloc(size);
+            auto ptr = alloc::kmalloc(size * sizeof(T));
             if (ptr.none()) {
                 return Option<DynArray>::None();
             }
@@ -82,7 +81,7 @@ namespace wlib {
 
         ~DynArray() {
             if (_array != nullptr) {
-                simple_allocator.kfree(uptr(_array));
+                alloc::kmfree(uptr(_array));
             }
         }
 
@@ -1,3 +1,89 @@
+%ifdef ARCH_X86_64
+[bits 64]
+; There is no pushad in long mode. Saved in the order regstate (idt.hh) expects.
+%macro push_regs 0
+    push rax
+    push rcx
+    push rdx
+    push rbx
+    push rbp
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+%endmacro
+
+%macro pop_regs 0
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rbp
+    pop rbx
+    pop rdx
+    pop rcx
+    pop rax
+%endmacro
+
+; The CPU aligns the stack before pushing its frame, so after the error code, vector and
+; the 15 registers, rsp is 16 byte aligned again as the System V ABI wants for the call.
+%macro isr_err_stub 1
+isr_stub_%+%1:
+    push qword %1
+    push_regs
+    mov rdi, rsp
+    call exception_handler
+    pop_regs
+    add rsp, 16
+    iretq
+%endmacro
+
+%macro isr_no_err_stub 1
+isr_stub_%+%1:
+    push qword 0
+    push qword %1
+    push_regs
+    mov rdi, rsp
+    call exception_handler
+    pop_regs
+    add rsp, 16
+    iretq
+%endmacro
+
+%macro keyboard_stub 0
+isr_stub_33:
+    push_regs
+    call keyboard_handler
+    pop_regs
+    iretq
+%endmacro
+
+%macro timer_stub 0
+isr_stub_32:
+    push qword 0
+    push qword 32
+    push_regs
+    mov rdi, rsp
+    call timer_handler
+    pop_regs
+    add rsp, 16
+    iretq
+%endmacro
+
+%define STUB_ADDRESS dq
+%else
 ; Macro for interrupts (exceptions) with error codes
 %macro isr_err_stub 1
 isr_stub_%+%1:
@@ -47,6 +133,10 @@ isr_stub_32:
 %endmacro
 
 
+
+%define STUB_ADDRESS dd
+%endif
+
 extern exception_handler
 extern keyboard_handler
 extern timer_handler
@@ -121,6 +211,6 @@ global isr_stub_table
 isr_stub_table:
 %assign i 0
 %rep 64
-    dd isr_stub_%+i
+    STUB_ADDRESS isr_stub_%+i
 %assign i i+1
 %endrep
@@ -8,6 +8,32 @@ namespace wlib {
         void sleep(usize miliseconds);
     };
 
+#ifdef __x86_64__
+    // Long mode gates are 16 bytes, with a 64-bit handler address.
+    class alignas(16) IdtEntry {
+      public:
+        IdtEntry() {}
+        void set(void* handler, u8 flags, u16 code_segment) {
+            auto handler_address = reinterpret_cast<uptr>(handler);
+            _isr_low = handler_address & 0xFFFF;
+            _kernel_cs = code_segment;
+            _ist = 0;
+            _attributes = flags;
+            _isr_mid = (handler_address >> 16) & 0xFFFF;
+            _isr_high = u32(handler_address >> 32);
+            _reserved = 0;
+        }
+
+      private:
+        u16 _isr_low = 0;
+        u16 _kernel_cs = 0;
+        u8 _ist = 0;
+        u8 _attributes = 0;
+        u16 _isr_mid = 0;
+        u32 _isr_high = 0;
+        u32 _reserved = 0;
+    } __attribute__((packed));
+#else
     class alignas(8) IdtEntry {
       public:
         IdtEntry() : _isr_low(0), _kernel_cs(0), _reserved(0), _attributes(0), _isr_high(0) {}
@@ -29,6 +55,7 @@ namespace wlib {
         u16 _isr_high = 0;
 
     } __attribute__((packed));
+#endif
 
     class Idtr {
     public:
@@ -42,7 +69,7 @@ namespace wlib {
 
     private:
         u16 _limit = 0;
-        u32 _base = 0;
+        uptr _base = 0;
     } __attribute__((packed));
 
     class alignas(16) Idt {
@@ -65,6 +92,13 @@ namespace wlib {
             __asm__ volatile ("cli");
         }
 
+        /// Return whether interrupts are enabled (EFLAGS.IF).
+        [[nodiscard]] inline static auto interrupts_enabled() -> bool {
+            usize flags;
+            __asm__ volatile ("pushf\n\tpop %0" : "=r"(flags));
+            return flags & (1 << 9);
+        }
+
         void init();
         Array<IdtEntry, 256> _idt;
 
@@ -72,23 +106,59 @@ namespace wlib {
       private:
     };
 
-    /// InterruptGuard: Disables interrupts when constructed and then 
-    /// enables interrupts at the end of its scope.
+    /// InterruptGuard: Disables interrupts when constructed, and puts them back the way
+    /// they were at the end of its scope. Guards can nest.
     class InterruptGuard {
         InterruptGuard(InterruptGuard const&) = delete;
         InterruptGuard& operator=(InterruptGuard const&) = delete;
 
         public:
-            InterruptGuard() {
+            InterruptGuard() : _enabled(Idt::interrupts_enabled()) {
                 Idt::disable_interrupts();
             }
             ~InterruptGuard() {
-                Idt::enable_interrupts();
+                if (_enabled) {
+                    Idt::enable_interrupts();
+                }
             }
         private:
+            bool _enabled;
     };
 
 
+#ifdef __x86_64__
+    // Pushed by the stubs in idt.asm, lowest address first.
+    struct regstate {
+    public:
+        usize reg_r15;
+        usize reg_r14;
+        usize reg_r13;
+        usize reg_r12;
+        usize reg_r11;
+        usize reg_r10;
+        usize reg_r9;
+        usize reg_r8;
+        usize reg_rdi;
+        usize reg_rsi;
+        usize reg_rbp;
+        usize reg_rbx;
+        usize reg_rdx;
+        usize reg_rcx;
+        usize reg_rax;
+        usize vector_code;
+        usize error_code;
+        usize reg_rip;
+        usize reg_cs;
+        usize reg_rflags;
+        usize reg_rsp;
+        usize reg_ss;
+
+        [[nodiscard]] auto instruction_pointer() const -> uptr { return reg_rip; }
+        // Whether interrupts were enabled (RFLAGS.IF) in the interrupted code.
+        [[nodiscard]] auto interrupts_enabled() const -> bool { return reg_rflags & (1 << 9); }
+    private:
+    } __attribute__((packed));
+#else
     struct regstate {
     public:
         usize reg_edi;
@@ -104,8 +174,13 @@ namespace wlib {
         usize reg_eip;
         usize reg_cs;
         usize reg_eflags;
+
+        [[nodiscard]] auto instruction_pointer() const -> uptr { return reg_eip; }
+        // Whether interrupts were enabled (EFLAGS.IF) in the interrupted code.
+        [[nodiscard]] auto interrupts_enabled() const -> bool { return reg_eflags & (1 << 9); }
     private:
     } __attribute__((packed));
+#endif
 
 
 }; // namespace wlib
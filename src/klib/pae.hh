@@ -0,0 +1,209 @@
+#pragma once
+#include "klib/int.hh"
+#include "klib/array.hh"
+#include "klib/nullable.hh"
+#include "klib/pagetables.hh"
+#include "klib/result.hh"
+#include "klib/util.hh"
+
+namespace wlib::pagetables::pae {
+    // Physical Address Extension paging: three levels of 64-bit entries, so page frames may
+    // live anywhere below 2^52 rather than only in the first 4 GiB, and pages may be
+    // marked no-execute. Virtual addresses are still 32 bits, split as
+    //
+    //   bits 30-31: page directory pointer table index (4 entries)
+    //   bits 21-29: page directory index (512 entries, each may map a 2 MiB page)
+    //   bits 12-20: page table index (512 entries)
+
+    // Size of a page mapped directly by a page directory entry.
+    auto static constexpr LARGE_PAGESIZE = 0x200000;
+
+    class Entry {
+      public:
+        Entry() : _internal(0) {}
+        Entry(Entry const& entry) = delete;
+
+        /// Return whether this entry is [P]resent.
+        [[nodiscard]] auto constexpr present()     const -> bool { return _internal & PTE_P; }
+        /// Return whether this entry is [W]ritable.
+        [[nodiscard]] auto constexpr writable()    const -> bool { return _internal & PTE_W; }
+        /// Return whether this entry is [U]ser-accessible.
+        [[nodiscard]] auto constexpr user()        const -> bool { return _internal & PTE_U; }
+        /// Return whether this page directory entry maps a 2 MiB page rather than a pagetable.
+        [[nodiscard]] auto constexpr large()       const -> bool { return _internal & PAGE_SIZE_BIT; }
+        /// Return whether this entry's TLB entries survive %cr3 reloads.
+        [[nodiscard]] auto constexpr global()      const -> bool { return _internal & PTE_G; }
+        /// Return whether instruction fetches from this page fault.
+        [[nodiscard]] auto constexpr no_execute()  const -> bool { return _internal & NX_BIT; }
+
+        /// Return the physical address of the page or table this entry points to.
+        [[nodiscard]] auto constexpr address() const -> u64 {
+            return _internal & ADDRESS_MASK;
+        }
+
+        /// Return the physical address of the 2 MiB page mapped by this entry, if it is large().
+        [[nodiscard]] auto constexpr large_page_address() const -> u64 {
+            return _internal & ADDRESS_MASK & ~u64(LARGE_PAGESIZE - 1);
+        }
+
+        /// Same as address(), for code shared with the non-PAE PageTableEntry.
+        [[nodiscard]] auto constexpr page_address() const -> u64 { return address(); }
+
+        /// Return the permission and status bits, with NX reported as PTE_NX.
+        [[nodiscard]] auto constexpr perm() const -> u16 {
+            return u16(_internal & 0x7FF) | (no_execute() ? PTE_NX : 0);
+        }
+
+        /// Point this entry at physical address [addr] with given [perm]issions.
+        void set(u64 addr, u16 perm);
+
+        /// Make this entry a copy of [other].
+        void copy_from(Entry const& other) {
+            _internal = other._internal;
+        }
+
+        /// Keep this entry's flags, but point it at physical address [addr].
+        void set_address(u64 const addr) {
+            _internal = (_internal & ~ADDRESS_MASK) | addr;
+        }
+
+        /// Point this entry at the 2 MiB page at [addr]. Only valid in a page directory.
+        void set_large(u64 const addr, u16 const perm) {
+            set(addr, large_page_perm(perm));
+            _internal |= PAGE_SIZE_BIT;
+        }
+
+        /// Clear this entry, so whatever it pointed to is no longer mapped.
+        void clear() {
+            _internal = 0;
+        }
+
+        /// Return the raw entry, for loading into the page directory pointer table.
+        [[nodiscard]] auto constexpr raw() const -> u64 { return _internal; }
+
+      private:
+        auto static constexpr PAGE_SIZE_BIT = 0b10000000_u64;
+        auto static constexpr NX_BIT = 1_u64 << 63;
+        auto static constexpr ADDRESS_MASK = 0x000FFFFFFFFFF000_u64;
+
+        u64 _internal;
+    } __attribute__((packed));
+
+    // Both page directories and pagetables: 512 entries filling one page.
+    class alignas(PAGESIZE) Table {
+      public:
+        Table(Table const& table) = delete;
+        Table() {}
+        static auto constexpr NUM_ENTRIES = 512_usize;
+
+        constexpr Entry const& operator[](usize idx) const { return _entries[idx]; }
+        constexpr Entry& operator[](usize idx) { return _entries[idx]; }
+
+        [[nodiscard]] auto static constexpr pt_idx(uptr const address) -> usize {
+            return (address >> 12) & 0x1FF;
+        }
+
+        [[nodiscard]] auto static constexpr pd_idx(uptr const address) -> usize {
+            return (address >> 21) & 0x1FF;
+        }
+
+      private:
+        Array<Entry, NUM_ENTRIES> _entries;
+    };
+
+    // The top level. Page directories are allocated the first time something is mapped under
+    // them, and clones share the kernel's instead of copying it. The CPU caches the pointer table
+    // when %cr3 is loaded, so adding a directory to the loaded table reloads %cr3.
+    class PageDirectoryPointerTable {
+      public:
+        PageDirectoryPointerTable(PageDirectoryPointerTable const& pdpt) = delete;
+        PageDirectoryPointerTable();
+        static auto constexpr NUM_ENTRIES = 4_usize;
+
+        [[nodiscard]] auto try_map(uptr virtual_addr, u64 physical_addr, u16 perm) -> Result<Null, Null>;
+
+        // Map the 2 MiB page at [virtual_addr] to [physical_addr]. Both must be 2 MiB aligned,
+        // and nothing may be mapped in that range yet.
+        [[nodiscard]] auto map_large(uptr virtual_addr, u64 physical_addr, u16 perm) -> Result<Null, Null>;
+
+        // Remove the mapping (or swap entry) for [virtual_addr] and flush it from the TLB.
+        // Returns the physical address it mapped to, if it was mapped.
+        auto unmap(uptr virtual_addr) -> Nullable<u64, u64(-1)>;
+
+        auto va_to_pa(uptr address) const -> Nullable<u64, u64(-1)>;
+
+        // Same contracts as in PageDirectory
+        [[nodiscard]] auto clone_into(PageDirectoryPointerTable& child) -> Result<Null, Null>;
+        [[nodiscard]] auto sync_kernel(PageDirectoryPointerTable const& kernel, uptr address) -> bool;
+        void release_user();
+        [[nodiscard]] auto resolve_cow(uptr address) -> bool;
+        [[nodiscard]] auto test_and_clear_accessed(uptr address) -> bool;
+        auto swap_out(uptr address, u32 slot) -> Nullable<u64, u64(-1)>;
+        auto remap(uptr address, u64 physical_addr) -> Nullable<u64, u64(-1)>;
+        [[nodiscard]] auto swap_slot(uptr address) const -> Nullable<u32, u32(-1)>;
+
+        /// Load this table into %cr3. CR4.PAE must already be set (see grub/crt0.asm).
+        void set_page_directory() const;
+
+        [[nodiscard]] auto static constexpr pdpt_idx(uptr const address) -> usize {
+            return address >> 30;
+        }
+
+      private:
+        // Return the page directory for [address], allocating it if it's missing and [create].
+        auto directory(uptr address, bool create) const -> Option<Table&>;
+
+        // Return the pagetable for [address], if its page directory entry points to one.
+        auto get_pt(uptr address) const -> Option<Table&>;
+
+        // Modified through directory() even when const, like in PageMapLevel4
+        alignas(32) mutable Array<u64, NUM_ENTRIES> _pointers;
+    };
+
+#ifdef __x86_64__
+    // Long mode adds a fourth level on top, and the pointer table becomes a full Table:
+    //
+    //   bits 39-47: page map level 4 index
+    //   bits 30-38: page directory pointer table index
+    //   bits 21-29, 12-20: as above
+    //
+    // Lower levels are allocated as they are needed.
+    class alignas(PAGESIZE) PageMapLevel4 {
+      public:
+        PageMapLevel4(PageMapLevel4 const& pml4) = delete;
+        PageMapLevel4() {}
+
+        [[nodiscard]] auto try_map(uptr virtual_addr, u64 physical_addr, u16 perm) -> Result<Null, Null>;
+        [[nodiscard]] auto map_large(uptr virtual_addr, u64 physical_addr, u16 perm) -> Result<Null, Null>;
+        auto unmap(uptr virtual_addr) -> Nullable<u64, u64(-1)>;
+        auto va_to_pa(uptr address) const -> Nullable<u64, u64(-1)>;
+        [[nodiscard]] auto clone_into(PageMapLevel4& child) -> Result<Null, Null>;
+        [[nodiscard]] auto sync_kernel(PageMapLevel4 const& kernel, uptr address) -> bool;
+        void release_user();
+        [[nodiscard]] auto resolve_cow(uptr address) -> bool;
+        [[nodiscard]] auto test_and_clear_accessed(uptr address) -> bool;
+        auto swap_out(uptr address, u32 slot) -> Nullable<u64, u64(-1)>;
+        auto remap(uptr address, u64 physical_addr) -> Nullable<u64, u64(-1)>;
+        [[nodiscard]] auto swap_slot(uptr address) const -> Nullable<u32, u32(-1)>;
+        void set_page_directory() const;
+
+        [[nodiscard]] auto static constexpr pml4_idx(uptr const address) -> usize {
+            return (address >> 39) & 0x1FF;
+        }
+
+        [[nodiscard]] auto static constexpr pdpt_idx(uptr const address) -> usize {
+            return (address >> 30) & 0x1FF;
+        }
+
+      private:
+        // Return the page directory for [address], allocating missing levels if [create].
+        auto directory(uptr address, bool create) const -> Option<Table&>;
+
+        // Return the pagetable for [address], if its page directory entry points to one.
+        auto get_pt(uptr address) const -> Option<Table&>;
+
+        // Modified through directory() even when const, like the hardware does with A/D bits
+        mutable Table _entries;
+    };
+#endif
+};
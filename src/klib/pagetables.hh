@@ -4,6 +4,7 @@
 #include "klib/console.hh"
 #include "klib/nullable.hh"
 #include "klib/result.hh"
+#include "klib/util.hh"
 
 
 namespace wlib {
@@ -15,9 +16,85 @@ namespace wlib {
     auto static constexpr PTE_PW  = PTE_P | PTE_W;
     auto static constexpr PTE_PU  = PTE_P | PTE_U;
 
+    // Global: the TLB entry survives %cr3 reloads (needs CR4.PGE). For kernel mappings only,
+    // since they are the same in every address space.
+    auto static constexpr PTE_G   = 0b100000000;
+
+    // No-execute: instruction fetches from the page fault. Only honoured in PAE mode with
+    // EFER.NXE set (see enable_no_execute); it sits in an ignored bit otherwise.
+    auto static constexpr PTE_NX  = 0b100000000000;
+
+    // Copy-on-write: the page is shared read-only after an address space was cloned, and gets
+    // copied on the first write. One of the bits the CPU ignores.
+    auto static constexpr PTE_COW = 0b1000000000;
+
+    // Set by the CPU on every access through the entry; the swap code clears it to find cold pages.
+    auto static constexpr PTE_A   = 0b100000;
+
+    // Swapped out: a non-present entry with this bit set holds a swap slot where the frame
+    // address would be (see kernel/swap.hh). The CPU ignores every other bit of a non-present entry.
+    auto static constexpr PTE_SWAPPED = 0b10000000000;
+
+    // Cache control bits. Together they select one of the eight Page Attribute Table entries;
+    // use memory_type() rather than setting them directly. PTE_PAT is where the bit lives in a
+    // 4 KiB entry: the map_large functions move it to bit 12, where large pages keep it.
+    auto static constexpr PTE_PWT = 0b1000;
+    auto static constexpr PTE_PCD = 0b10000;
+    auto static constexpr PTE_PAT = 0b10000000;
+    auto static constexpr LARGE_PAT = 0b1000000000000;
+
+    // Size of a page mapped directly by a page directory entry (needs CR4.PSE, set in crt0).
+    auto static constexpr LARGE_PAGESIZE = 0x400000;
+
     namespace pagetables {
         void enable_paging();
 
+        enum class MemoryType {
+            WriteBack,      // Ordinary RAM
+            Uncached,       // Device registers: every access goes to the device, in order
+            WriteCombining, // Frame buffers: writes are buffered and sent in bursts
+        };
+
+        /// Program the Page Attribute Table so that every MemoryType is available, if the CPU
+        /// supports it. Without PAT, WriteCombining falls back to Uncached.
+        void enable_pat();
+
+        /// Return the cache control bits to OR into a 4 KiB mapping's permissions for [type].
+        [[nodiscard]] auto memory_type(MemoryType type) -> u16;
+
+        /// Move the PAT bit of [perm] (from memory_type) to where a large page entry keeps it.
+        [[nodiscard]] auto constexpr large_page_perm(u16 const perm) -> u16 {
+            return (perm & PTE_PAT) ? u16((perm & ~PTE_PAT) | LARGE_PAT) : perm;
+        }
+
+        /// Return whether crt0 switched to PAE paging, which it does if CPUID reports support.
+        [[nodiscard]] auto pae_enabled() -> bool;
+
+        /// Set CR0.WP, so that the kernel too faults when writing to read-only (e.g. copy-on-write) pages.
+        void enable_write_protect();
+
+        /// Set EFER.NXE if the CPU supports it, so PTE_NX is honoured in PAE mode.
+        /// Returns whether no-execute is now in effect.
+        auto enable_no_execute() -> bool;
+
+        [[nodiscard]] auto no_execute_enabled() -> bool;
+
+        /// Honour the G bit by setting CR4.PGE, if the CPU supports it.
+        void enable_global_pages();
+
+        /// Drop the TLB entry for the page containing [virtual_addr], global or not.
+        void invalidate_page(uptr virtual_addr);
+
+        /// Drop the TLB entries for every page overlapping [virtual_addr, virtual_addr + size).
+        /// Large ranges flush the whole TLB instead, which is cheaper than that many invlpgs.
+        void invalidate_range(uptr virtual_addr, usize size);
+
+        /// Drop every non-global TLB entry, by reloading %cr3.
+        void flush_tlb();
+
+        /// Drop every TLB entry, global ones included, by toggling CR4.PGE.
+        void flush_tlb_all();
+
         class PageTableEntry {
           public:
             PageTableEntry() : _internal(0) {}
@@ -44,20 +121,35 @@ namespace wlib {
 
             /// Return the address of the page pointed by this PT Entry.
             [[nodiscard]] auto constexpr page_address() const -> uptr { 
-                return _internal & 0xFFFFFF00;
+                return _internal & 0xFFFFF000;
+            }
+
+            /// Return the permission and status bits of this entry.
+            [[nodiscard]] auto constexpr perm() const -> u16 {
+                return u16(_internal & 0xFFF);
+            }
+
+            /// Point this entry at physical address [addr] with given [perm]issions.
+            void set(u64 const addr, u16 const perm) {
+                _internal = u32(addr) | perm;
             }
 
             /// Make this pagetable entry map to physical address [addr].
-            auto map(uptr addr, u8 perm) -> Result<Null, Null> {
+            auto map(uptr addr, u16 perm) -> Result<Null, Null> {
                 _internal = addr;
                 _internal |= perm;
                 return Result<Null, Null>::Ok({});
             }
             
-            [[nodiscard]] auto try_map(uptr addr, u8 perm) -> Result<Null, Null> {
+            [[nodiscard]] auto try_map(uptr addr, u16 perm) -> Result<Null, Null> {
                 return map(addr, perm);
             }
 
+            /// Clear this entry, so the page it pointed to is no longer mapped.
+            void unmap() {
+                _internal = 0;
+            }
+
 
           private:
             u32 _internal;
@@ -110,26 +202,44 @@ namespace wlib {
             [[nodiscard]] auto constexpr cache_disable() const -> bool  { return _internal & 0b10000; }
             /// Return whether this directory was read during virtual address translation.
             [[nodiscard]] auto constexpr accessed()      const -> bool  { return _internal & 0b100000; }
+            /// Return whether this entry maps a 4 MiB page directly, rather than pointing to a pagetable.
+            [[nodiscard]] auto constexpr large()         const -> bool  { return _internal & PAGE_SIZE_BIT; }
 
-            /// Return the address of the pagetable pointed by this PD Entry.
+            /// Return the physical address of the pagetable pointed by this PD Entry.
             [[nodiscard]] auto constexpr pt_address() const -> uptr { 
-                return _internal & 0xFFFFFF00;
+                return large() ? 0 : _internal & 0xFFFFF000;
+            }
+
+            /// Return the address of the 4 MiB page mapped by this PD Entry, if it is large().
+            [[nodiscard]] auto constexpr large_page_address() const -> uptr {
+                return _internal & 0xFFC00000;
+            }
+
+            /// Make this entry map the 4 MiB page at physical address [addr] with given [perm]issions.
+            /// Fails if [addr] is not 4 MiB aligned or this entry is already in use.
+            [[nodiscard]] auto map_large(uptr const addr, u16 const perm) -> Result<Null, Null> {
+                if (addr % LARGE_PAGESIZE != 0 || _internal != 0) [[unlikely]] {
+                    return Result<Null, Null>::Err({});
+                }
+                _internal = addr | large_page_perm(perm) | PAGE_SIZE_BIT;
+                return Result<Null, Null>::Ok({});
             }
             
             // Obtain a reference to the pagetable associated with this directory entry, if possible.
+            // Large entries have no pagetable.
             [[nodiscard]] auto get_pt() const -> Option<PageTable&> {
-                auto const pt_addr = reinterpret_cast<PageTable*>(pt_address());
-                if (!pt_addr) {
+                if (pt_address() == 0) {
                     return Option<PageTable&>::None();
                 } else {
-                    auto& pt_ref = *pt_addr;
+                    auto& pt_ref = *reinterpret_cast<PageTable*>(
+                        util::physical_addr_to_kernel(pt_address()));
                     return Option<PageTable&>::Some(pt_ref);
                 }
             }
 
             // Map [virtual_addr] to [physical_addr] with given [perm]issions.
             // Returns -1 on failure. Else, returns 0.
-            auto map(uptr const virtual_addr, uptr const physical_addr, u8 const perm) -> Result<Null, Null> {
+            auto map(uptr const virtual_addr, uptr const physical_addr, u16 const perm) -> Result<Null, Null> {
                 auto& pagetable = get_pt().unwrap();
                 auto pt_idx = pagetable.pt_idx(virtual_addr);
 
@@ -140,7 +250,7 @@ namespace wlib {
             // Try to map [virtual_addr] to [physical_addr] with given [perm]issions.
             // If this operation fails, returns -1. Otherwise, returns 0.
             [[nodiscard]] auto try_map(uptr const virtual_addr,
-                                       uptr const physical_addr, u8 const perm) -> Result<Null, Null> {
+                                       uptr const physical_addr, u16 const perm) -> Result<Null, Null> {
                 auto maybe_pagetable = get_pt();
                 if (maybe_pagetable.none()) {
                     return Result<Null, Null>::Err({});
@@ -155,9 +265,28 @@ namespace wlib {
             }
 
 
+            // Point this entry at the pagetable at kernel address [ptable_addr].
             [[nodiscard]] auto add_pt(uptr ptable_addr, u8 perm) -> Result<Null, Null>;
 
+            /// Make this entry a copy of [other], pointing at the same pagetable or large page.
+            void copy_from(PageDirectoryEntry const& other) {
+                _internal = other._internal;
+            }
+
+            /// Keep this entry's flags, but point it at the pagetable at kernel address [ptable_addr].
+            void set_pt_address(uptr const ptable_addr) {
+                _internal = (_internal & 0xFFF) | u32(util::kernel_to_physical_addr(ptable_addr));
+            }
+
+            /// Forget the pagetable or large page this entry points to.
+            void clear() {
+                _internal = 0;
+            }
+
           private:
+            // PS: set when this entry maps a 4 MiB page
+            auto static constexpr PAGE_SIZE_BIT = 0b10000000_u32;
+
             u32 _internal;
         } __attribute__((packed));
 
@@ -172,16 +301,60 @@ namespace wlib {
 
             auto add_pagetable(usize const idx, PageTable const&, u8 perm) -> Result<Null, Null>;
 
-            auto map(uptr const virtual_addr, uptr const physical_addr, u8 perm) -> Result<Null, Null>;
+            auto map(uptr const virtual_addr, uptr const physical_addr, u16 perm) -> Result<Null, Null>;
 
             [[nodiscard]] auto try_map(uptr const virtual_addr, 
-                                       uptr const physical_addr, u8 const perm) -> Result<Null, Null>;
+                                       uptr const physical_addr, u16 const perm) -> Result<Null, Null>;
+
+            // Map the 4 MiB page at [virtual_addr] to [physical_addr]. Both must be 4 MiB aligned,
+            // and nothing may be mapped in that range yet.
+            [[nodiscard]] auto map_large(uptr virtual_addr, uptr physical_addr, u16 perm) -> Result<Null, Null>;
+
+            // Remove the mapping (or swap entry) for [virtual_addr] and flush it from the TLB.
+            // Returns the physical address it mapped to, if it was mapped.
+            auto unmap(uptr virtual_addr) -> Nullable<uptr, uptr(-1)>;
 
             /// Set this page directory to be the page directory in force using %cr3.
             void set_page_directory() const;
 
             auto va_to_pa(uptr const address) const -> Nullable<uptr, uptr(-1)>;
 
+            // Give [child] the same user mappings as this directory, sharing every page: writable
+            // ones become read-only and PTE_COW in both, to be copied on the first write (see
+            // resolve_cow). Kernel entries are copied as they are. [child] must be empty.
+            // On failure, [child] holds whatever was cloned so far; release_user() it.
+            [[nodiscard]] auto clone_into(PageDirectory& child) -> Result<Null, Null>;
+
+            // Kernel entries are only copied when cloning, so pagetables the kernel gains later
+            // (vmalloc, ioremap, demand regions) are missing here. Copy the entry for [address]
+            // from [kernel] if it is a kernel address this directory lacks. Returns whether it
+            // did, in which case the fault at [address] is fixed.
+            [[nodiscard]] auto sync_kernel(PageDirectory const& kernel, uptr address) -> bool;
+
+            // Unmap every user page, dropping a reference to each frame, and free the pagetables.
+            void release_user();
+
+            // Handle a write fault at [address]: if the page is PTE_COW, give this directory
+            // its own writable copy (or just make it writable, if nobody else shares it).
+            // Returns false if [address] is not a copy-on-write page.
+            [[nodiscard]] auto resolve_cow(uptr address) -> bool;
+
+            // Return whether the page at [address] was accessed since the last call, clearing
+            // its accessed bit (and TLB entry) so the next access sets it again.
+            [[nodiscard]] auto test_and_clear_accessed(uptr address) -> bool;
+
+            // Replace the mapping for [address] with a swap entry for [slot], and flush it from the TLB.
+            // Returns the physical address it mapped to; nothing changes if it was not mapped.
+            auto swap_out(uptr address, u32 slot) -> Nullable<u64, u64(-1)>;
+
+            // Point the page at [address] at [physical_addr] instead, keeping its permissions, and
+            // flush it from the TLB. Returns the physical address it mapped to; nothing changes
+            // if it was not mapped.
+            auto remap(uptr address, u64 physical_addr) -> Nullable<u64, u64(-1)>;
+
+            // The swap slot the page at [address] was swapped out to, if it was.
+            [[nodiscard]] auto swap_slot(uptr address) const -> Nullable<u32, u32(-1)>;
+
             [[nodiscard]] auto constexpr va_to_idx(uptr addr) const -> usize {
                 // Indexed by top 10 bits (2^10 = 1024)
                 return (addr & 0xFFC00000) >> 22;
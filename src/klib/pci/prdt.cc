@@ -1,5 +1,5 @@
 #include "kernel/kernel.hh"
-#include "kernel/alloc.hh"
+#include "kernel/dma.hh"
 #include "klib/ports.hh"
 #include "klib/util.hh"
 #include "klib/pci/prdt.hh"
@@ -11,19 +11,19 @@ auto PRDT::initialize(u16 const entry_count,
                       u16 const bus_master_register, 
                       ChannelType const channel) -> Result<Null, Null> {
     usize bytes = usize(entry_count) * sizeof(PRD_Entry);
-    auto location = simple_allocator.kalloc(bytes);
+    auto location = alloc::dma_alloc(bytes, 4, 64 * 1024);
 
     if (location.none()) {
         return Result<Null, Null>::Err({});
     }
 
-    this->prdt_location = location.unwrap_as<PRD_Entry*>();
+    this->prdt_location = reinterpret_cast<PRD_Entry*>(location.unwrap().virt);
     this->bus_master_register = bus_master_register + static_cast<u8>(channel);
     this->entry_count = entry_count;
 
     auto const port = this->bus_master_register + static_cast<u8>(BMROffset::Command);
 
-    ports::outl(port, location.unwrap());
+    ports::outl(port, location.unwrap().phys);
 
     return Result<Null, Null>::Ok({});
 }
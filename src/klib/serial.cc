@@ -0,0 +1,63 @@
+#include "klib/serial.hh"
+#include "klib/array.hh"
+
+wlib::serial::SerialPort com1(wlib::serial::COM1);
+
+namespace wlib::serial {
+    void SerialPort::init() {
+        ports::outb(m_base + INTERRUPT_ENABLE, 0x00);
+        // Set DLAB so that the next two writes go to the divisor latch: 115200 / 3 = 38400 baud
+        ports::outb(m_base + LINE_CONTROL, 0x80);
+        ports::outb(m_base + DATA, 0x03);
+        ports::outb(m_base + INTERRUPT_ENABLE, 0x00);
+        // 8 bits, no parity, one stop bit (this also clears DLAB)
+        ports::outb(m_base + LINE_CONTROL, 0x03);
+        // Enable and clear FIFOs, 14-byte threshold
+        ports::outb(m_base + FIFO_CONTROL, 0xC7);
+        // DTR, RTS and OUT2
+        ports::outb(m_base + MODEM_CONTROL, 0x0B);
+    }
+
+    void SerialPort::put_char(char const ch) {
+        while ((ports::inb(m_base + LINE_STATUS) & TRANSMIT_EMPTY) == 0) {}
+        ports::outb(m_base + DATA, u8(ch));
+    }
+
+    void SerialPort::put(str const string) {
+        for (auto const ch : string) {
+            put_char(ch);
+        }
+    }
+
+    void SerialPort::put(u32 num) {
+        Array<char, 10> digits;
+        auto count = 0_u8;
+
+        do {
+            digits[count] = char(num % 10 + '0');
+            ++count;
+            num /= 10;
+        } while (num > 0);
+
+        while (count > 0) {
+            --count;
+            put_char(digits[count]);
+        }
+    }
+
+    void SerialPort::put(void* const ptr) {
+        static constexpr Array<char const, 16> hex_values {'0', '1', '2', '3', '4', '5', '6', '7',
+                                                           '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+        put(str("0x"));
+        auto const addr = reinterpret_cast<uptr>(ptr);
+        auto started = false;
+
+        for (auto shift = i32(sizeof(uptr) * 8 - 4); shift >= 0; shift -= 4) {
+            auto const nibble = (addr >> shift) & 0xF;
+            started |= nibble != 0 || shift == 0;
+            if (started) {
+                put_char(hex_values[nibble]);
+            }
+        }
+    }
+}
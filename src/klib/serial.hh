@@ -0,0 +1,74 @@
+#pragma once
+#include "klib/strings.hh"
+#include "klib/int.hh"
+#include "klib/ports.hh"
+
+namespace wlib::serial {
+    // SerialPort: Polled, output-only driver for a 16550 UART.
+    // Meant for dumps and logs that should outlive the VGA console (QEMU writes COM1 to a file).
+    class SerialPort {
+      public:
+        constexpr SerialPort(u16 const base) : m_base(base) {}
+        SerialPort(SerialPort const&) = delete;
+
+        // 38400 baud, 8N1, FIFOs on, interrupts off.
+        void init();
+
+        void print() {}
+
+        template<typename T, typename... Types>
+        void print(T&& var1, Types&&... var2) {
+            put(var1);
+            print(var2...);
+        }
+
+        template<size_t S, typename... Types>
+        void print(char const (&var1)[S], Types&&... var2) {
+            print(str(var1, S), var2...);
+        }
+
+        template<typename... Types>
+        void print_line(Types&&... var2) {
+            print(var2...);
+            put_char('\r');
+            put_char('\n');
+        }
+
+        void put_char(char ch);
+        void put(str string);
+        void put(void* ptr);
+        void put(u32 num);
+
+        void put(i32 const num) {
+            put(u32(num));
+        }
+
+        void put(u16 const num) {
+            put(u32(num));
+        }
+
+        void put(u8 const num) {
+            put(u32(num));
+        }
+
+        void put(char const ch) {
+            put_char(ch);
+        }
+
+      private:
+        u16 const m_base;
+
+        static u16 const DATA = 0;
+        static u16 const INTERRUPT_ENABLE = 1;
+        static u16 const FIFO_CONTROL = 2;
+        static u16 const LINE_CONTROL = 3;
+        static u16 const MODEM_CONTROL = 4;
+        static u16 const LINE_STATUS = 5;
+
+        static u8 const TRANSMIT_EMPTY = 0x20;
+    };
+
+    auto constexpr COM1 = 0x3F8_u16;
+}; // namespace wlib::serial
+
+extern wlib::serial::SerialPort com1;
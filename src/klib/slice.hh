@@ -7,6 +7,8 @@ namespace wlib {
     template<typename T>
     class Slice {
       public:
+        constexpr Slice() : _values(nullptr), _size(0) {}
+
         constexpr Slice(T* values, usize size) : _values(values), _size(size) {}
         
         template<usize S>
@@ -5,9 +5,20 @@ void* memset(void* ptr, int ch, size_t count) {
     auto const ch_value = static_cast<unsigned char>(ch);
 
     for (size_t i = 0; i < count; ++i) {
-        *ch_ptr = ch_value;
+        ch_ptr[i] = ch_value;
     }
 
     return ptr;
 }
 
+
+void* memcpy(void* dest, void const* src, size_t count) {
+    auto const dest_ptr = reinterpret_cast<char*>(dest);
+    auto const src_ptr = reinterpret_cast<char const*>(src);
+
+    for (size_t i = 0; i < count; ++i) {
+        dest_ptr[i] = src_ptr[i];
+    }
+
+    return dest;
+}
@@ -48,7 +48,17 @@ namespace wlib::util {
     inline void memset(void* ptr, T value, usize count) {
         auto const t_ptr = reinterpret_cast<T*>(ptr);
         for (usize i = 0; i < count; ++i) {
-            *t_ptr = value;
+            t_ptr[i] = value;
+        }
+    }
+
+    // Copy [count] Ts from [src] to [dest], which must not overlap.
+    template<typename T>
+    inline void memcpy(void* dest, void const* src, usize count) {
+        auto const t_dest = reinterpret_cast<T*>(dest);
+        auto const t_src = reinterpret_cast<T const*>(src);
+        for (usize i = 0; i < count; ++i) {
+            t_dest[i] = t_src[i];
         }
     }
 
@@ -67,16 +77,29 @@ namespace wlib::util {
         #endif
     }
     
-    inline auto kernel_to_physical_addr(uptr kernel_addr) -> uptr {
-        // This does nothing right now, but may save time if we make a higher-half kernel
-        return kernel_addr;
+    // Where physical address 0 appears in the kernel's address space. Managed RAM (the kernel
+    // image included) is mapped linearly from here, so translating is a single add.
+    // Keep in sync with KERNEL_VIRTUAL_BASE in grub/crt0.asm and ldconfig.ld (ldconfig64.ld).
+#ifdef __x86_64__
+    auto constexpr KERNEL_VIRTUAL_BASE = uptr(0xFFFFFFFF80000000);
+#else
+    auto constexpr KERNEL_VIRTUAL_BASE = uptr(0xC0000000);
+#endif
+
+    // Only valid for addresses in the direct map, i.e. not for vmalloc memory.
+    inline auto constexpr kernel_to_physical_addr(uptr kernel_addr) -> uptr {
+        return kernel_addr - KERNEL_VIRTUAL_BASE;
     }
 
-    inline auto physical_addr_to_kernel(uptr physical_addr) -> uptr {
-        return physical_addr;
+    inline auto constexpr physical_addr_to_kernel(uptr physical_addr) -> uptr {
+        return physical_addr + KERNEL_VIRTUAL_BASE;
     }
 }; // namespace wlib::util
 
-// This is outside of any namespace on purpose. "memset" is used by the compiler.
-// Prefer to use util::memset as it can take advantage of greater-sized integers.
-void* memset(void* ptr, int ch, size_t count);
+// These are outside of any namespace, and unmangled, on purpose: the compiler turns fill and
+// copy loops (util::memset and util::memcpy included) into calls to "memset" and "memcpy".
+// Prefer util::memset as it can take advantage of greater-sized integers.
+extern "C" {
+    void* memset(void* ptr, int ch, size_t count);
+    void* memcpy(void* dest, void const* src, size_t count);
+}
@@ -37,10 +37,15 @@ namespace wlib::x86 {
 
     [[nodiscard]] inline auto read_cr2() -> uptr {
         uptr cr2;
-        asm volatile("movl %%cr2, %0" : "=r" (cr2));
+        asm volatile("mov %%cr2, %0" : "=r" (cr2));
         return cr2;
     }
 
+    // Invalidate the TLB entry for the page containing [addr].
+    inline void invlpg(uptr const addr) {
+        asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+    }
+
     
 
     [[nodiscard]] inline auto lzcnt_16(u16 num) -> u16 {
@@ -0,0 +1,130 @@
+#include "klib/console.hh"
+#include "kernel/alloc.hh"
+#include "kernel/block_queue.hh"
+#include "kernel/kernel.hh"
+#include "kernel/multiboot.hh"
+#include "klib/ahci/ahci.hh"
+#include "klib/array.hh"
+#include "klib/assert.hh"
+#include "klib/idt.hh"
+#include "klib/new.hh"
+#include "klib/pic.hh"
+#include "klib/ps2/keyboard.hh"
+#include "klib/slice.hh"
+
+using namespace wlib;
+using ahci::Direction;
+using ahci::SECTOR_SIZE;
+
+// kernel.cc is left out of test images, but the interrupt handlers and filesystems expect these
+Option<ahci::AHCIState &> sata_disk0 = Option<ahci::AHCIState &>::None();
+Option<block::Queue &> disk0_queue = Option<block::Queue &>::None();
+ps2::Ps2Keyboard keyboard;
+
+// Adjacent sectors, submitted in this order
+auto static constexpr NUM_SECTORS = 8_usize;
+static Array<usize, NUM_SECTORS> const order = { 3, 1, 0, 2, 6, 7, 5, 4 };
+
+static Array<block::Request, 32> fillers;
+static Array<block::Request, NUM_SECTORS> requests;
+
+// Keep every command of [queue] busy with a read of sector 0, then queue one request per sector
+// [first] + order[i] behind them, for sector order[i] of [buffer]. Returns how many commands
+// the queue used for those requests once they are done.
+auto static run(block::Queue& queue, usize const first, Direction const direction, u8* const buffer,
+                u8* const scratch, u32 const slots) -> u32 {
+    u32 commands;
+
+    {
+        // No completion can free a command until we are done submitting
+        InterruptGuard guard;
+
+        for (u32 i = 0; i < slots; ++i) {
+            fillers[i] = block::Request {
+                .buffer = Slice<u8>(scratch, SECTOR_SIZE),
+                .sector = 0,
+                .direction = Direction::Read,
+            };
+            queue.submit(fillers[i]);
+        }
+
+        commands = queue.stats().commands;
+
+        for (usize i = 0; i < NUM_SECTORS; ++i) {
+            requests[i] = block::Request {
+                .buffer = Slice<u8>(buffer + order[i] * SECTOR_SIZE, SECTOR_SIZE),
+                .sector = first + order[i],
+                .direction = direction,
+            };
+            queue.submit(requests[i]);
+        }
+
+        assert(queue.stats().commands == commands, "Requests went out without a free command");
+    }
+
+    for (u32 i = 0; i < slots; ++i) {
+        assert(queue.wait(fillers[i]).is_ok(), "Filler read failed");
+    }
+
+    for (auto& request : requests) {
+        assert(queue.wait(request).is_ok(), "Request failed");
+    }
+
+    return queue.stats().commands - commands;
+}
+
+extern "C" void kernel_main(u32, kernel::multiboot::Info const* multiboot_info) {
+    using console::Color;
+
+    terminal.clear();
+    simple_allocator.init(*multiboot_info);
+    setup_pagedir();
+
+    Pic::remap(0x20, 0x28);
+    Pic::clear_masks();
+    idt.init();
+    Idt::enable_interrupts();
+
+    sata_disk0 = ahci::AHCIState::find();
+    assert(sata_disk0.some(), "Unable to find hard disk");
+    auto& disk = sata_disk0.unwrap();
+    disk.enable_interrupts();
+
+    auto* const queue = alloc::knew<block::Queue>();
+    assert(queue != nullptr, "Could not allocate the disk queue");
+    ::new (queue) block::Queue(disk);
+
+    auto const slots = util::min(disk.num_ncq_slots(), 32_u32);
+    auto const written = simple_allocator.kalloc(PAGESIZE);
+    auto const read = simple_allocator.kalloc(PAGESIZE);
+    auto const scratch = simple_allocator.kalloc(PAGESIZE);
+    assert(written.some() && read.some() && scratch.some(), "simple_allocator returned nothing");
+
+    auto* const out = reinterpret_cast<u8*>(written.unwrap());
+    auto* const in = reinterpret_cast<u8*>(read.unwrap());
+
+    for (usize i = 0; i < NUM_SECTORS * SECTOR_SIZE; ++i) {
+        out[i] = u8(i * 7 + i / SECTOR_SIZE);
+        in[i] = 0;
+    }
+
+    // Scribbles over the end of the disk, where swap would go
+    auto const first = disk.num_sectors() - NUM_SECTORS;
+    auto const requests_before = queue->stats().requests;
+
+    // The queued requests are adjacent, so each direction needs just one command
+    assert(run(*queue, first, Direction::Write, out, reinterpret_cast<u8*>(scratch.unwrap()),
+               slots) == 1, "Writes were not merged");
+    assert(run(*queue, first, Direction::Read, in, reinterpret_cast<u8*>(scratch.unwrap()),
+               slots) == 1, "Reads were not merged");
+    assert(queue->stats().requests - requests_before == 2 * (slots + NUM_SECTORS),
+           "Requests not counted");
+
+    for (usize i = 0; i < NUM_SECTORS * SECTOR_SIZE; ++i) {
+        assert(in[i] == out[i], "Read back the wrong data");
+    }
+
+    terminal.print_line("commands: ", queue->stats().commands,
+                        ", requests: ", queue->stats().requests);
+    terminal.print_line_color(Color::LightGreen, Color::Black, "Test passed!");
+}
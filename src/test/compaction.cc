@@ -0,0 +1,66 @@
+#include "klib/console.hh"
+#include "kernel/alloc.hh"
+#include "kernel/multiboot.hh"
+#include "klib/array.hh"
+#include "klib/pagetables.hh"
+#include "klib/assert.hh"
+
+using namespace wlib;
+using alloc::Mobility;
+
+auto static constexpr NUM_PAGES = 64_u32;
+
+// Stands in for the pagetables: the owner of each page is its index in here, plus one
+static Array<uptr, NUM_PAGES> pages;
+
+auto static migrate(uptr const frame, uptr const destination) -> bool {
+    auto const idx = reinterpret_cast<uptr>(simple_allocator.owner(frame)) - 1;
+
+    assert(pages[idx] == frame, "Migrated the wrong frame");
+
+    *reinterpret_cast<u32*>(destination) = *reinterpret_cast<u32*>(frame);
+    pages[idx] = destination;
+    simple_allocator.set_owner(destination, reinterpret_cast<void*>(idx + 1));
+    return true;
+}
+
+extern "C" void kernel_main(u32, kernel::multiboot::Info const* multiboot_info) {
+    using console::Color;
+
+    terminal.clear();
+    simple_allocator.init(*multiboot_info);
+
+    for (u32 i = 0; i < NUM_PAGES; ++i) {
+        auto const page = simple_allocator.kalloc(PAGESIZE, Mobility::Movable);
+        assert(page.some(), "simple_allocator returned nothing");
+
+        pages[i] = page.unwrap();
+        *reinterpret_cast<u32*>(pages[i]) = i;
+        simple_allocator.set_owner(pages[i], reinterpret_cast<void*>(uptr(i) + 1));
+    }
+
+    // Every other page is freed, so none of them can coalesce
+    for (u32 i = 0; i < NUM_PAGES; i += 2) {
+        simple_allocator.kfree(pages[i]);
+        pages[i] = 0;
+    }
+
+    assert(simple_allocator.compact(2, migrate), "Compaction failed");
+    assert(simple_allocator.stats().compactions == 1, "Compaction not counted");
+    assert(simple_allocator.stats().migrations > 0, "Nothing was moved");
+
+    // An unowned page can't be moved
+    auto const pinned = simple_allocator.kalloc(PAGESIZE, Mobility::Movable);
+    assert(pinned.some() && simple_allocator.owner(pinned.unwrap()) == nullptr,
+           "Freed frame kept its owner");
+
+    for (u32 i = 1; i < NUM_PAGES; i += 2) {
+        assert(*reinterpret_cast<u32*>(pages[i]) == i, "Page contents were lost");
+        simple_allocator.kfree(pages[i]);
+    }
+
+    simple_allocator.kfree(pinned.unwrap());
+
+    simple_allocator.print_stats(terminal);
+    terminal.print_line_color(Color::LightGreen, Color::Black, "Test passed!");
+}
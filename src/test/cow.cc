@@ -0,0 +1,75 @@
+#include "klib/console.hh"
+#include "kernel/alloc.hh"
+#include "kernel/multiboot.hh"
+#include "klib/pagetables.hh"
+#include "klib/assert.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using pagetables::PageDirectory;
+using pagetables::PageTableEntry;
+
+// Any user address will do
+auto static constexpr ADDRESS = uptr(0x400000);
+
+static PageDirectory parent;
+static PageDirectory child;
+
+auto static pte_of(PageDirectory& pd) -> PageTableEntry& {
+    auto& pt = pd[pd.va_to_idx(ADDRESS)].get_pt().unwrap();
+    return pt[pt.pt_idx(ADDRESS)];
+}
+
+// The page at ADDRESS in [pd], through the direct map.
+auto static page_of(PageDirectory const& pd) -> u32* {
+    return reinterpret_cast<u32*>(util::physical_addr_to_kernel(pd.va_to_pa(ADDRESS).unwrap()));
+}
+
+// [pte] must map the frame at kernel address [frame] read-only and copy-on-write.
+void static assert_shared(PageTableEntry const& pte, uptr const frame) {
+    assert(pte.present() && !pte.writable() && (pte.perm() & PTE_COW), "Expected a COW page");
+    assert(pte.page_address() == util::kernel_to_physical_addr(frame), "Frame not shared");
+}
+
+extern "C" void kernel_main(u32, kernel::multiboot::Info const* multiboot_info) {
+    using console::Color;
+
+    terminal.clear();
+    simple_allocator.init(*multiboot_info);
+
+    auto const free_pages = simple_allocator.free_pages();
+
+    auto const frame = simple_allocator.kalloc(PAGESIZE);
+    assert(frame.some(), "simple_allocator returned nothing");
+    *reinterpret_cast<u32*>(frame.unwrap()) = 0xC0FFEE;
+
+    assert(parent.try_map(ADDRESS, util::kernel_to_physical_addr(frame.unwrap()), PTE_PWU).is_ok(),
+           "Couldn't map the page");
+    assert(parent.clone_into(child).is_ok(), "Clone failed");
+
+    // Both now share the frame, and neither may write to it
+    assert(simple_allocator.ref_count(frame.unwrap()) == 2, "Expected two references");
+    assert_shared(pte_of(parent), frame.unwrap());
+    assert_shared(pte_of(child), frame.unwrap());
+
+    // A write to the child's page faults, and the fault handler gives it a copy
+    assert(child.resolve_cow(ADDRESS), "Page was not copy-on-write");
+    assert(pte_of(child).writable() && !(pte_of(child).perm() & PTE_COW), "Copy is not writable");
+    assert(page_of(child) != page_of(parent), "Child did not get a copy");
+    assert(*page_of(child) == 0xC0FFEE, "Copy lost the contents");
+
+    *page_of(child) = 0xBEEF;
+    assert(*page_of(parent) == 0xC0FFEE, "Write went through to the parent");
+    assert(simple_allocator.ref_count(frame.unwrap()) == 1, "Child kept its reference");
+
+    // The parent is the last one left, so its write needs no copy
+    assert(parent.resolve_cow(ADDRESS), "Page was not copy-on-write");
+    assert(page_of(parent) == reinterpret_cast<u32*>(frame.unwrap()), "Parent copied its page");
+
+    child.release_user();
+    parent.release_user();
+    assert(simple_allocator.free_pages() == free_pages, "Frames or pagetables leaked");
+
+    simple_allocator.print_stats(terminal);
+    terminal.print_line_color(Color::LightGreen, Color::Black, "Test passed!");
+}
@@ -0,0 +1,46 @@
+#include "klib/console.hh"
+#include "kernel/alloc.hh"
+#include "kernel/multiboot.hh"
+#include "klib/pagetables.hh"
+#include "klib/assert.hh"
+#include "klib/util.hh"
+
+using namespace wlib;
+using alloc::BuddyAllocator;
+using alloc::Mobility;
+
+auto static pageblock_of(uptr const addr) -> uptr {
+    return util::kernel_to_physical_addr(addr) / (PAGESIZE << BuddyAllocator::PAGEBLOCK_ORDER);
+}
+
+extern "C" void kernel_main(u32, kernel::multiboot::Info const* multiboot_info) {
+    using console::Color;
+
+    terminal.clear();
+    simple_allocator.init(*multiboot_info);
+
+    // Everything starts out movable, so the first unmovable page has to claim a pageblock
+    auto const first = simple_allocator.kalloc(PAGESIZE);
+    assert(first.some(), "simple_allocator returned nothing");
+    assert(simple_allocator.stats().fallbacks == 1, "Expected a fallback");
+    assert(simple_allocator.pageblocks(Mobility::Unmovable) == 1, "Expected one unmovable pageblock");
+
+    auto const movable = simple_allocator.kalloc(PAGESIZE, Mobility::Movable);
+    assert(movable.some(), "simple_allocator returned nothing");
+    assert(pageblock_of(movable.unwrap()) != pageblock_of(first.unwrap()),
+           "Movable page landed in an unmovable pageblock");
+
+    // Further unmovable pages fill up the claimed pageblock without falling back again
+    auto const second = simple_allocator.kalloc(PAGESIZE);
+    assert(second.some(), "simple_allocator returned nothing");
+    assert(pageblock_of(second.unwrap()) == pageblock_of(first.unwrap()),
+           "Unmovable pages were not grouped");
+    assert(simple_allocator.stats().fallbacks == 1, "Unexpected fallback");
+
+    simple_allocator.kfree(second.unwrap());
+    simple_allocator.kfree(movable.unwrap());
+    simple_allocator.kfree(first.unwrap());
+
+    simple_allocator.print_stats(terminal);
+    terminal.print_line_color(Color::LightGreen, Color::Black, "Test passed!");
+}
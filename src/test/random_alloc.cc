@@ -2,17 +2,17 @@
 #include "klib/console.hh"
 #include "klib/array.hh"
 #include "kernel/alloc.hh"
+#include "kernel/multiboot.hh"
 #include "klib/pagetables.hh"
 #include "klib/assert.hh"
 
 using namespace wlib;
 
-alloc::BuddyAllocator simple_allocator;
-
-extern "C" void kernel_main() {
+extern "C" void kernel_main(u32, kernel::multiboot::Info const* multiboot_info) {
     using console::Color;
 
     terminal.clear();
+    simple_allocator.init(*multiboot_info);
 
     auto arr = Array<uptr, 32>::filled(0);
 
@@ -0,0 +1,66 @@
+#include "klib/strings.hh"
+#include "klib/console.hh"
+#include "klib/array.hh"
+#include "kernel/alloc.hh"
+#include "kernel/slab.hh"
+#include "kernel/multiboot.hh"
+#include "klib/pagetables.hh"
+#include "klib/assert.hh"
+
+using namespace wlib;
+
+struct Handle {
+    u32 id;
+    u32 position;
+    Handle(u32 id) : id(id), position(0) {}
+};
+
+static alloc::ObjectCache<Handle> handles;
+
+extern "C" void kernel_main(u32, kernel::multiboot::Info const* multiboot_info) {
+    using console::Color;
+
+    terminal.clear();
+    simple_allocator.init(*multiboot_info);
+
+    auto arr = Array<uptr, 256>::filled(0);
+
+    // Every size class, several slabs' worth each, must come back aligned to its class
+    for (usize size = 16; size <= 2048; size <<= 1) {
+        for (usize i = 0; i < arr.len(); ++i) {
+            auto object = alloc::kmalloc(size);
+            assert(object.some(), "kmalloc returned nothing");
+            assert(object.unwrap() % size == 0, "kmalloc returned a misaligned object");
+            arr[i] = object.unwrap();
+        }
+
+        for (usize i = 0; i < arr.len(); ++i) {
+            alloc::kmfree(arr[i]);
+        }
+
+        terminal.print_line("Passed size class ", u32(size));
+    }
+
+    // Objects from the same page must not cost a page each
+    auto const first = alloc::kmalloc(24).unwrap();
+    auto const second = alloc::kmalloc(24).unwrap();
+    assert(first / PAGESIZE == second / PAGESIZE, "Small objects were not packed into one slab");
+    alloc::kmfree(first);
+    alloc::kmfree(second);
+
+    Array<Handle*, 64> created;
+
+    for (u32 i = 0; i < created.len(); ++i) {
+        created[i] = handles.create(i);
+        assert(created[i] != nullptr, "ObjectCache returned nothing");
+        assert(created[i]->id == i && created[i]->position == 0, "Object was not constructed");
+    }
+
+    for (auto* handle : created) {
+        handles.destroy(handle);
+    }
+
+    terminal.print_line("Passed object cache");
+
+    terminal.print_line_color(Color::LightGreen, Color::Black, "Test passed!");
+}
@@ -1,9 +1,14 @@
 #include "klib/console.hh"
+#include "klib/serial.hh"
 #include "klib/assert.hh"
 #include "klib/ps2/keyboard.hh"
 #include "klib/ahci/ahci.hh"
+#include "kernel/block_queue.hh"
 #include "kernel/vfs/vfs.hh"
 #include "kernel/ext2/ext2_util.hh"
+#include "kernel/alloc.hh"
+#include "kernel/compaction.hh"
+#include "kernel/zeroed_pages.hh"
 
 // Note: This is not going to run in userspace just yet. This program will first
 // run in kernel space and will be used to aid in creating some programs on the file system
@@ -89,6 +94,10 @@ static void parse_input(InputBuffer& buffer, u16 end) {
             }
             terminal.print_line();
         }
+    } else if (command == "meminfo") {
+        // Also dump to COM1, which keeps the full history after the screen scrolls
+        simple_allocator.print_stats(terminal);
+        simple_allocator.print_stats(com1);
     } else if (command == "mkdir") {
     } else if (command == "mkfile") {
         auto maybe_arg = space_split.next();
@@ -98,7 +107,7 @@ static void parse_input(InputBuffer& buffer, u16 end) {
 
         auto& arg = maybe_arg.unwrap();
 
-        auto result = FileHandle::create(&sata_disk0.unwrap(), arg);
+        auto result = FileHandle::create(&disk0_queue.unwrap(), arg);
 
         if (result.is_ok()) {
             terminal.print_line("File handle successfully created with name ", arg);
@@ -111,7 +120,7 @@ static void parse_input(InputBuffer& buffer, u16 end) {
 
 
 void shell_main() {
-    assert(sata_disk0.some(), "SATA disk must be made first");
+    assert(disk0_queue.some(), "SATA disk must be made first");
     terminal.print('>');
 
     bool left_shift_pressed = false;
@@ -198,6 +207,12 @@ void shell_main() {
                 extended = false;
             }
         }
+
+        // Nothing to do until the next interrupt: clear a few pages for later,
+        // and put a large free block back together if we are out of them.
+        // Kept small so that a keypress arriving meanwhile isn't noticeably delayed.
+        alloc::refill_zeroed_pages(4);
+        alloc::compact_idle();
         __asm__ volatile ("hlt");
     }
 }
@@ -3,6 +3,7 @@
 #include "klib/nullable.hh"
 #include "klib/console.hh"
 #include "klib/ahci/ahci.hh"
+#include "kernel/block_queue.hh"
 
 namespace wnfs {
     class BufCache {
@@ -58,7 +59,11 @@ namespace wnfs {
             return wlib::Nullable<u8, u8(-1)>::None();
         }
 
-        [[nodiscard]] auto inline read_buf_sector(u32 sector) 
+        // Metadata (inodes, bitmaps) should be read and flushed with Priority::High, so that it
+        // doesn't wait behind file data.
+        [[nodiscard]] auto inline read_buf_sector(u32 sector,
+                                                  wlib::ahci::Priority priority
+                                                      = wlib::ahci::Priority::Normal) 
                                   -> wlib::Result<BufCacheRef, wlib::Null> {
             auto const maybe_buf_num = buf_with_sector(sector);
             if (maybe_buf_num.some()) {
@@ -72,7 +77,7 @@ namespace wnfs {
                 if (_buffer_free_mask & (1 << i)) {
                     wlib::Slice slice(_buffer, i * BUF_SIZE, BUF_SIZE);
 
-                    auto result = sata_disk0.unwrap().read(slice, sector * BUF_SIZE);
+                    auto result = disk0_queue.unwrap().read(slice, sector * BUF_SIZE, priority);
 
                     if (result.is_err()) {
                         return wlib::Result<BufCacheRef, wlib::Null>::ErrInPlace();
@@ -87,10 +92,11 @@ namespace wnfs {
             return wlib::Result<BufCacheRef, wlib::Null>::ErrInPlace();
         }
 
-        auto inline flush(u8 buf_num) -> wlib::Result<wlib::Null, wlib::ahci::IOError> {
+        auto inline flush(u8 buf_num, wlib::ahci::Priority priority = wlib::ahci::Priority::Normal)
+            -> wlib::Result<wlib::Null, wlib::ahci::IOError> {
             wlib::Slice slice(&get_val(0, buf_num), BUF_SIZE);
             _buffer_dirty_mask &= ~(1 << buf_num);
-            return sata_disk0->write(slice, _buf_sectors[buf_num] * BUF_SIZE);
+            return disk0_queue->write(slice, _buf_sectors[buf_num] * BUF_SIZE, priority);
         }
 
 
@@ -11,13 +11,14 @@
 #include "kernel/vfs/vfs.hh"
 
 using namespace wlib;
-using ahci::AHCIState;
+using block::Queue;
 using ahci::IOError;
+using ahci::Priority;
 using kernel::vfs::ReadError;
 using kernel::vfs::file_metadata;
 using kernel::vfs::MetadataError;
 
-auto wnfs::format_disk(AHCIState* const disk) -> Result<Null, IOError> {
+auto wnfs::format_disk(Queue* const disk) -> Result<Null, IOError> {
     // We first write the tag bitmap. There will be no tags allocated yet.
     wnfs::TagBitmapBlock bitmap;
     bitmap.bitmap_bytes.fill(0_u8);
@@ -68,7 +69,7 @@ auto wnfs::format_disk(AHCIState* const disk) -> Result<Null, IOError> {
 
     // Done! We can now use this (for now, simple) filesystem.
 
-    return Result<Null, ahci::IOError>::Ok({});
+    return disk->flush();
 }
 
 auto wnfs::add_tag(INodeID inode_id,
@@ -79,7 +80,7 @@ auto wnfs::add_tag(INodeID inode_id,
     return wlib::Result<wlib::Null, wlib::ahci::IOError>::OkInPlace();
 }
 
-auto wnfs::get_file_sector(ahci::AHCIState* const disk, 
+auto wnfs::get_file_sector(Queue* const disk, 
                            Slice<u8>& buf, INodeID id) -> Result<u32, ahci::IOError> {
     if (buf.len() < SECTOR_SIZE) {
         return Result<u32, ahci::IOError>::Err(ahci::IOError::BufferTooSmall);
@@ -87,7 +88,7 @@ auto wnfs::get_file_sector(ahci::AHCIState* const disk,
 
     auto const sector = inode_sector(u32(id));
     
-    auto const result = disk->read(buf, sector * SECTOR_SIZE);
+    auto const result = disk->read(buf, sector * SECTOR_SIZE, Priority::High);
 
     if (result.is_err()) {
         return Result<u32, ahci::IOError>::Err(result.as_err());
@@ -96,11 +97,11 @@ auto wnfs::get_file_sector(ahci::AHCIState* const disk,
     return Result<u32, ahci::IOError>::Ok(inode_sector_offset(u32(id)));
 }
 
-auto wnfs::create_file(ahci::AHCIState* const, 
+auto wnfs::create_file(Queue* const disk, 
                        str const name) -> Result<INodeID, FileError> {
 
     // TODO: check the entire bitmap, not just the first sector (512 * 8 inodes)
-    auto maybe_bitmap = buf_cache.read_buf_sector(INODE_BITMAP_START_SECTOR);
+    auto maybe_bitmap = buf_cache.read_buf_sector(INODE_BITMAP_START_SECTOR, Priority::High);
 
     if (maybe_bitmap.is_err()) {
         return Result<INodeID, FileError>::ErrInPlace(FileError::DiskError);
@@ -121,7 +122,7 @@ auto wnfs::create_file(ahci::AHCIState* const,
 
                 auto const sector_num = inode_sector(inode_num);
 
-                auto maybe_inode_buf = buf_cache.read_buf_sector(sector_num);
+                auto maybe_inode_buf = buf_cache.read_buf_sector(sector_num, Priority::High);
 
                 if (maybe_inode_buf.is_err()) {
                     return Result<INodeID, FileError>::ErrInPlace(FileError::DiskError);
@@ -143,14 +144,18 @@ auto wnfs::create_file(ahci::AHCIState* const,
                 nodes[inode_offset].triple_indirect_block = 0;
                 nodes[inode_offset].set_name(name);
                 
-                if (buf_cache.flush(inode_buf.buf_num()).is_err()) {
+                // The inode has to be on disk, not just in the drive's cache, before the
+                // bitmap says it is in use
+                if (buf_cache.flush(inode_buf.buf_num(), Priority::High).is_err()
+                    || disk->flush().is_err()) {
                     return Result<INodeID, FileError>::ErrInPlace(FileError::DiskError);
                 }
 
                 // Only now should we try writing to the bitmap (atomic operation)
                 bitmap.write(i, bitmap_byte | u8(1_u8 << j));
 
-                if (buf_cache.flush(bitmap.buf_num()).is_err()) {
+                if (buf_cache.flush(bitmap.buf_num(), Priority::High).is_err()
+                    || disk->flush().is_err()) {
                     return Result<INodeID, FileError>::ErrInPlace(FileError::DiskError);
                 }
 
@@ -162,13 +167,13 @@ auto wnfs::create_file(ahci::AHCIState* const,
     return Result<INodeID, FileError>::Err(FileError::OutOfINodes);
 }
 
-auto wnfs::read_from_file(AHCIState* const,
+auto wnfs::read_from_file(Queue* const,
                          Slice<u8>& buffer,
                          INodeID inode_id, 
                          u32 const position) -> Result<u32, ReadError> {
     // TODO: change the buffer cache to be associated with the disk passed in
     auto inode_location = inode_sector(u32(inode_id));
-    auto const maybe_inode = buf_cache.read_buf_sector(inode_location);
+    auto const maybe_inode = buf_cache.read_buf_sector(inode_location, Priority::High);
 
     if (maybe_inode.is_err()) {
         return Result<u32, ReadError>::ErrInPlace(ReadError::DiskError);
@@ -228,12 +233,12 @@ auto wnfs::read_from_file(AHCIState* const,
     return Result<u32, ReadError>::OkInPlace(bytes_to_read);
 }
 
-auto wnfs::write_to_file(AHCIState* const disk,
+auto wnfs::write_to_file(Queue* const disk,
                          Slice<u8> const& buffer,
                          INodeID inode_id,
                          u32 const position) -> Result<u32, IOError> {
     auto inode_location = inode_sector(u32(inode_id));
-    auto maybe_inode = buf_cache.read_buf_sector(inode_location);
+    auto maybe_inode = buf_cache.read_buf_sector(inode_location, Priority::High);
 
     if (maybe_inode.is_err()) {
         return Result<u32, IOError>::ErrInPlace(IOError::DeviceError);
@@ -301,7 +306,14 @@ auto wnfs::write_to_file(AHCIState* const disk,
     }
 
     if (should_flush_inode) {
-        auto flush_res = buf_cache.flush(inode_sector.buf_num());
+        // The data goes to disk before the inode that points to it or covers it. The inode
+        // itself is only durable once the file is synced (see FileHandle::sync).
+        auto const barrier = disk->flush();
+        if (barrier.is_err()) {
+            return Result<u32, IOError>::ErrInPlace(barrier.as_err());
+        }
+
+        auto flush_res = buf_cache.flush(inode_sector.buf_num(), Priority::High);
         if (flush_res.is_err()) {
             return Result<u32, IOError>::ErrInPlace(flush_res.as_err());
         }
@@ -311,11 +323,11 @@ auto wnfs::write_to_file(AHCIState* const disk,
 }
 
 
-auto wnfs::allocate_sectors(AHCIState* const disk, u32 sectors) -> Result<u32, Null> {
+auto wnfs::allocate_sectors(Queue* const disk, u32 sectors) -> Result<u32, Null> {
     Array<u8, 512> bitmap_buffer;
     Slice bitmap_slice(bitmap_buffer);
 
-    auto const maybe_bitmap = disk->read(bitmap_slice, BLOCK_GROUP_START);
+    auto const maybe_bitmap = disk->read(bitmap_slice, BLOCK_GROUP_START, Priority::High);
 
     if (maybe_bitmap.is_err()) {
         return Result<u32, wlib::Null>::ErrInPlace();
@@ -369,7 +381,7 @@ auto wnfs::allocate_sectors(AHCIState* const disk, u32 sectors) -> Result<u32, N
         }
     }
 
-    if (disk->write(bitmap_slice, BLOCK_GROUP_START).is_err()) {
+    if (disk->write(bitmap_slice, BLOCK_GROUP_START, Priority::High).is_err()) {
         return Result<u32, Null>::ErrInPlace();
     }
 
@@ -378,7 +390,7 @@ auto wnfs::allocate_sectors(AHCIState* const disk, u32 sectors) -> Result<u32, N
 
 auto wnfs::vfs_metadata(u32 file_id) -> Result<file_metadata, MetadataError> {
     auto const inode_location = inode_sector(file_id);
-    auto const maybe_inode = buf_cache.read_buf_sector(inode_location);
+    auto const maybe_inode = buf_cache.read_buf_sector(inode_location, Priority::High);
 
     if (maybe_inode.is_err()) {
         return Result<file_metadata, MetadataError>::ErrInPlace(MetadataError::DiskError);
@@ -6,10 +6,11 @@
 #include "wnfs/inode.hh"
 #include "wnfs/tag_node.hh"
 #include "kernel/vfs/vfs.hh"
+#include "kernel/block_queue.hh"
 
 namespace wnfs {
 
-    auto format_disk(wlib::ahci::AHCIState* disk) -> wlib::Result<wlib::Null, wlib::ahci::IOError>;
+    auto format_disk(wlib::block::Queue* disk) -> wlib::Result<wlib::Null, wlib::ahci::IOError>;
 
     enum class FileError : u8 {
         DiskError,
@@ -22,31 +23,31 @@ namespace wnfs {
 
     // Creates a file/inode with the name `name` of size 0.
     // Returns the inode ID on success or an error code otherwise.
-    [[nodiscard]] auto create_file(wlib::ahci::AHCIState* disk, 
+    [[nodiscard]] auto create_file(wlib::block::Queue* disk, 
                                    wlib::str const name) -> wlib::Result<INodeID, FileError>;
 
 
     // Load the inode sector of the file with the inode id `id` into `buf`.
     // Returns the id's offset into the buffer if successful, else returns an error code.
-    [[nodiscard]] auto get_file_sector(wlib::ahci::AHCIState* disk, 
+    [[nodiscard]] auto get_file_sector(wlib::block::Queue* disk, 
                                        wlib::Slice<u8>& buf, 
                                        INodeID id) -> wlib::Result<u32, wlib::ahci::IOError>;
 
     // Allocate `amount` number of contiguous sectors. Returns the first sector where the sectors 
     // were allocated on success, or nothing on error.
-    [[nodiscard]] auto allocate_sectors(wlib::ahci::AHCIState* disk,
+    [[nodiscard]] auto allocate_sectors(wlib::block::Queue* disk,
                                         u32 amount) -> wlib::Result<u32, wlib::Null>;
 
     // Write to the file with id `inode_id`. 
     // Returns # of bytes written on success or an error code on error. 
-    [[nodiscard]] auto write_to_file(wlib::ahci::AHCIState* disk,
+    [[nodiscard]] auto write_to_file(wlib::block::Queue* disk,
                                      wlib::Slice<u8> const& buffer,
                                      INodeID inode_id,
                                      u32 position) -> wlib::Result<u32, wlib::ahci::IOError>;
 
     // Read from the file with id `inode_id`.
     // Returns # of bytes read on success or an error code on error.
-    [[nodiscard]] auto read_from_file(wlib::ahci::AHCIState* disk,
+    [[nodiscard]] auto read_from_file(wlib::block::Queue* disk,
                                       wlib::Slice<u8>& buffer,
                                       INodeID inode_id,
                                       u32 position) -> wlib::Result<u32, kernel::vfs::ReadError>;
@@ -106,6 +107,10 @@ namespace wnfs {
 
     u32 static constexpr BLOCK_START_SECTOR = BLOCKS_START / SECTOR_SIZE;
 
+    // One past the last sector the block group bitmap can hand out, so WNFS never uses
+    // anything from here on.
+    u32 static constexpr END_SECTOR = BLOCK_START_SECTOR + BLOCK_GROUP_BITMAP_SECTORS * SECTOR_SIZE * 8;
+
     [[nodiscard]] auto constexpr inode_sector(u32 inode_num) -> u32 {
         return inode_num / INODES_PER_SECTOR + INODES_START / SECTOR_SIZE;
     }